@@ -0,0 +1,324 @@
+#include "EmulatedFlash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+
+// ---------------------------------------------------------------------------
+// Partitions
+// ---------------------------------------------------------------------------
+EmulatedFlash& EmulatedFlash::instance() {
+  static EmulatedFlash flash;
+  return flash;
+}
+
+static std::string trim(const std::string& s) {
+  size_t first = s.find_first_not_of(" \t\r");
+  size_t last = s.find_last_not_of(" \t\r");
+  return (first == std::string::npos) ? "" : s.substr(first, last - first + 1);
+}
+
+static uint32_t parseSize(const std::string& s) {
+  char* end = nullptr;
+  uint32_t value = strtoul(s.c_str(), &end, 0);
+  if (end && (*end == 'K' || *end == 'k')) value *= 1024;
+  if (end && (*end == 'M' || *end == 'm')) value *= 1024 * 1024;
+  return value;
+}
+
+static esp_partition_subtype_t parseDataSubtype(const std::string& s) {
+  if (s == "ota") return 0x00;
+  if (s == "phy") return 0x01;
+  if (s == "nvs") return 0x02;
+  if (s == "coredump") return 0x03;
+  if (s == "nvs_keys") return 0x04;
+  if (s == "efuse") return 0x05;
+  return (esp_partition_subtype_t)strtoul(s.c_str(), nullptr, 0);
+}
+
+bool EmulatedFlash::loadPartitionTable(const char* path) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+
+  std::string line;
+  uint32_t nextOffset = 0x9000;
+  while (std::getline(in, line)) {
+    line = trim(line);
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::vector<std::string> fields;
+    std::stringstream ss(line);
+    std::string field;
+    while (std::getline(ss, field, ',')) {
+      fields.push_back(trim(field));
+    }
+    if (fields.size() < 5) {
+      continue;
+    }
+
+    uint32_t offset = fields[3].empty() ? nextOffset : parseSize(fields[3]);
+    uint32_t size = parseSize(fields[4]);
+    nextOffset = offset + size;
+    if (fields[1] == "data" && fields[2] != "ota" && fields[2] != "coredump") {
+      addPartition(fields[0].c_str(), parseDataSubtype(fields[2]), offset, size);
+    }
+  }
+  return true;
+}
+
+void EmulatedFlash::addPartition(const char* label, esp_partition_subtype_t subtype, uint32_t address, uint32_t size) {
+  Partition* p = new Partition();
+  p->info.type = ESP_PARTITION_TYPE_DATA;
+  p->info.subtype = subtype;
+  p->info.address = address;
+  p->info.size = size;
+  p->info.erase_size = SECTOR_SIZE;
+  snprintf(p->info.label, sizeof(p->info.label), "%s", label);
+  p->data.assign(size, 0xFF);
+  p->eraseCounts.assign(size / SECTOR_SIZE, 0);
+  mPartitions.push_back(p);
+
+  if (subtype == 0x02) {
+    mNvsPages.assign(size / SECTOR_SIZE, NvsPage());
+    mNvsActivePage = 0;
+  }
+}
+
+EmulatedFlash::Partition* EmulatedFlash::find(const char* label) {
+  for (Partition* p : mPartitions) {
+    if (strcmp(p->info.label, label) == 0) {
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+EmulatedFlash::Partition* EmulatedFlash::find(esp_partition_subtype_t subtype) {
+  for (Partition* p : mPartitions) {
+    if (p->info.subtype == subtype) {
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+std::vector<EmulatedFlash::Partition*> EmulatedFlash::partitions() {
+  return mPartitions;
+}
+
+void EmulatedFlash::addLogicalBytes(const char* label, uint64_t bytes) {
+  Partition* p = find(label);
+  if (p) {
+    p->logicalBytes += bytes;
+  }
+}
+
+static EmulatedFlash::Partition* fromInfo(const esp_partition_t* info) {
+  for (EmulatedFlash::Partition* p : EmulatedFlash::instance().partitions()) {
+    if (&p->info == info) {
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+// ---------------------------------------------------------------------------
+// esp_partition API
+// ---------------------------------------------------------------------------
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label) {
+  EmulatedFlash::Partition* p = label ? EmulatedFlash::instance().find(label) : EmulatedFlash::instance().find(subtype);
+  if (!p || p->info.type != type || p->info.subtype != subtype) {
+    return nullptr;
+  }
+  return &p->info;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size) {
+  EmulatedFlash::Partition* p = fromInfo(partition);
+  if (!p || src_offset + size > p->info.size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(dst, p->data.data() + src_offset, size);
+  p->bytesRead += size;
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset, const void* src, size_t size) {
+  EmulatedFlash::Partition* p = fromInfo(partition);
+  if (!p || dst_offset + size > p->info.size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  const uint8_t* bytes = (const uint8_t*)src;
+  bool overwrite = false;
+  for (size_t i = 0; i < size; i++) {
+    uint8_t& cell = p->data[dst_offset + i];
+    if (bytes[i] & ~cell) {
+      overwrite = true;
+    }
+    cell &= bytes[i];
+  }
+  p->bytesProgrammed += size;
+  if (overwrite) {
+    p->overwrites++;
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size) {
+  EmulatedFlash::Partition* p = fromInfo(partition);
+  if (!p || offset % EmulatedFlash::SECTOR_SIZE || size % EmulatedFlash::SECTOR_SIZE) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (offset + size > p->info.size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memset(p->data.data() + offset, 0xFF, size);
+  for (size_t sector = offset / EmulatedFlash::SECTOR_SIZE; sector < (offset + size) / EmulatedFlash::SECTOR_SIZE; sector++) {
+    p->eraseCounts[sector]++;
+  }
+  return ESP_OK;
+}
+
+/**
+ * The mapping is the emulated flash itself, so like on the chip writes and erases show up in it right away.
+ */
+esp_err_t esp_partition_mmap(const esp_partition_t* partition, size_t offset, size_t size,
+                             esp_partition_mmap_memory_t memory, const void** out_ptr, esp_partition_mmap_handle_t* out_handle) {
+  EmulatedFlash::Partition* p = fromInfo(partition);
+  if (!p || memory != ESP_PARTITION_MMAP_DATA || offset + size > p->info.size) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  *out_ptr = p->data.data() + offset;
+  *out_handle = 1;
+  return ESP_OK;
+}
+
+void esp_partition_munmap(esp_partition_mmap_handle_t) {
+}
+
+// ---------------------------------------------------------------------------
+// NVS model
+// ---------------------------------------------------------------------------
+EmulatedFlash::Partition* EmulatedFlash::nvsPartition() {
+  return find((esp_partition_subtype_t)0x02);
+}
+
+void EmulatedFlash::nvsPut(const std::string& ns, const std::string& key, const void* value, uint32_t len) {
+  Partition* nvs = nvsPartition();
+  if (!nvs || mNvsPages.empty()) {
+    return;
+  }
+  nvs->logicalBytes += len;
+
+  std::string id = ns + "/" + key;
+  const uint8_t* bytes = (const uint8_t*)value;
+  auto it = mNvsEntries.find(id);
+  if (it != mNvsEntries.end()) {
+    // NVS compares with the stored value first and skips the write if nothing changed.
+    if (it->second.value.size() == len && memcmp(it->second.value.data(), bytes, len) == 0) {
+      return;
+    }
+    mNvsPages[it->second.page].live -= it->second.entries;
+    nvs->bytesProgrammed += 1;  // Marking the old entries erased clears bits in the page's entry bitmap.
+  }
+
+  NvsEntry& entry = mNvsEntries[id];
+  entry.value.assign(bytes, bytes + len);
+  entry.page = UINT32_MAX;  // Not on any page until it's appended
+  entry.entries = 2 + (len + NVS_ENTRY_SIZE - 1) / NVS_ENTRY_SIZE;  // Blob index, data header and the data
+  nvsAppend(nvs, entry);
+}
+
+bool EmulatedFlash::nvsGet(const std::string& ns, const std::string& key, std::vector<uint8_t>& value) const {
+  auto it = mNvsEntries.find(ns + "/" + key);
+  if (it == mNvsEntries.end()) {
+    return false;
+  }
+  value = it->second.value;
+  return true;
+}
+
+void EmulatedFlash::nvsEraseNamespace(const std::string& ns) {
+  std::string prefix = ns + "/";
+  for (auto it = mNvsEntries.begin(); it != mNvsEntries.end();) {
+    if (it->first.compare(0, prefix.size(), prefix) == 0) {
+      mNvsPages[it->second.page].live -= it->second.entries;
+      it = mNvsEntries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void EmulatedFlash::nvsAppend(Partition* nvs, NvsEntry& entry) {
+  if (mNvsPages[mNvsActivePage].used + entry.entries > NVS_ENTRIES_PER_PAGE) {
+    nvsAdvancePage(nvs);
+  }
+  NvsPage& page = mNvsPages[mNvsActivePage];
+  entry.page = mNvsActivePage;
+  page.used += entry.entries;
+  page.live += entry.entries;
+  nvs->bytesProgrammed += entry.entries * NVS_ENTRY_SIZE;
+}
+
+void EmulatedFlash::nvsAdvancePage(Partition* nvs) {
+  for (uint32_t tries = 0; tries < mNvsPages.size(); tries++) {
+    mNvsActivePage = (mNvsActivePage + 1) % mNvsPages.size();
+    NvsPage& page = mNvsPages[mNvsActivePage];
+    if (page.used == 0) {
+      return;
+    }
+
+    // Garbage collect the page: erase it and write its live entries back.
+    nvs->eraseCounts[mNvsActivePage]++;
+    page.used = 0;
+    page.live = 0;
+    for (auto& it : mNvsEntries) {
+      if (it.second.page == mNvsActivePage) {
+        page.used += it.second.entries;
+        page.live += it.second.entries;
+        nvs->bytesProgrammed += it.second.entries * NVS_ENTRY_SIZE;
+      }
+    }
+    if (page.used < NVS_ENTRIES_PER_PAGE) {
+      return;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Preferences
+// ---------------------------------------------------------------------------
+#include <Preferences.h>
+
+bool Preferences::begin(const char* name, bool) {
+  mNamespace = name;
+  return true;
+}
+
+size_t Preferences::putBytes(const char* key, const void* value, size_t len) {
+  EmulatedFlash::instance().nvsPut(mNamespace, key, value, len);
+  return len;
+}
+
+size_t Preferences::getBytes(const char* key, void* buf, size_t maxLen) {
+  std::vector<uint8_t> value;
+  if (!EmulatedFlash::instance().nvsGet(mNamespace, key, value)) {
+    return 0;
+  }
+  if (value.size() > maxLen) {
+    return 0;
+  }
+  memcpy(buf, value.data(), value.size());
+  return value.size();
+}
+
+bool Preferences::clear() {
+  EmulatedFlash::instance().nvsEraseNamespace(mNamespace);
+  return true;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <esp_partition.h>
+
+/**
+ * NOR flash emulation with wear accounting, for running the firmware's storage classes on the host.
+ *
+ * Behaves like the ESP32's SPI flash: erasing works on whole 4KB sectors and sets every bit, programming can
+ * only clear bits (programming over data that isn't erased ANDs the two, like the real chip, and is counted as
+ * an overwrite so layout bugs show up). Every erase and every programmed byte is counted per partition.
+ *
+ * The NVS partition isn't driven through esp_partition_* by the firmware but through Preferences, so it gets
+ * a model of the NVS page allocator instead: 4KB pages of 126 32-byte entries, a blob costs an index entry,
+ * a data header entry and one entry per 32 bytes, values are appended to the active page and the page that's
+ * next in line is garbage collected (live entries moved, page erased) when the active page fills up. It
+ * doesn't reproduce NVS byte for byte, but the erase rate per write it gives is the one to expect.
+ */
+class EmulatedFlash {
+  public:
+    static constexpr uint32_t SECTOR_SIZE = 4096;
+
+    struct Partition {
+      esp_partition_t info;
+      std::vector<uint8_t> data;
+      std::vector<uint32_t> eraseCounts;  // Per sector
+      uint64_t bytesProgrammed = 0;
+      uint64_t bytesRead = 0;
+      uint64_t overwrites = 0;            // Programming operations that tried to set a bit back to 1
+      uint64_t logicalBytes = 0;          // What the workload asked to store, see addLogicalBytes()
+    };
+
+    static EmulatedFlash& instance();
+
+    /**
+     * Loads the data partitions of an ESP-IDF partitions.csv. Returns false if the file can't be read.
+     */
+    bool loadPartitionTable(const char* path);
+
+    void addPartition(const char* label, esp_partition_subtype_t subtype, uint32_t address, uint32_t size);
+
+    Partition* find(const char* label);
+    Partition* find(esp_partition_subtype_t subtype);
+    std::vector<Partition*> partitions();
+
+    /**
+     * Credits bytes the workload considers useful payload to a partition, write amplification is measured
+     * against them.
+     */
+    void addLogicalBytes(const char* label, uint64_t bytes);
+
+    // NVS model, used by the Preferences stub.
+    void nvsPut(const std::string& ns, const std::string& key, const void* value, uint32_t len);
+    bool nvsGet(const std::string& ns, const std::string& key, std::vector<uint8_t>& value) const;
+    void nvsEraseNamespace(const std::string& ns);
+
+  private:
+    static constexpr uint32_t NVS_ENTRY_SIZE = 32;
+    static constexpr uint32_t NVS_ENTRIES_PER_PAGE = 126;
+
+    struct NvsEntry {
+      std::vector<uint8_t> value;
+      uint32_t page = 0;
+      uint32_t entries = 0;
+    };
+
+    struct NvsPage {
+      uint32_t used = 0;  // Entries written since the last erase, live or not
+      uint32_t live = 0;
+    };
+
+    std::vector<Partition*> mPartitions;
+    std::map<std::string, NvsEntry> mNvsEntries;  // "<namespace>/<key>"
+    std::vector<NvsPage> mNvsPages;
+    uint32_t mNvsActivePage = 0;
+
+    Partition* nvsPartition();
+    void nvsAppend(Partition* nvs, NvsEntry& entry);
+    void nvsAdvancePage(Partition* nvs);
+};
@@ -0,0 +1,283 @@
+/**
+ * Round-trip test for the telemetry chunk codec (TelemetryCodec.h) and the varints under it (Varint.h).
+ *
+ * Encodes runs of samples into chunks, decodes them again and checks every sample comes back unchanged:
+ * steady pace, decreasing channels (negative deltas), every delta-of-delta bucket edge including the 32 bit
+ * escape and wraparound, chunks filled until add() refuses, and a long random series split over many chunks.
+ * Also checks that no chunk gets bigger than MAX_CHUNK_SIZE and that truncated chunks are rejected.
+ *
+ * Build and run with `make test`. Prints one line per case and exits non-zero if any of them failed.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <random>
+#include <vector>
+
+#include "TelemetryCodec.h"
+
+static uint32_t failures = 0;
+
+static void check(bool ok, const char* name) {
+  printf("%-48s %s\n", name, ok ? "ok" : "FAILED");
+  if (!ok) {
+    failures++;
+  }
+}
+
+static bool sameSample(const TelemetrySample& a, const TelemetrySample& b) {
+  return a.time == b.time && a.steps == b.steps && a.speed == b.speed && a.distance == b.distance;
+}
+
+static TelemetrySample sample(uint32_t time, uint32_t steps, uint32_t speed, uint32_t distance) {
+  TelemetrySample s;
+  s.time = time;
+  s.steps = steps;
+  s.speed = speed;
+  s.distance = distance;
+  return s;
+}
+
+/**
+ * Encodes samples into as many chunks as it takes and decodes them back. Returns false on any mismatch, any
+ * chunk over MAX_CHUNK_SIZE or any chunk that doesn't decode. chunks is set to the number of chunks used.
+ */
+static bool roundTrip(const std::vector<TelemetrySample>& samples, uint32_t key, uint32_t& chunks) {
+  TelemetryCodec::Encoder encoder;
+  std::vector<TelemetrySample> decoded;
+  uint8_t chunk[TelemetryCodec::MAX_CHUNK_SIZE];
+  TelemetrySample out[TelemetryCodec::MAX_SAMPLES_PER_CHUNK];
+  chunks = 0;
+
+  auto flush = [&]() {
+    uint32_t len = encoder.finish(chunk);
+    uint32_t chunkKey = 0;
+    uint32_t count = 0;
+    chunks++;
+    if (len > TelemetryCodec::MAX_CHUNK_SIZE || encoder.count() > TelemetryCodec::MAX_SAMPLES_PER_CHUNK) {
+      return false;
+    }
+    if (!TelemetryCodec::readKey(chunk, len, chunkKey) || chunkKey != key) {
+      return false;
+    }
+    if (!TelemetryCodec::decode(chunk, len, chunkKey, out, count) || chunkKey != key || count != encoder.count()) {
+      return false;
+    }
+    decoded.insert(decoded.end(), out, out + count);
+    return true;
+  };
+
+  encoder.reset(key);
+  for (const TelemetrySample& s : samples) {
+    if (!encoder.add(s)) {
+      if (!flush()) {
+        return false;
+      }
+      encoder.reset(key);
+      if (!encoder.add(s)) {
+        return false;  // The first sample of a chunk always fits
+      }
+    }
+  }
+  if (encoder.count() > 0 && !flush()) {
+    return false;
+  }
+
+  if (decoded.size() != samples.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < samples.size(); i++) {
+    if (!sameSample(decoded[i], samples[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Cases
+// ---------------------------------------------------------------------------
+static void testVarints() {
+  static const int32_t signedValues[] = { 0, -1, 1, -2, 63, -64, 64, -65, 8191, -8192, INT32_MAX, INT32_MIN };
+  bool ok = true;
+  for (int32_t v : signedValues) {
+    uint8_t buf[Varint::MAX_SIZE];
+    uint32_t len = Varint::put(buf, Varint::zigzag(v));
+    uint32_t pos = 0;
+    uint32_t raw = 0;
+    ok = ok && len <= Varint::MAX_SIZE && Varint::get(buf, len, pos, raw) && pos == len && Varint::unzigzag(raw) == v;
+    // Small magnitudes of either sign must stay small, that's the point of the zigzag mapping
+    if (v >= -64 && v <= 63) {
+      ok = ok && len == 1;
+    }
+  }
+  check(ok, "zigzag varints, negative values");
+
+  uint8_t buf[Varint::MAX_SIZE];
+  uint32_t len = Varint::put(buf, UINT32_MAX);
+  uint32_t pos = 0;
+  uint32_t raw = 0;
+  check(len == Varint::MAX_SIZE && !Varint::get(buf, len - 1, pos, raw), "truncated varint is rejected");
+}
+
+static void testSingleSample() {
+  uint32_t chunks = 0;
+  std::vector<TelemetrySample> samples = { sample(1700000000, 0, 0, 0) };
+  check(roundTrip(samples, 1700000000, chunks) && chunks == 1, "single sample chunk");
+}
+
+static void testSteadyPace() {
+  std::vector<TelemetrySample> samples;
+  for (uint32_t i = 0; i < 3600; i++) {
+    samples.push_back(sample(1700000000 + i, i * 2 + (i % 3 == 0), 350, i + i / 4));
+  }
+  uint32_t chunks = 0;
+  bool ok = roundTrip(samples, 1700000000, chunks);
+  // ~10 bits a sample, see the TelemetryCodec doc, so an hour should take ~5KB worth of chunks
+  check(ok && chunks * TelemetryCodec::MAX_CHUNK_SIZE < 8 * 1024, "steady pace, an hour at 1Hz");
+}
+
+static void testNegativeDeltas() {
+  // Slowing down to a stop and the counters going backwards, as after a treadmill reset mid session
+  std::vector<TelemetrySample> samples;
+  uint32_t speed = 800;
+  uint32_t steps = 5000;
+  uint32_t distance = 4000;
+  for (uint32_t i = 0; i < 600; i++) {
+    samples.push_back(sample(1700000000 + i, steps, speed, distance));
+    speed = speed >= 3 ? speed - 3 : 0;
+    steps = steps >= 7 ? steps - (i % 7) : 0;
+    distance = i == 300 ? 0 : distance + 1;
+  }
+  uint32_t chunks = 0;
+  check(roundTrip(samples, 1700000000, chunks), "negative deltas");
+}
+
+static void testBucketEdges() {
+  // Deltas of delta right at and just past the edge of every bucket, in both directions
+  static const int32_t dods[] = { 0, 3, -4, 4, -5, 63, -64, 64, -65, 2047, -2048, 2048, -2049,
+                                  INT32_MAX, INT32_MIN, 1, -1 };
+  std::vector<TelemetrySample> samples;
+  uint32_t value = 1u << 31;
+  int32_t delta = 0;
+  samples.push_back(sample(value, value, value, value));
+  for (int32_t dod : dods) {
+    delta = (int32_t)((uint32_t)delta + (uint32_t)dod);
+    value += (uint32_t)delta;
+    samples.push_back(sample(value, value, value, value));
+  }
+  uint32_t chunks = 0;
+  check(roundTrip(samples, 0, chunks), "every dod bucket edge and the 32 bit escape");
+
+  // Counters wrapping around zero in both directions
+  samples.clear();
+  samples.push_back(sample(0, UINT32_MAX - 2, 2, 0));
+  samples.push_back(sample(UINT32_MAX, UINT32_MAX, 0, UINT32_MAX));
+  samples.push_back(sample(0, 1, UINT32_MAX, 0));
+  samples.push_back(sample(UINT32_MAX, 4, UINT32_MAX - 4, 1u << 31));
+  check(roundTrip(samples, UINT32_MAX, chunks), "wraparound at 0 and UINT32_MAX");
+}
+
+static void testFullChunk() {
+  TelemetryCodec::Encoder encoder;
+  uint8_t chunk[TelemetryCodec::MAX_CHUNK_SIZE];
+  TelemetrySample out[TelemetryCodec::MAX_SAMPLES_PER_CHUNK];
+
+  // Worst case, every channel takes the 32 bit escape on every sample
+  encoder.reset(UINT32_MAX);
+  uint32_t i = 0;
+  while (encoder.add(sample(i & 1 ? 0 : UINT32_MAX, i & 1 ? UINT32_MAX : 0, i & 1 ? 0 : UINT32_MAX,
+                            i & 1 ? UINT32_MAX : 0))) {
+    i++;
+  }
+  uint32_t len = encoder.finish(chunk);
+  uint32_t key = 0;
+  uint32_t count = 0;
+  bool ok = len <= TelemetryCodec::MAX_CHUNK_SIZE && encoder.count() == i && i > 1 &&
+            TelemetryCodec::decode(chunk, len, key, out, count) && key == UINT32_MAX && count == i;
+  printf("  worst case: %u samples, %u of %u bytes\n", i, len, TelemetryCodec::MAX_CHUNK_SIZE);
+  check(ok, "chunk full of 32 bit escapes fits MAX_CHUNK_SIZE");
+
+  // Best case, nothing changes, stops at the worst case reserve and still fits
+  encoder.reset(UINT32_MAX);
+  TelemetrySample still = sample(UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX);
+  while (encoder.add(still)) {
+  }
+  len = encoder.finish(chunk);
+  ok = len <= TelemetryCodec::MAX_CHUNK_SIZE && encoder.count() <= TelemetryCodec::MAX_SAMPLES_PER_CHUNK &&
+       TelemetryCodec::decode(chunk, len, key, out, count) && count == encoder.count();
+  for (uint32_t n = 0; ok && n < count; n++) {
+    ok = sameSample(out[n], still);
+  }
+  printf("  best case: %u samples, %u of %u bytes\n", encoder.count(), len, TelemetryCodec::MAX_CHUNK_SIZE);
+  check(ok, "chunk full of repeats fits MAX_CHUNK_SIZE");
+
+  // A sample refused by a full chunk starts the next one after reset()
+  ok = !encoder.add(still);
+  encoder.reset(7);
+  ok = ok && encoder.add(still) && encoder.count() == 1 && encoder.key() == 7;
+  len = encoder.finish(chunk);
+  ok = ok && TelemetryCodec::decode(chunk, len, key, out, count) && key == 7 && count == 1 && sameSample(out[0], still);
+  check(ok, "refused sample starts the next chunk");
+}
+
+static void testTruncated() {
+  TelemetryCodec::Encoder encoder;
+  encoder.reset(1700000000);
+  for (uint32_t i = 0; i < 100; i++) {
+    encoder.add(sample(1700000000 + i, i * 2, 350 - i, i));
+  }
+  uint8_t chunk[TelemetryCodec::MAX_CHUNK_SIZE];
+  TelemetrySample out[TelemetryCodec::MAX_SAMPLES_PER_CHUNK];
+  uint32_t len = encoder.finish(chunk);
+  uint32_t key = 0;
+  uint32_t count = 0;
+  bool ok = TelemetryCodec::decode(chunk, len, key, out, count);
+  for (uint32_t cut = 1; ok && cut < len; cut++) {
+    ok = !TelemetryCodec::decode(chunk, len - cut, key, out, count);
+  }
+  check(ok, "truncated chunks are rejected");
+}
+
+static void testRandomSeries() {
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<int32_t> small(-3, 3);
+  std::uniform_int_distribution<int32_t> jump(-100000, 100000);
+  std::uniform_int_distribution<uint32_t> pick(0, 99);
+  bool ok = true;
+  uint32_t totalChunks = 0;
+  for (uint32_t series = 0; ok && series < 50; series++) {
+    std::vector<TelemetrySample> samples;
+    TelemetrySample s = sample(1700000000 + series * 86400, 0, 300, 0);
+    for (uint32_t i = 0; i < 2000; i++) {
+      samples.push_back(s);
+      s.time += 1 + (pick(rng) == 0);
+      s.steps += 2 + small(rng);
+      s.speed += pick(rng) < 5 ? jump(rng) : small(rng);
+      s.distance += pick(rng) < 2 ? jump(rng) : 1 + (pick(rng) < 25);
+    }
+    uint32_t chunks = 0;
+    ok = roundTrip(samples, samples[0].time, chunks);
+    totalChunks += chunks;
+  }
+  printf("  %u chunks\n", totalChunks);
+  check(ok, "random series over many chunks");
+}
+
+int main() {
+  testVarints();
+  testSingleSample();
+  testSteadyPace();
+  testNegativeDeltas();
+  testBucketEdges();
+  testFullChunk();
+  testTruncated();
+  testRandomSeries();
+
+  if (failures > 0) {
+    printf("%u case(s) FAILED\n", failures);
+    return 1;
+  }
+  printf("All cases passed\n");
+  return 0;
+}
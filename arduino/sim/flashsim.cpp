@@ -0,0 +1,472 @@
+/**
+ * Flash endurance simulator.
+ *
+ * Runs the firmware's real storage classes (SessionStore, SessionCheckpoint, TelemetryRecorder, DailyRollups)
+ * against an emulated NOR flash laid out by partitions.csv, replays a workload of sessions, syncs and WiFi
+ * credential rewrites, and reports how often every sector got erased, the write amplification of each
+ * partition and how long the worst sector would last at that rate.
+ *
+ * The workload is either synthetic (see the options below) or replayed from a file with one event per line:
+ *   <unix time> session <duration secs> <steps>
+ *   <unix time> sync
+ *   <unix time> wifi
+ * Lines starting with # are ignored.
+ *
+ * Build and run with `make run`, or `./flashsim --help` for the options.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "EmulatedFlash.h"
+#include "SessionStore.h"
+#include "SessionCheckpoint.h"
+#include "TelemetryRecorder.h"
+#include "DailyRollups.h"
+
+DebugWrapper Debug;
+
+// ---------------------------------------------------------------------------
+// Options
+// ---------------------------------------------------------------------------
+struct Options {
+  const char* partitions = "../src/partitions.csv";
+  const char* replay = nullptr;
+  const char* csv = nullptr;
+  uint32_t days = 365;
+  double sessionsPerDay = 10;
+  double sessionMinutes = 30;
+  double stepsPerMinute = 100;
+  double syncsPerDay = 1;
+  double wifiWritesPerMonth = 1;
+  uint32_t rebootEveryDays = 7;
+  uint32_t checkpointSecs = 60;     // CHECKPOINT_INTERVAL_MS in treadspan.ino
+  uint32_t checkpointSteps = 250;   // CHECKPOINT_STEPS in treadspan.ino
+  bool telemetry = true;
+  bool foldWhenFull = true;         // FOLD_OLD_SESSIONS_WHEN_FULL in treadspan.ino
+  uint32_t endurance = 100000;      // Erase cycles per sector the flash is rated for
+  uint32_t seed = 1;
+};
+
+static void printUsage() {
+  printf("Usage: flashsim [options]\n"
+         "  --partitions FILE          Partition table to lay out the flash (default ../src/partitions.csv)\n"
+         "  --replay FILE              Replay a recorded workload instead of generating one\n"
+         "  --days N                   Days to simulate (default 365)\n"
+         "  --sessions-per-day N       Walking sessions per day (default 10)\n"
+         "  --session-minutes N        Average session length (default 30)\n"
+         "  --steps-per-minute N       Average pace (default 100)\n"
+         "  --syncs-per-day N          Syncs with the mobile app per day (default 1)\n"
+         "  --wifi-writes-per-month N  saveWiFiCredentials() calls per month (default 1)\n"
+         "  --reboot-every-days N      Reboot (rescan storage) this often, 0 never (default 7)\n"
+         "  --checkpoint-secs N        Session checkpoint interval (default 60)\n"
+         "  --checkpoint-steps N       Session checkpoint every N steps (default 250)\n"
+         "  --no-telemetry             Don't record session telemetry\n"
+         "  --keep-oldest              Refuse new sessions when the journal is full instead of folding old ones\n"
+         "  --endurance N              Rated erase cycles per sector (default 100000)\n"
+         "  --seed N                   Seed of the synthetic workload (default 1)\n"
+         "  --csv FILE                 Also write partition,sector,erases for every sector to FILE\n");
+}
+
+static bool parseOptions(int argc, char** argv, Options& opt) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+    bool usesValue = true;
+    if (!strcmp(arg, "--no-telemetry")) { opt.telemetry = false; usesValue = false; }
+    else if (!strcmp(arg, "--keep-oldest")) { opt.foldWhenFull = false; usesValue = false; }
+    else if (!strcmp(arg, "--help") || !strcmp(arg, "-h")) { return false; }
+    else if (!value) { fprintf(stderr, "Missing value for %s\n", arg); return false; }
+    else if (!strcmp(arg, "--partitions")) opt.partitions = value;
+    else if (!strcmp(arg, "--replay")) opt.replay = value;
+    else if (!strcmp(arg, "--csv")) opt.csv = value;
+    else if (!strcmp(arg, "--days")) opt.days = atoi(value);
+    else if (!strcmp(arg, "--sessions-per-day")) opt.sessionsPerDay = atof(value);
+    else if (!strcmp(arg, "--session-minutes")) opt.sessionMinutes = atof(value);
+    else if (!strcmp(arg, "--steps-per-minute")) opt.stepsPerMinute = atof(value);
+    else if (!strcmp(arg, "--syncs-per-day")) opt.syncsPerDay = atof(value);
+    else if (!strcmp(arg, "--wifi-writes-per-month")) opt.wifiWritesPerMonth = atof(value);
+    else if (!strcmp(arg, "--reboot-every-days")) opt.rebootEveryDays = atoi(value);
+    else if (!strcmp(arg, "--checkpoint-secs")) opt.checkpointSecs = atoi(value);
+    else if (!strcmp(arg, "--checkpoint-steps")) opt.checkpointSteps = atoi(value);
+    else if (!strcmp(arg, "--endurance")) opt.endurance = atoi(value);
+    else if (!strcmp(arg, "--seed")) opt.seed = atoi(value);
+    else { fprintf(stderr, "Unknown option %s\n", arg); return false; }
+    if (usesValue) i++;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Workload
+// ---------------------------------------------------------------------------
+enum EventType { EVENT_SESSION, EVENT_SYNC, EVENT_WIFI };
+
+struct Event {
+  uint32_t time = 0;
+  EventType type = EVENT_SESSION;
+  uint32_t duration = 0;
+  uint32_t steps = 0;
+};
+
+static const uint32_t SIM_EPOCH = 1735718400;  // 2025-01-01 08:00 UTC, midnight in Pacific time
+static const uint32_t SECS_PER_DAY = 24 * 60 * 60;
+
+static std::vector<Event> generateWorkload(const Options& opt) {
+  std::vector<Event> events;
+  std::mt19937 rng(opt.seed);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+  // Sessions spread over 08:00 to 20:00, syncs spread over the whole day starting in the evening.
+  const uint32_t walkingWindow = 12 * 60 * 60;
+  double sessionCarry = 0;
+  double syncCarry = 0;
+  for (uint32_t day = 0; day < opt.days; day++) {
+    uint32_t dayStart = SIM_EPOCH + day * SECS_PER_DAY;
+
+    sessionCarry += opt.sessionsPerDay;
+    uint32_t sessions = (uint32_t)sessionCarry;
+    sessionCarry -= sessions;
+    for (uint32_t i = 0; i < sessions; i++) {
+      uint32_t slot = walkingWindow / sessions;
+      Event e;
+      e.type = EVENT_SESSION;
+      e.duration = (uint32_t)(opt.sessionMinutes * 60 * (0.7 + 0.6 * unit(rng)));
+      e.duration = std::max<uint32_t>(60, std::min(e.duration, slot - 60));
+      e.steps = (uint32_t)(e.duration / 60.0 * opt.stepsPerMinute * (0.9 + 0.2 * unit(rng)));
+      e.time = dayStart + 8 * 60 * 60 + i * slot + (uint32_t)((slot - e.duration) * unit(rng));
+      events.push_back(e);
+    }
+
+    syncCarry += opt.syncsPerDay;
+    uint32_t syncs = (uint32_t)syncCarry;
+    syncCarry -= syncs;
+    for (uint32_t i = 0; i < syncs; i++) {
+      Event e;
+      e.type = EVENT_SYNC;
+      e.time = dayStart + (21 * 60 * 60 + i * SECS_PER_DAY / syncs) % SECS_PER_DAY;
+      events.push_back(e);
+    }
+  }
+
+  if (opt.wifiWritesPerMonth > 0) {
+    double interval = 30.0 * SECS_PER_DAY / opt.wifiWritesPerMonth;
+    for (double t = interval / 2; t < (double)opt.days * SECS_PER_DAY; t += interval) {
+      Event e;
+      e.type = EVENT_WIFI;
+      e.time = SIM_EPOCH + (uint32_t)t;
+      events.push_back(e);
+    }
+  }
+
+  std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) { return a.time < b.time; });
+  return events;
+}
+
+static bool loadWorkload(const char* path, std::vector<Event>& events) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::stringstream ss(line);
+    std::string type;
+    Event e;
+    ss >> e.time >> type;
+    if (type == "session") {
+      e.type = EVENT_SESSION;
+      ss >> e.duration >> e.steps;
+    } else if (type == "sync") {
+      e.type = EVENT_SYNC;
+    } else if (type == "wifi") {
+      e.type = EVENT_WIFI;
+    } else {
+      fprintf(stderr, "Skipping unknown event: %s\n", line.c_str());
+      continue;
+    }
+    events.push_back(e);
+  }
+  std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) { return a.time < b.time; });
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Device
+// ---------------------------------------------------------------------------
+/**
+ * The storage side of the firmware, recreated on every simulated reboot so the boot scans run too.
+ */
+struct Device {
+  SessionStore sessionStore;
+  SessionCheckpoint sessionCheckpoint;
+  TelemetryRecorder telemetryRecorder;
+  DailyRollups dailyRollups;
+
+  void begin(const Options& opt) {
+    dailyRollups.begin();
+    sessionStore.begin();
+    if (opt.foldWhenFull) {
+      sessionStore.setRetentionPolicy(SessionStore::RETENTION_FOLD_INTO_DAYS, DailyRollups::dayNumber);
+    }
+    sessionCheckpoint.begin();
+    if (opt.telemetry) {
+      telemetryRecorder.begin();
+    }
+  }
+};
+
+struct Totals {
+  uint32_t sessions = 0;
+  uint32_t syncs = 0;
+  uint32_t wifiWrites = 0;
+  uint32_t reboots = 0;
+  uint32_t failedAppends = 0;
+  uint32_t pending = 0;
+};
+
+static void setClock(uint32_t now, uint32_t simStart) {
+  SimClock::millisRef() = (unsigned long)(now - simStart) * 1000UL;
+}
+
+/**
+ * Walks through a session second by second the way the firmware's loop() would.
+ */
+static void runSession(Device& dev, const Options& opt, const Event& e, uint32_t simStart, Totals& totals) {
+  EmulatedFlash& flash = EmulatedFlash::instance();
+  TreadmillSession session;
+  session.start = e.time;
+  if (opt.telemetry) {
+    dev.telemetryRecorder.startSeries(session.start);
+  }
+
+  uint32_t lastCheckpointTime = e.time;
+  uint32_t lastCheckpointSteps = 0;
+  for (uint32_t s = 1; s <= e.duration; s++) {
+    uint32_t now = e.time + s;
+    setClock(now, simStart);
+    session.steps = (uint32_t)((uint64_t)e.steps * s / e.duration);
+    session.distanceMeters = session.steps * 7 / 10;
+    session.activeSecs = s;
+    session.calories = session.steps / 25;
+
+    if (opt.telemetry) {
+      TelemetrySample sample;
+      sample.time = now;
+      sample.steps = session.steps;
+      sample.speed = (uint32_t)(opt.stepsPerMinute * 0.042 * 100);  // ~0.7m per step, in 0.01 km/h
+      sample.distance = session.distanceMeters;
+      dev.telemetryRecorder.sample(sample);
+      flash.addLogicalBytes("telemetry", sizeof(TelemetrySample));
+    }
+
+    if (now - lastCheckpointTime >= opt.checkpointSecs || session.steps >= lastCheckpointSteps + opt.checkpointSteps) {
+      lastCheckpointTime = now;
+      lastCheckpointSteps = session.steps;
+      dev.sessionCheckpoint.save(session, now);
+      flash.addLogicalBytes("checkpoint", sizeof(TreadmillSession));
+    }
+    dev.sessionStore.compactStep();
+  }
+
+  session.stop = e.time + e.duration;
+  if (opt.telemetry) {
+    dev.telemetryRecorder.finishSeries();
+  }
+  if (!dev.sessionStore.append(session)) {
+    totals.failedAppends++;
+  }
+  flash.addLogicalBytes("sessions", sizeof(TreadmillSession));
+  dev.dailyRollups.addSession(DailyRollups::dayNumber(session.start), session.steps, session.activeSecs);
+  dev.sessionCheckpoint.clear();
+  totals.sessions++;
+}
+
+/**
+ * What saveWiFiCredentials() does: the EEPROM library commits its whole 512 byte buffer as one NVS blob.
+ */
+static void rewriteWiFiCredentials(uint32_t n) {
+  uint8_t eeprom[512];
+  memset(eeprom, 0, sizeof(eeprom));
+  snprintf((char*)eeprom, 32, "network-%u", n);
+  Preferences prefs;
+  prefs.begin("eeprom", false);
+  prefs.putBytes("eeprom", eeprom, sizeof(eeprom));
+}
+
+// ---------------------------------------------------------------------------
+// Report
+// ---------------------------------------------------------------------------
+static void printReport(const Options& opt, double days, const Totals& totals) {
+  printf("Simulated %.1f days: %u sessions, %u syncs, %u WiFi credential writes, %u reboots",
+         days, totals.sessions, totals.syncs, totals.wifiWrites, totals.reboots);
+  if (totals.failedAppends) {
+    printf(", %u sessions NOT stored", totals.failedAppends);
+  }
+  printf(", %u unsynced at the end", totals.pending);
+  printf("\n\n");
+
+  printf("%-11s %7s %9s %22s %12s %12s %7s %16s\n", "partition", "sectors", "erases", "per sector min/avg/max",
+         "programmed", "logical", "WA", "worst sector");
+  double worstYears = -1;
+  const char* worstPartition = "";
+  for (EmulatedFlash::Partition* p : EmulatedFlash::instance().partitions()) {
+    uint64_t total = 0;
+    uint32_t minErases = UINT32_MAX;
+    uint32_t maxErases = 0;
+    for (uint32_t count : p->eraseCounts) {
+      total += count;
+      minErases = std::min(minErases, count);
+      maxErases = std::max(maxErases, count);
+    }
+    double avg = p->eraseCounts.empty() ? 0 : (double)total / p->eraseCounts.size();
+
+    char wa[16] = "-";
+    if (p->logicalBytes) {
+      snprintf(wa, sizeof(wa), "%.2f", (double)p->bytesProgrammed / p->logicalBytes);
+    }
+    char lifetime[32] = "no erases";
+    if (maxErases) {
+      double years = opt.endurance / (maxErases / days) / 365.25;
+      snprintf(lifetime, sizeof(lifetime), "%.0f years", years);
+      if (worstYears < 0 || years < worstYears) {
+        worstYears = years;
+        worstPartition = p->info.label;
+      }
+    }
+    char perSector[32];
+    snprintf(perSector, sizeof(perSector), "%u/%.1f/%u", minErases, avg, maxErases);
+    printf("%-11s %7zu %9llu %22s %12llu %12llu %7s %16s\n", p->info.label, p->eraseCounts.size(),
+           (unsigned long long)total, perSector, (unsigned long long)p->bytesProgrammed,
+           (unsigned long long)p->logicalBytes, wa, lifetime);
+    if (p->overwrites) {
+      printf("  WARNING: %llu writes to '%s' programmed over data that wasn't erased\n",
+             (unsigned long long)p->overwrites, p->info.label);
+    }
+  }
+
+  printf("\nErases per sector:\n");
+  for (EmulatedFlash::Partition* p : EmulatedFlash::instance().partitions()) {
+    printf("  %s", p->info.label);
+    for (size_t i = 0; i < p->eraseCounts.size(); i++) {
+      printf((i % 16 == 0) ? "\n    %5u" : " %5u", p->eraseCounts[i]);
+    }
+    printf("\n");
+  }
+
+  printf("\nWA = bytes programmed / bytes of payload the workload stored. Lifetime assumes %u erase cycles.\n",
+         opt.endurance);
+  if (worstYears >= 0) {
+    printf("Projected flash lifetime: %.0f years, limited by '%s'.\n", worstYears, worstPartition);
+  } else {
+    printf("Projected flash lifetime: no sector was erased.\n");
+  }
+}
+
+static bool writeCsv(const char* path) {
+  FILE* f = fopen(path, "w");
+  if (!f) {
+    return false;
+  }
+  fprintf(f, "partition,sector,erases\n");
+  for (EmulatedFlash::Partition* p : EmulatedFlash::instance().partitions()) {
+    for (size_t i = 0; i < p->eraseCounts.size(); i++) {
+      fprintf(f, "%s,%zu,%u\n", p->info.label, i, p->eraseCounts[i]);
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Main
+// ---------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  Options opt;
+  if (!parseOptions(argc, argv, opt)) {
+    printUsage();
+    return 1;
+  }
+
+  // Days are counted in the same time zone the firmware uses.
+  setenv("TZ", "PST8PDT", 1);
+  tzset();
+
+  EmulatedFlash& flash = EmulatedFlash::instance();
+  if (!flash.loadPartitionTable(opt.partitions)) {
+    fprintf(stderr, "Can't read partition table %s\n", opt.partitions);
+    return 1;
+  }
+
+  std::vector<Event> events;
+  if (opt.replay) {
+    if (!loadWorkload(opt.replay, events)) {
+      fprintf(stderr, "Can't read workload %s\n", opt.replay);
+      return 1;
+    }
+  } else {
+    events = generateWorkload(opt);
+  }
+  if (events.empty()) {
+    fprintf(stderr, "The workload is empty\n");
+    return 1;
+  }
+
+  uint32_t simStart = events.front().time;
+  uint32_t simEnd = simStart;
+  uint32_t lastBoot = simStart;
+  Totals totals;
+  setClock(simStart, simStart);
+  std::unique_ptr<Device> dev(new Device());
+  dev->begin(opt);
+
+  for (const Event& e : events) {
+    setClock(e.time, simStart);
+    if (opt.rebootEveryDays && e.time - lastBoot >= opt.rebootEveryDays * SECS_PER_DAY) {
+      dev.reset(new Device());
+      dev->begin(opt);
+      lastBoot = e.time;
+      totals.reboots++;
+    }
+
+    switch (e.type) {
+      case EVENT_SESSION:
+        if (e.duration == 0) {
+          break;
+        }
+        runSession(*dev, opt, e, simStart, totals);
+        break;
+      case EVENT_SYNC:
+        // The firmware doesn't compact while the app is connected, give it the idle time before the sync.
+        while (dev->sessionStore.compactStep()) {}
+        if (dev->sessionStore.pendingCount() > 0) {
+          dev->sessionStore.acknowledge(dev->sessionStore.nextSeq() - 1);
+        }
+        totals.syncs++;
+        break;
+      case EVENT_WIFI:
+        rewriteWiFiCredentials(totals.wifiWrites++);
+        break;
+    }
+    simEnd = std::max(simEnd, e.time + e.duration);
+  }
+
+  totals.pending = dev->sessionStore.pendingCount();
+  double days = std::max(1.0, (double)(simEnd - simStart) / SECS_PER_DAY);
+  printReport(opt, days, totals);
+  if (opt.csv && !writeCsv(opt.csv)) {
+    fprintf(stderr, "Can't write %s\n", opt.csv);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+// Just enough of the Arduino core to compile the storage classes on the host.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+
+typedef uint8_t byte;
+
+/**
+ * Simulated clock, the simulator advances it instead of waiting.
+ */
+namespace SimClock {
+  inline unsigned long& millisRef() {
+    static unsigned long ms = 0;
+    return ms;
+  }
+}
+
+inline unsigned long millis() {
+  return SimClock::millisRef();
+}
+
+class String {
+  public:
+    String() {}
+    String(const char* s) : mValue(s) {}
+    const char* c_str() const { return mValue.c_str(); }
+
+  private:
+    std::string mValue;
+};
+
+class HardwareSerial {
+  public:
+    void begin(unsigned long) {}
+    size_t print(const char* s) { return ::fputs(s, stderr) < 0 ? 0 : strlen(s); }
+    size_t println(const char* s) { return print(s) + print("\n"); }
+    size_t println() { return print("\n"); }
+    template<typename T> size_t print(const T&) { return 0; }
+    template<typename T> size_t println(const T&) { return print("\n"); }
+    int printf(const char* format, ...) {
+      va_list args;
+      va_start(args, format);
+      int ret = vfprintf(stderr, format, args);
+      va_end(args);
+      return ret;
+    }
+    size_t write(const uint8_t*, size_t size) { return size; }
+    size_t write(uint8_t) { return 1; }
+};
+
+inline HardwareSerial Serial;
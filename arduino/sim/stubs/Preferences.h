@@ -0,0 +1,19 @@
+#pragma once
+
+// Host version of the Arduino Preferences library, every put goes through the NVS wear model of EmulatedFlash.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+class Preferences {
+  public:
+    bool begin(const char* name, bool readOnly = false);
+    void end() {}
+    size_t putBytes(const char* key, const void* value, size_t len);
+    size_t getBytes(const char* key, void* buf, size_t maxLen);
+    bool clear();
+
+  private:
+    std::string mNamespace;
+};
@@ -0,0 +1,7 @@
+#pragma once
+
+// The simulator mirrors the ESP-IDF 5 API.
+
+#define ESP_IDF_VERSION_MAJOR 5
+#define ESP_IDF_VERSION_MINOR 1
+#define ESP_IDF_VERSION_PATCH 0
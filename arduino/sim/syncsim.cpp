@@ -0,0 +1,600 @@
+/**
+ * Session sync simulator and throughput benchmark.
+ *
+ * Runs the firmware's real sync code (SessionSync, SyncResumeTable, SessionStore on the emulated flash) against
+ * a scripted virtual app that behaves like SyncView.swift, over a simulated BLE link. The glue between them,
+ * what ConfirmCallback, indicateNextSession() and the time characteristics do in treadspan.ino, is mirrored in
+ * SimDevice below since the sketch itself needs NimBLE.
+ *
+ * The link is modeled per connection event: every interval the device sends up to --packets-per-event link
+ * layer packets and the app gets one write with response through (iOS waits for the response before the next
+ * one). Notifications are split into link layer packets by the data length (27 bytes, or 251 with --dle), the
+ * controller holds --buffers of them and notify() fails once they're taken, like BLE_HS_ENOMEM on the device.
+ * --loss drops whole notifications (the stop-and-wait formats only recover by reconnecting, see SessionSync),
+ * --latency delays every app reaction.
+ *
+ * For every store size and sync format it reports the time from connecting to the last session being
+ * acknowledged, sessions per second and the round trips (app writes) it took. After that it checks that an app
+ * whose cursor is from before a compaction gets every step exactly once, day summaries included.
+ *
+ * Build and run with `make bench`, or `./syncsim --help` for the options.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "EmulatedFlash.h"
+#include "SessionStore.h"
+#include "SessionSync.h"
+
+DebugWrapper Debug;
+
+// ---------------------------------------------------------------------------
+// Options
+// ---------------------------------------------------------------------------
+struct Options {
+  const char* partitions = "../src/partitions.csv";
+  std::vector<uint32_t> sizes = { 10, 100, 1000, 10000 };
+  std::vector<uint32_t> formats = { 0, 1, 2, 3 };
+  double intervalMs = 30;        // iOS picks 30ms unless asked otherwise
+  uint32_t mtu = 185;            // What iOS negotiates
+  bool dle = true;               // Data length extension, 251 byte link layer payloads instead of 27
+  uint32_t packetsPerEvent = 6;  // Link layer packets the device gets out per connection event
+  uint32_t buffers = 12;         // Link layer packets the controller can hold
+  double latencyMs = 5;          // App reaction time to a notification
+  double loss = 0;               // Probability a notification is lost
+  double timeoutSecs = 3600;
+  uint32_t seed = 1;
+};
+
+static void printUsage() {
+  printf("Usage: syncsim [options]\n"
+         "  --partitions FILE        Partition table to lay out the flash (default ../src/partitions.csv)\n"
+         "  --sizes N,N,...          Unsynced sessions in the store (default 10,100,1000,10000)\n"
+         "  --formats N,N,...        Sync formats to run, 0 legacy to 3 cursors (default 0,1,2,3)\n"
+         "  --interval MS            Connection interval (default 30)\n"
+         "  --mtu N                  ATT MTU (default 185)\n"
+         "  --no-dle                 27 byte link layer packets instead of 251\n"
+         "  --packets-per-event N    Link layer packets per connection event (default 6)\n"
+         "  --buffers N              Link layer packets the controller can queue (default 12)\n"
+         "  --latency MS             App reaction time (default 5)\n"
+         "  --loss P                 Probability a notification is lost, 0..1 (default 0)\n"
+         "  --timeout SECS           Give up on a sync after this long (default 3600)\n"
+         "  --seed N                 Seed of the loss (default 1)\n");
+}
+
+static std::vector<uint32_t> parseList(const char* value) {
+  std::vector<uint32_t> list;
+  std::stringstream ss(value);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    list.push_back(strtoul(item.c_str(), nullptr, 0));
+  }
+  return list;
+}
+
+static bool parseOptions(int argc, char** argv, Options& opt) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+    bool usesValue = true;
+    if (!strcmp(arg, "--no-dle")) { opt.dle = false; usesValue = false; }
+    else if (!strcmp(arg, "--help") || !strcmp(arg, "-h")) { return false; }
+    else if (!value) { fprintf(stderr, "Missing value for %s\n", arg); return false; }
+    else if (!strcmp(arg, "--partitions")) opt.partitions = value;
+    else if (!strcmp(arg, "--sizes")) opt.sizes = parseList(value);
+    else if (!strcmp(arg, "--formats")) opt.formats = parseList(value);
+    else if (!strcmp(arg, "--interval")) opt.intervalMs = atof(value);
+    else if (!strcmp(arg, "--mtu")) opt.mtu = atoi(value);
+    else if (!strcmp(arg, "--packets-per-event")) opt.packetsPerEvent = atoi(value);
+    else if (!strcmp(arg, "--buffers")) opt.buffers = atoi(value);
+    else if (!strcmp(arg, "--latency")) opt.latencyMs = atof(value);
+    else if (!strcmp(arg, "--loss")) opt.loss = atof(value);
+    else if (!strcmp(arg, "--timeout")) opt.timeoutSecs = atof(value);
+    else if (!strcmp(arg, "--seed")) opt.seed = atoi(value);
+    else { fprintf(stderr, "Unknown option %s\n", arg); return false; }
+    if (usesValue) i++;
+  }
+  for (uint32_t format : opt.formats) {
+    if (format > SessionSync::FORMAT_VERSION) {
+      fprintf(stderr, "Unknown sync format %u\n", format);
+      return false;
+    }
+  }
+  if (opt.mtu < 23 || opt.mtu > 517 || opt.packetsPerEvent == 0 || opt.buffers == 0 || opt.intervalMs <= 0) {
+    fprintf(stderr, "Link parameters out of range\n");
+    return false;
+  }
+  return true;
+}
+
+static uint32_t readUint32(const uint8_t* in) {
+  return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+static void writeUint32(uint8_t* out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+// ---------------------------------------------------------------------------
+// Link
+// ---------------------------------------------------------------------------
+typedef std::vector<uint8_t> Bytes;
+
+/**
+ * The device's end of the link, what notify() on the data characteristic does.
+ */
+class SimLink : public SyncTransport {
+  public:
+    SimLink(const Options& opt) : mOpt(opt) {}
+
+    bool send(const uint8_t* data, size_t len) override {
+      uint32_t packets = linkPackets(len);
+      if (len > mOpt.mtu - 3u || mQueuedPackets + packets > mOpt.buffers) {
+        return false;
+      }
+      mQueue.push_back(Bytes(data, data + len));
+      mQueuedPackets += packets;
+      notifications++;
+      return true;
+    }
+
+    /**
+     * One connection event: the notifications whose last link layer packet fits. What doesn't is sent partially
+     * and finishes in a later event.
+     */
+    std::vector<Bytes> connectionEvent() {
+      std::vector<Bytes> delivered;
+      uint32_t budget = mOpt.packetsPerEvent;
+      while (budget > 0 && !mQueue.empty()) {
+        uint32_t left = linkPackets(mQueue.front().size()) - mFrontSent;
+        uint32_t now = (left < budget) ? left : budget;
+        budget -= now;
+        mFrontSent += now;
+        mQueuedPackets -= now;
+        if (mFrontSent == linkPackets(mQueue.front().size())) {
+          delivered.push_back(mQueue.front());
+          mQueue.pop_front();
+          mFrontSent = 0;
+        }
+      }
+      return delivered;
+    }
+
+    uint32_t notifications = 0;
+
+  private:
+    const Options& mOpt;
+    std::deque<Bytes> mQueue;
+    uint32_t mQueuedPackets = 0;
+    uint32_t mFrontSent = 0;  // Link layer packets of the front notification already sent
+
+    uint32_t linkPackets(size_t len) const {
+      uint32_t payload = mOpt.dle ? 251 : 27;
+      uint32_t pdu = len + 3 + 4;  // ATT opcode and handle, L2CAP header
+      return (pdu + payload - 1) / payload;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Device
+// ---------------------------------------------------------------------------
+/**
+ * The sync server side of treadspan.ino for one connection, see ConfirmCallback, indicateNextSession() and the
+ * time characteristics there. Flash writes run inline, the storage task would do them between two connection
+ * events anyway.
+ */
+class SimDevice {
+  public:
+    SimDevice(SessionStore& store, SimLink& link) : mStore(store), mLink(link), mSync(store, mResume) {}
+
+    void onConnect(uint16_t mtu) {
+      mSync.reset();
+      mSync.setMtu(mtu);
+      mSubscribed = false;
+      mHaveNotifiedOfFirstSession = false;
+    }
+
+    void onSubscribe() {
+      mSubscribed = true;
+    }
+
+    uint32_t onTimeRead() {
+      return mTime;
+    }
+
+    void onTimeWrite(const Bytes& value) {
+      if (value.size() == 4) {
+        mTime = readUint32(value.data());
+      }
+    }
+
+    void onConfirmWrite(const Bytes& value) {
+      const uint8_t* data = value.data();
+      if (value.size() >= 2 && data[0] == SessionSync::HELLO) {
+        uint32_t durableSeq = mSync.handleHello(data, value.size());
+        if (durableSeq) {
+          mStore.acknowledge(durableSeq);
+        }
+        if (mHaveNotifiedOfFirstSession) {
+          mSync.start();
+          indicateNextSession();
+        }
+      } else if (value.size() >= 5 && data[0] == SessionSync::DURABLE_ACK) {
+        uint32_t durableSeq = SessionSync::parseDurableAck(data, value.size());
+        mStore.acknowledge(durableSeq);
+        mSync.handleDurableAck(durableSeq);
+      } else if (value.size() >= 2 && data[0] == SessionSync::ACK) {
+        if (mSync.handleAck(data, value.size())) {
+          indicateNextSession();
+        }
+      } else if (value.size() > 0 && data[0] == SessionSync::CONFIRM) {
+        if (mSync.handleConfirm()) {
+          indicateNextSession();
+        }
+      }
+    }
+
+    void loop() {
+      if (mSubscribed && !mHaveNotifiedOfFirstSession) {
+        mHaveNotifiedOfFirstSession = true;
+        mSync.start();
+        indicateNextSession();
+      }
+      if (mSync.isActive()) {
+        indicateNextSession();
+      }
+    }
+
+    void onDisconnect() {
+      mSync.reset();
+    }
+
+  private:
+    SessionStore& mStore;
+    SimLink& mLink;
+    SyncResumeTable mResume;
+    SessionSync mSync;
+    bool mSubscribed = false;
+    bool mHaveNotifiedOfFirstSession = false;
+    uint32_t mTime = 0;
+
+    void indicateNextSession() {
+      uint32_t ackSeq = 0;
+      bool done = mSync.pump(mLink, millis(), ackSeq);
+      if (done && ackSeq) {
+        mStore.acknowledge(ackSeq);
+      }
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Virtual app
+// ---------------------------------------------------------------------------
+/**
+ * What SyncView.swift does, for one sync format: read and set the time, say hello, subscribe, confirm or ack
+ * every notification and acknowledge durably at the end.
+ */
+class VirtualApp {
+  public:
+    enum WriteTarget { TIME_READ, TIME_WRITE, CONFIRM, SUBSCRIBE };
+
+    struct Write {
+      WriteTarget target;
+      Bytes value;
+      double readyAt;
+    };
+
+    VirtualApp(uint32_t format, double latencyMs, uint32_t cursor = 0)
+        : mFormat(format), mLatencyMs(latencyMs), mCursor(cursor) {}
+
+    void connect(double now) {
+      mWrites.push_back({ TIME_READ, Bytes(), now });
+      Bytes time(4);
+      writeUint32(time.data(), 1735718400);
+      mWrites.push_back({ TIME_WRITE, time, now });
+      if (mFormat >= SessionSync::FORMAT_BATCHED) {
+        Bytes hello = { SessionSync::HELLO, (uint8_t)mFormat };
+        if (mFormat >= SessionSync::FORMAT_CURSORS) {
+          hello.resize(10);
+          writeUint32(hello.data() + 2, mCursor);     // Everything up to here is stored on the phone
+          writeUint32(hello.data() + 6, 0x5EED1234);  // Sync token
+        }
+        mWrites.push_back({ CONFIRM, hello, now });
+      }
+      mWrites.push_back({ SUBSCRIBE, Bytes(), now });
+    }
+
+    void onNotify(const Bytes& data, double now) {
+      double at = now + mLatencyMs;
+      if (data[0] == SessionSync::DONE_MARKER) {
+        if (mDone) {
+          duplicates++;  // Resent before the disconnect or durable ack got through, the app ignores it
+          return;
+        }
+        mDone = true;
+        if (data.size() >= 5) {
+          mWrites.push_back({ CONFIRM, { SessionSync::DURABLE_ACK, data[1], data[2], data[3], data[4] }, at });
+        }
+        return;
+      }
+      if (data[0] != SessionSync::BATCH_MARKER) {
+        sessions.push_back(readUint32(data.data()));  // Legacy record, kept as it comes like the app does
+        mWrites.push_back({ CONFIRM, { SessionSync::CONFIRM }, at });
+        return;
+      }
+
+      uint32_t version = data[1];
+      uint32_t count = data[2];
+      uint32_t headerSize = (version >= 2) ? 4 : 3;
+      uint32_t recordSize = (version >= 3) ? 16 : 12;
+      if (version >= 2) {
+        uint8_t seq = data[3];
+        uint8_t ahead = seq - mAckedBatchSeq;
+        if (ahead < 1 || ahead >= 128 || mBatchesAhead.count(seq)) {
+          duplicates++;
+          ackBatches(at);
+          return;
+        }
+        mBatchesAhead.insert(seq);
+      }
+      for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* record = data.data() + headerSize + i * recordSize;
+        // Version 3 skips the seqs it has, they can come again across a reconnect or out of order after a
+        // retransmission. Everything before is kept as it comes.
+        if (version >= 3 && !mSessionSeqs.insert(readUint32(record)).second) {
+          continue;
+        }
+        sessions.push_back(readUint32(record + recordSize - 12));
+        steps += readUint32(record + recordSize - 4);
+      }
+      if (version >= 2) {
+        ackBatches(at);
+      } else {
+        mWrites.push_back({ CONFIRM, { SessionSync::CONFIRM }, at });
+      }
+    }
+
+    /**
+     * The next write that's ready to go out, writes with response go one at a time.
+     */
+    bool nextWrite(double now, Write& write) {
+      if (mWrites.empty() || mWrites.front().readyAt > now) {
+        return false;
+      }
+      write = mWrites.front();
+      mWrites.pop_front();
+      writes++;
+      return true;
+    }
+
+    bool isDone() const {
+      return mDone && mWrites.empty();
+    }
+
+    std::vector<uint32_t> sessions;  // Start times, in the order the app stored them
+    uint64_t steps = 0;              // Of the batched sessions
+    uint32_t writes = 0;
+    uint32_t duplicates = 0;
+
+  private:
+    uint32_t mFormat;
+    double mLatencyMs;
+    uint32_t mCursor;
+    std::deque<Write> mWrites;
+    std::set<uint8_t> mBatchesAhead;
+    std::set<uint32_t> mSessionSeqs;
+    uint8_t mAckedBatchSeq = 0;
+    bool mDone = false;
+
+    void ackBatches(double at) {
+      while (mBatchesAhead.count((uint8_t)(mAckedBatchSeq + 1))) {
+        mAckedBatchSeq++;
+        mBatchesAhead.erase(mAckedBatchSeq);
+      }
+      uint8_t bitmap = 0;
+      for (int i = 0; i < 8; i++) {
+        if (mBatchesAhead.count((uint8_t)(mAckedBatchSeq + 1 + i))) {
+          bitmap |= 1 << i;
+        }
+      }
+      mWrites.push_back({ CONFIRM, { SessionSync::ACK, mAckedBatchSeq, bitmap }, at });
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Benchmark
+// ---------------------------------------------------------------------------
+struct Result {
+  bool complete = false;
+  double secs = 0;
+  uint32_t received = 0;
+  uint32_t notifications = 0;
+  uint32_t lost = 0;
+  uint32_t duplicates = 0;
+  uint32_t roundTrips = 0;
+  uint32_t pendingAfter = 0;
+  uint64_t steps = 0;
+};
+
+static TreadmillSession sessionNumber(uint32_t i) {
+  TreadmillSession s;
+  s.start = 1735718400 + i * 3600;
+  s.stop = s.start + 1800;
+  s.steps = 3000 + i % 1000;
+  return s;
+}
+
+static bool eraseStore(SessionStore& store) {
+  const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)0x40, "sessions");
+  return partition && esp_partition_erase_range(partition, 0, partition->size) == ESP_OK && store.begin();
+}
+
+static bool fillStore(SessionStore& store, uint32_t sessions) {
+  if (!eraseStore(store)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < sessions; i++) {
+    if (!store.append(sessionNumber(i))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static Result runSync(const Options& opt, SessionStore& store, uint32_t format, std::mt19937& rng, uint32_t cursor = 0) {
+  SimLink link(opt);
+  SimDevice device(store, link);
+  VirtualApp app(format, opt.latencyMs, cursor);
+  std::uniform_real_distribution<double> chance(0, 1);
+  Result result;
+
+  double now = 0;
+  SimClock::millisRef() = 0;
+  device.onConnect(opt.mtu);
+  app.connect(now);
+
+  uint32_t initialPending = store.pendingCount();
+  while (now < opt.timeoutSecs * 1000) {
+    now += opt.intervalMs;
+    SimClock::millisRef() = (unsigned long)now;
+
+    // Device to app.
+    for (const Bytes& notification : link.connectionEvent()) {
+      if (opt.loss > 0 && chance(rng) < opt.loss) {
+        result.lost++;
+        continue;
+      }
+      app.onNotify(notification, now);
+    }
+
+    // App to device, one write with response per connection event.
+    VirtualApp::Write write;
+    if (app.nextWrite(now, write)) {
+      switch (write.target) {
+        case VirtualApp::TIME_READ: device.onTimeRead(); break;
+        case VirtualApp::TIME_WRITE: device.onTimeWrite(write.value); break;
+        case VirtualApp::CONFIRM: device.onConfirmWrite(write.value); break;
+        case VirtualApp::SUBSCRIBE: device.onSubscribe(); break;
+      }
+    }
+
+    device.loop();
+    // The app disconnects once it has the done marker and its last write went out.
+    if (app.isDone()) {
+      device.onDisconnect();
+      result.complete = store.pendingCount() == 0;
+      break;
+    }
+  }
+
+  result.secs = now / 1000;
+  result.received = app.sessions.size();
+  uint32_t distinct = std::set<uint32_t>(app.sessions.begin(), app.sessions.end()).size();
+  result.notifications = link.notifications;
+  result.duplicates = app.duplicates;
+  result.roundTrips = app.writes;
+  result.pendingAfter = store.pendingCount();
+  result.steps = app.steps;
+  result.complete = result.complete && result.received == initialPending && distinct == initialPending;
+  return result;
+}
+
+// ---------------------------------------------------------------------------
+// Cursor sync after compaction
+// ---------------------------------------------------------------------------
+static uint32_t dayOf(time_t t) {
+  return (uint32_t)(t / 86400);
+}
+
+/**
+ * A phone syncs durably, then the treadmill records far more sessions than the journal holds, so compaction
+ * folds the oldest into day summaries while the originals stay readable. The phone comes back with its cursor and
+ * has to end up with every step since then exactly once.
+ */
+static bool runCompactionCheck(const Options& opt, std::mt19937& rng) {
+  SessionStore store;
+  if (!eraseStore(store)) {
+    return false;
+  }
+  store.setRetentionPolicy(SessionStore::RETENTION_FOLD_INTO_DAYS, dayOf);
+
+  const uint32_t synced = 100;
+  const uint32_t total = store.capacity() * 3 / 2;
+  uint64_t expectedSteps = 0;
+  for (uint32_t i = 0; i < total; i++) {
+    TreadmillSession s = sessionNumber(i);
+    if (!store.append(s)) {
+      fprintf(stderr, "Journal full after %u sessions\n", i);
+      return false;
+    }
+    if (i + 1 == synced) {
+      store.acknowledge(store.nextSeq() - 1);  // The phone's durable ack
+    } else if (i + 1 > synced) {
+      expectedSteps += s.steps;
+    }
+    while (store.compactStep()) {
+    }
+  }
+
+  Result r = runSync(opt, store, SessionSync::FORMAT_CURSORS, rng, synced);
+  printf("\nCursor sync after compaction: %u sessions recorded, folded through session %u, the phone had %u.\n"
+         "  %u sessions received, %llu of %llu steps  %s\n",
+         total, store.foldSeq(), synced, r.received, (unsigned long long)r.steps, (unsigned long long)expectedSteps,
+         (r.steps == expectedSteps) ? "ok" : (r.steps > expectedSteps ? "COUNTED TWICE" : "MISSING"));
+  return r.steps == expectedSteps;
+}
+
+// ---------------------------------------------------------------------------
+// Main
+// ---------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  Options opt;
+  if (!parseOptions(argc, argv, opt)) {
+    printUsage();
+    return 1;
+  }
+  if (!EmulatedFlash::instance().loadPartitionTable(opt.partitions)) {
+    fprintf(stderr, "Can't read partition table %s\n", opt.partitions);
+    return 1;
+  }
+
+  printf("Link: %.2fms interval, MTU %u, %u byte link layer packets, %u packets per event, %u buffers, "
+         "%.0fms app latency, %.1f%% loss\n\n",
+         opt.intervalMs, opt.mtu, opt.dle ? 251 : 27, opt.packetsPerEvent, opt.buffers, opt.latencyMs, opt.loss * 100);
+  printf("%-6s %8s %10s %12s %13s %11s %6s %11s  %s\n", "format", "sessions", "time (s)", "sessions/s",
+         "notifications", "round trips", "lost", "duplicates", "result");
+
+  std::mt19937 rng(opt.seed);
+  bool allComplete = true;
+  for (uint32_t size : opt.sizes) {
+    for (uint32_t format : opt.formats) {
+      SessionStore store;
+      if (!fillStore(store, size)) {
+        fprintf(stderr, "Couldn't store %u sessions\n", size);
+        return 1;
+      }
+      Result r = runSync(opt, store, format, rng);
+      allComplete = allComplete && r.complete;
+      const char* outcome = r.complete ? "ok" : (r.secs * 1000 >= opt.timeoutSecs * 1000 ? "TIMEOUT" : "INCOMPLETE");
+      printf("%-6u %8u %10.2f %12.1f %13u %11u %6u %11u  %s", format, size, r.secs, r.received / r.secs,
+             r.notifications, r.roundTrips, r.lost, r.duplicates, outcome);
+      if (!r.complete) {
+        printf(", %u received, %u still pending", r.received, r.pendingAfter);
+      }
+      printf("\n");
+    }
+  }
+  allComplete = runCompactionCheck(opt, rng) && allComplete;
+  return allComplete ? 0 : 2;
+}
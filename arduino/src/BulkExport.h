@@ -0,0 +1,172 @@
+#pragma once
+
+#include <Arduino.h>
+#include "globals.h"
+#include "SessionStore.h"
+#include "TelemetryRecorder.h"
+
+/**
+ * Streams the whole session journal, and optionally the telemetry series of every session, as one framed byte
+ * stream. It's meant for an L2CAP connection-oriented channel (see L2CAP_EXPORT_ENABLED in treadspan.ino), which
+ * has credit based flow control and isn't limited to one attribute value per connection event like notifications.
+ * It only reads, the app acknowledges what it stored through the confirm characteristic like after a GATT sync.
+ *
+ * The app opens the channel and writes a request:
+ *   [REQUEST_EXPORT][from seq u32][flags]  with flags bit 0 asking for telemetry, from seq 0 for everything
+ * and then reads frames, [type][payload length u16][payload], all big-endian:
+ *   FRAME_SESSIONS   up to SESSIONS_PER_FRAME records [seq][start][stop][steps][distance][calories][active secs]
+ *   FRAME_TELEMETRY  [session start u32][chunk] with one chunk of the series (see TelemetryCodec.h)
+ *   FRAME_END        [last seq u32], the export is complete
+ * Telemetry follows once all the sessions went out. A frame can span several SDUs of the channel.
+ */
+class BulkExport {
+  public:
+    static constexpr uint8_t REQUEST_EXPORT = 0x01;
+    static constexpr uint8_t FLAG_TELEMETRY = 0x01;
+
+    static constexpr uint8_t FRAME_SESSIONS = 0x10;
+    static constexpr uint8_t FRAME_TELEMETRY = 0x11;
+    static constexpr uint8_t FRAME_END = 0x7F;
+
+    static constexpr uint32_t FRAME_HEADER_SIZE = 3;
+    static constexpr uint32_t RECORD_SIZE = 28;
+    static constexpr uint32_t SESSIONS_PER_FRAME = 16;
+    static constexpr uint32_t MAX_FRAME_SIZE = FRAME_HEADER_SIZE + SESSIONS_PER_FRAME * RECORD_SIZE;
+    static_assert(MAX_FRAME_SIZE >= FRAME_HEADER_SIZE + 4 + TelemetryCodec::MAX_CHUNK_SIZE, "Telemetry frames must fit");
+
+    /**
+     * The telemetry recorder is optional, without one requests for telemetry only get the sessions.
+     */
+    BulkExport(SessionStore& store, TelemetryRecorder* telemetry) : mStore(store), mTelemetry(telemetry) {}
+
+    /**
+     * Starts an export for a request the app wrote. Returns false if it's malformed.
+     */
+    bool handleRequest(const uint8_t* data, size_t len) {
+      if (len < 5 || data[0] != REQUEST_EXPORT) {
+        return false;
+      }
+      uint32_t from = readUint32(data + 1);
+      mWithTelemetry = mTelemetry && len >= 6 && (data[5] & FLAG_TELEMETRY);
+      mFirstSeq = (from > mStore.oldestStoredSeq()) ? from : mStore.oldestStoredSeq();
+      mEndSeq = mStore.nextSeq();  // Sessions recorded during the export are left for the next one
+      mNextSeq = mFirstSeq;
+      mState = SESSIONS;
+      mTelemetrySeq = 0;
+      Debug.printf("Bulk export of sessions %u to %u%s\n", mFirstSeq, mEndSeq - 1, mWithTelemetry ? " with telemetry" : "");
+      return true;
+    }
+
+    void cancel() {
+      mState = IDLE;
+    }
+
+    bool isRunning() const {
+      return mState != IDLE;
+    }
+
+    /**
+     * Writes the next frame into out (MAX_FRAME_SIZE bytes) and returns its length. Returns 0 when a call only
+     * skipped ahead (a session without telemetry), the export is over once isRunning() is false. Call it with the
+     * storage lock held. If the channel didn't take the frame, send the same bytes again.
+     */
+    uint32_t nextFrame(uint8_t* out) {
+      switch (mState) {
+        case SESSIONS:
+          return nextSessionsFrame(out);
+        case TELEMETRY:
+          return nextTelemetryFrame(out);
+        case END:
+          mState = IDLE;
+          writeUint32(out + FRAME_HEADER_SIZE, mEndSeq - 1);
+          return writeHeader(out, FRAME_END, 4);
+        default:
+          return 0;
+      }
+    }
+
+  private:
+    enum State : uint8_t { IDLE, SESSIONS, TELEMETRY, END };
+
+    SessionStore& mStore;
+    TelemetryRecorder* mTelemetry;
+    State mState = IDLE;
+    bool mWithTelemetry = false;
+    uint32_t mFirstSeq = 0;
+    uint32_t mEndSeq = 0;
+    uint32_t mNextSeq = 0;       // Next session to send, or whose series to send
+    uint32_t mTelemetrySeq = 0;  // Session whose series is being read, 0 if none
+    TelemetryRecorder::ReadCursor mCursor;
+
+    uint32_t nextSessionsFrame(uint8_t* out) {
+      uint8_t* records = out + FRAME_HEADER_SIZE;
+      uint32_t count = 0;
+      while (count < SESSIONS_PER_FRAME && mNextSeq < mEndSeq) {
+        TreadmillSession s;
+        if (mStore.read(mNextSeq, s)) {
+          encodeRecord(mNextSeq, s, records + count * RECORD_SIZE);
+          count++;
+        }
+        mNextSeq++;
+      }
+      if (mNextSeq >= mEndSeq) {
+        mState = mWithTelemetry ? TELEMETRY : END;
+        mNextSeq = mFirstSeq;
+      }
+      return (count == 0) ? 0 : writeHeader(out, FRAME_SESSIONS, count * RECORD_SIZE);
+    }
+
+    /**
+     * Looking for a series reads the whole telemetry partition, so it's one session per call at most.
+     */
+    uint32_t nextTelemetryFrame(uint8_t* out) {
+      if (mNextSeq >= mEndSeq) {
+        mState = END;
+        return 0;
+      }
+      if (mTelemetrySeq != mNextSeq) {
+        TreadmillSession s;
+        if (!mStore.read(mNextSeq, s)) {
+          mNextSeq++;
+          return 0;
+        }
+        mTelemetry->beginRead(s.start, mCursor);
+        mTelemetrySeq = mNextSeq;
+      }
+      uint32_t len = mTelemetry->readNextChunk(mCursor, out + FRAME_HEADER_SIZE + 4);
+      if (len == 0) {
+        mNextSeq++;
+        return 0;
+      }
+      writeUint32(out + FRAME_HEADER_SIZE, mCursor.key);
+      return writeHeader(out, FRAME_TELEMETRY, 4 + len);
+    }
+
+    static uint32_t writeHeader(uint8_t* out, uint8_t type, uint32_t payloadLen) {
+      out[0] = type;
+      out[1] = payloadLen >> 8;
+      out[2] = payloadLen;
+      return FRAME_HEADER_SIZE + payloadLen;
+    }
+
+    static void encodeRecord(uint32_t seq, const TreadmillSession& s, uint8_t* p) {
+      writeUint32(p, seq);
+      writeUint32(p + 4, s.start);
+      writeUint32(p + 8, s.stop);
+      writeUint32(p + 12, s.steps);
+      writeUint32(p + 16, s.distanceMeters);
+      writeUint32(p + 20, s.calories);
+      writeUint32(p + 24, s.activeSecs);
+    }
+
+    static void writeUint32(uint8_t* out, uint32_t value) {
+      out[0] = value >> 24;
+      out[1] = value >> 16;
+      out[2] = value >> 8;
+      out[3] = value;
+    }
+
+    static uint32_t readUint32(const uint8_t* in) {
+      return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+    }
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * CRC-16/CCITT-FALSE, used to detect torn or corrupted records in the flash logs.
+ */
+inline uint16_t crc16(const uint8_t* data, uint32_t len) {
+  uint16_t crc = 0xFFFF;
+  for (uint32_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+  }
+  return crc;
+}
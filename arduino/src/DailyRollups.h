@@ -0,0 +1,117 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "globals.h"
+
+/**
+ * Totals of one local calendar day.
+ */
+struct DailyRollup {
+  uint32_t day = 0;         // Days since 1970-01-01 in local time
+  uint32_t steps = 0;
+  uint32_t activeSecs = 0;
+  uint16_t sessions = 0;
+  uint16_t reserved = 0;
+};
+
+/**
+ * Per day step totals, persisted in NVS so "Steps Today" survives a reboot and the mobile app can fetch history per
+ * day instead of per session.
+ *
+ * Each day lives under its own key, "d<day % DAYS_KEPT>", so the table is a ring of the last DAYS_KEPT days that
+ * never grows and updating a day rewrites one small blob (NVS does its own wear leveling). The day currently being
+ * added to is cached in RAM, so getting today's total doesn't touch flash.
+ */
+class DailyRollups {
+  public:
+    static constexpr uint32_t DAYS_KEPT = 120;
+
+    void begin() {
+      mPrefs.begin(NVS_NAMESPACE, false);
+    }
+
+    /**
+     * Adds a finished session to the totals of its day.
+     */
+    void addSession(uint32_t day, uint32_t steps, uint32_t activeSecs) {
+      DailyRollup& rollup = load(day);
+      rollup.steps += steps;
+      rollup.activeSecs += activeSecs;
+      rollup.sessions++;
+
+      char key[8];
+      keyFor(day, key);
+      if (mPrefs.putBytes(key, &rollup, sizeof(rollup)) != sizeof(rollup)) {
+        Debug.printf("ERROR: Failed to save the rollup of day %u\n", day);
+      }
+    }
+
+    /**
+     * Totals of the given day, all zero if nothing was recorded that day (or it's older than DAYS_KEPT).
+     */
+    DailyRollup get(uint32_t day) {
+      return load(day);
+    }
+
+    /**
+     * Like get() but leaves the cached day alone, for walking through the history.
+     */
+    DailyRollup peek(uint32_t day) {
+      if (mCacheValid && mCached.day == day) {
+        return mCached;
+      }
+      return readSlot(day);
+    }
+
+    /**
+     * Days since 1970-01-01 of a unix time, in the local time zone.
+     */
+    static uint32_t dayNumber(time_t t) {
+      struct tm timeinfo;
+      localtime_r(&t, &timeinfo);
+
+      // Days from civil, see http://howardhinnant.github.io/date_algorithms.html
+      int32_t y = timeinfo.tm_year + 1900;
+      uint32_t m = timeinfo.tm_mon + 1;
+      uint32_t d = timeinfo.tm_mday;
+      y -= m <= 2;
+      int32_t era = (y >= 0 ? y : y - 399) / 400;
+      uint32_t yoe = (uint32_t)(y - era * 400);
+      uint32_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+      uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+      return (uint32_t)(era * 146097 + (int32_t)doe - 719468);
+    }
+
+  private:
+    static constexpr const char* NVS_NAMESPACE = "rollups";
+
+    Preferences mPrefs;
+    DailyRollup mCached;
+    bool mCacheValid = false;
+
+    DailyRollup& load(uint32_t day) {
+      if (mCacheValid && mCached.day == day) {
+        return mCached;
+      }
+      mCached = readSlot(day);
+      mCacheValid = true;
+      return mCached;
+    }
+
+    DailyRollup readSlot(uint32_t day) {
+      char key[8];
+      keyFor(day, key);
+      DailyRollup stored;
+      // The slot may hold a day from a previous trip around the ring, that counts as empty.
+      if (mPrefs.getBytes(key, &stored, sizeof(stored)) != sizeof(stored) || stored.day != day) {
+        stored = DailyRollup();
+        stored.day = day;
+      }
+      return stored;
+    }
+
+    static void keyFor(uint32_t day, char* key) {
+      snprintf(key, 8, "d%u", (unsigned)(day % DAYS_KEPT));
+    }
+};
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <Arduino.h>
+#include <NimBLEDevice.h>
+#include <Preferences.h>
+#include "globals.h"
+
+#if defined(CONFIG_NIMBLE_CPP_IDF)
+  #include "host/ble_hs.h"
+#else
+  #include "nimble/nimble/host/include/host/ble_hs.h"
+#endif
+
+/**
+ * GATT operations on a treadmill connection by attribute handle, without the service discovery NimBLEClient needs
+ * before it hands out a characteristic. The drivers discover once, remember the handles (see GattHandleCache) and
+ * do everything else through here, so a reconnect to the same treadmill goes straight to subscribing.
+ *
+ * Writes with response and reads block the calling task (the main loop) until the treadmill answered, like
+ * NimBLERemoteCharacteristic does. Notifications come from a GAP event listener, they're delivered on the NimBLE
+ * host task like the NimBLE callbacks were.
+ */
+class GattLink {
+  public:
+    typedef void (*NotifyCallback)(void* context, uint8_t* data, size_t length);
+
+    static constexpr uint16_t NO_HANDLE = 0;
+    static constexpr uint8_t MAX_SUBSCRIPTIONS = 3;
+    static constexpr uint32_t TIMEOUT_MS = 3000;
+    static constexpr size_t DATABASE_HASH_SIZE = 16;
+
+    /**
+     * Starts using a new connection, subscriptions of the previous one are dropped.
+     */
+    void attach(uint16_t connHandle) {
+      if (!mListening) {
+        ble_gap_event_listener_register(&mListener, onGapEvent, this);
+        mListening = true;
+      }
+      mConnHandle = connHandle;
+      mSubscriptionCount = 0;
+    }
+
+    /**
+     * Enables notifications (never indications, no driver uses them) on a characteristic, given its value and
+     * Client Characteristic Configuration handles. The CCCD write is with response. Returns false if the treadmill
+     * rejected it, which is also how a stale handle shows up.
+     */
+    bool subscribe(uint16_t valueHandle, uint16_t cccdHandle, NotifyCallback callback, void* context) {
+      if (mSubscriptionCount >= MAX_SUBSCRIPTIONS || valueHandle == NO_HANDLE || cccdHandle == NO_HANDLE) {
+        return false;
+      }
+      // Registered first, the treadmill may notify before the write response arrives
+      mSubscriptions[mSubscriptionCount] = { valueHandle, callback, context };
+      mSubscriptionCount++;
+
+      const uint8_t enableNotifications[2] = { 0x01, 0x00 };
+      if (!write(cccdHandle, enableNotifications, sizeof(enableNotifications), true)) {
+        mSubscriptionCount--;
+        return false;
+      }
+      return true;
+    }
+
+    bool write(uint16_t handle, const uint8_t* data, size_t length, bool withResponse) {
+      if (handle == NO_HANDLE) {
+        return false;
+      }
+      if (!withResponse) {
+        return ble_gattc_write_no_rsp_flat(mConnHandle, handle, data, length) == 0;
+      }
+      if (!beginOperation()) {
+        return false;
+      }
+      int rc = ble_gattc_write_flat(mConnHandle, handle, data, length, onAttributeDone, this);
+      return waitForOperation(rc) == 0;
+    }
+
+    /**
+     * Reads the Database Hash (0x2B2A) of the treadmill, it changes whenever its attribute table does. Returns
+     * false if the treadmill doesn't have one, older and simpler GATT servers don't.
+     */
+    bool readDatabaseHash(uint8_t* hash) {
+      ble_uuid16_t uuid = BLE_UUID16_INIT(0x2B2A);
+      if (!beginOperation()) {
+        return false;
+      }
+      mReadLength = 0;
+      int rc = ble_gattc_read_by_uuid(mConnHandle, 1, 0xFFFF, &uuid.u, onAttributeRead, this);
+      if (waitForOperation(rc) != 0 || mReadLength != DATABASE_HASH_SIZE) {
+        return false;
+      }
+      memcpy(hash, mReadBuffer, DATABASE_HASH_SIZE);
+      return true;
+    }
+
+  private:
+    struct Subscription {
+      uint16_t valueHandle;
+      NotifyCallback callback;
+      void* context;
+    };
+
+    uint16_t mConnHandle = BLE_HS_CONN_HANDLE_NONE;
+    Subscription mSubscriptions[MAX_SUBSCRIPTIONS];
+    volatile uint8_t mSubscriptionCount = 0;
+
+    ble_gap_event_listener mListener;
+    bool mListening = false;
+    uint8_t mNotifyBuffer[BLE_ATT_ATTR_MAX_LEN];  // Only used on the NimBLE host task
+
+    // One operation at a time. One that timed out stays busy until NimBLE calls back for it, it always does
+    // (the ATT timeout or the disconnect at the latest), so a late answer can't be taken for the next one's.
+    volatile bool mBusy = false;
+    volatile int mOperationStatus = 0;
+    uint8_t mReadBuffer[DATABASE_HASH_SIZE];
+    volatile uint16_t mReadLength = 0;
+
+    bool beginOperation() {
+      if (mBusy) {
+        Debug.println("GATT operation still outstanding on the treadmill link");
+        return false;
+      }
+      mBusy = true;
+      return true;
+    }
+
+    int waitForOperation(int rc) {
+      if (rc != 0) {
+        mBusy = false;
+        return rc;
+      }
+      unsigned long start = millis();
+      while (mBusy) {
+        if (millis() - start > TIMEOUT_MS) {
+          return BLE_HS_ETIMEOUT;
+        }
+        delay(1);
+      }
+      return mOperationStatus;
+    }
+
+    static int onAttributeDone(uint16_t connHandle, const ble_gatt_error* error, ble_gatt_attr* attr, void* arg) {
+      GattLink* self = static_cast<GattLink*>(arg);
+      self->finishOperation(error->status);
+      return 0;
+    }
+
+    static int onAttributeRead(uint16_t connHandle, const ble_gatt_error* error, ble_gatt_attr* attr, void* arg) {
+      GattLink* self = static_cast<GattLink*>(arg);
+      if (error->status == 0 && attr) {
+        uint16_t length = 0;
+        ble_hs_mbuf_to_flat(attr->om, self->mReadBuffer, sizeof(self->mReadBuffer), &length);
+        self->mReadLength = length;
+        return 0;  // More results or BLE_HS_EDONE follow
+      }
+      self->finishOperation(error->status == BLE_HS_EDONE ? 0 : error->status);
+      return 0;
+    }
+
+    void finishOperation(int status) {
+      mOperationStatus = status;
+      mBusy = false;
+    }
+
+    static int onGapEvent(ble_gap_event* event, void* arg) {
+      GattLink* self = static_cast<GattLink*>(arg);
+      if (event->type != BLE_GAP_EVENT_NOTIFY_RX || event->notify_rx.conn_handle != self->mConnHandle) {
+        return 0;
+      }
+      for (uint8_t i = 0; i < self->mSubscriptionCount; i++) {
+        const Subscription& s = self->mSubscriptions[i];
+        if (s.valueHandle == event->notify_rx.attr_handle) {
+          uint16_t length = 0;
+          ble_hs_mbuf_to_flat(event->notify_rx.om, self->mNotifyBuffer, sizeof(self->mNotifyBuffer), &length);
+          s.callback(s.context, self->mNotifyBuffer, length);
+          break;
+        }
+      }
+      return 0;
+    }
+};
+
+/**
+ * The attribute handles a driver found on its treadmill, kept in NVS so reconnects, even after a reboot, can skip
+ * service discovery, the slowest part of connecting. The handles of a model don't change (protocol-analysis lists
+ * them), but a firmware update of the treadmill could move them, so the cache is only used when:
+ *   - it's for the treadmill we're connected to, by address
+ *   - the Database Hash of the treadmill is still the same, when it has one
+ * and a driver forgets it as soon as a write by handle fails, the next connect discovers again.
+ *
+ * Each driver uses its own key and decides what the handles mean, an index per characteristic.
+ */
+class GattHandleCache {
+  public:
+    static constexpr uint8_t MAX_HANDLES = 8;
+    static constexpr uint8_t FORMAT_VERSION = 1;
+
+    explicit GattHandleCache(const char* key) : mKey(key) {}
+
+    /**
+     * Fills handles with what was remembered for the treadmill at address, if it's still valid. Reads the
+     * Database Hash of the treadmill through the link to check.
+     */
+    bool restore(const NimBLEAddress& address, GattLink& link, uint16_t* handles) {
+      Entry entry;
+      if (!read(entry) || entry.address != (uint64_t)address || entry.addressType != address.getType()) {
+        return false;
+      }
+
+      uint8_t hash[GattLink::DATABASE_HASH_SIZE];
+      bool hasHash = link.readDatabaseHash(hash);
+      if (hasHash != (entry.hasDatabaseHash != 0) || (hasHash && memcmp(hash, entry.databaseHash, sizeof(hash)) != 0)) {
+        Debug.println("The GATT database of the treadmill changed, discovering again.");
+        forget();
+        return false;
+      }
+
+      memcpy(handles, entry.handles, sizeof(entry.handles));
+      return true;
+    }
+
+    /**
+     * Remembers the handles a discovery found, with the Database Hash (if any) to validate them later.
+     */
+    void store(const NimBLEAddress& address, GattLink& link, const uint16_t* handles) {
+      Entry entry;
+      entry.address = (uint64_t)address;
+      entry.addressType = address.getType();
+      entry.hasDatabaseHash = link.readDatabaseHash(entry.databaseHash) ? 1 : 0;
+      memcpy(entry.handles, handles, sizeof(entry.handles));
+
+      Preferences prefs;
+      prefs.begin(NVS_NAMESPACE, false);
+      if (prefs.putBytes(mKey, &entry, sizeof(entry)) != sizeof(entry)) {
+        Debug.println("ERROR: Failed to save the GATT handles of the treadmill");
+      }
+      prefs.end();
+    }
+
+    void forget() {
+      Preferences prefs;
+      prefs.begin(NVS_NAMESPACE, false);
+      prefs.remove(mKey);
+      prefs.end();
+    }
+
+  private:
+    static constexpr const char* NVS_NAMESPACE = "gattcache";
+
+    struct Entry {
+      uint8_t version = FORMAT_VERSION;
+      uint8_t addressType = 0;
+      uint8_t hasDatabaseHash = 0;
+      uint8_t reserved = 0;
+      uint64_t address = 0;
+      uint8_t databaseHash[GattLink::DATABASE_HASH_SIZE] = {0};
+      uint16_t handles[MAX_HANDLES] = {0};
+    };
+
+    const char* mKey;
+
+    bool read(Entry& entry) {
+      Preferences prefs;
+      prefs.begin(NVS_NAMESPACE, true);
+      size_t len = prefs.getBytes(mKey, &entry, sizeof(entry));
+      prefs.end();
+      return len == sizeof(entry) && entry.version == FORMAT_VERSION;
+    }
+};
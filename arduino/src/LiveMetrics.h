@@ -0,0 +1,132 @@
+#pragma once
+
+#include <Arduino.h>
+#include "globals.h"
+#include "SessionSync.h"
+
+/**
+ * The running treadmill values as the live metrics characteristic sends them.
+ */
+struct LiveMetricsSnapshot {
+  bool active = false;
+  uint32_t steps = 0;
+  uint16_t speed = 0;  // Hundredths of a km/h, like the telemetry samples
+  uint32_t distanceMeters = 0;
+  uint16_t durationSecs = 0;
+  uint16_t calories = 0;
+
+  bool operator==(const LiveMetricsSnapshot& other) const {
+    return active == other.active && steps == other.steps && speed == other.speed &&
+           distanceMeters == other.distanceMeters && durationSecs == other.durationSecs && calories == other.calories;
+  }
+
+  bool operator!=(const LiveMetricsSnapshot& other) const {
+    return !(*this == other);
+  }
+};
+
+/**
+ * Streams the live values to a subscribed app, for a dashboard while walking.
+ *
+ * Treadmills report several times a second and mostly repeat themselves, so a notification only goes out when
+ * something changed, and at most once every min interval. Changes in between are coalesced, the app gets the
+ * latest values once the interval is up. A congested link (the sync saturating the buffers) holds the
+ * notifications off for CONGESTION_HOLD_MS, a dashboard can miss a beat but the treadmill connection and the
+ * sync can't.
+ *
+ * Each notification is PAYLOAD_SIZE bytes, big-endian:
+ *   [FORMAT_VERSION][flags][steps u32][speed u16][distance u32][duration u16][calories u16]
+ * with flags bit 0 set while a session is running.
+ */
+class LiveMetricsNotifier {
+  public:
+    static constexpr uint8_t FORMAT_VERSION = 1;
+    static constexpr uint8_t FLAG_ACTIVE = 0x01;
+    static constexpr size_t PAYLOAD_SIZE = 16;
+    static constexpr uint32_t CONGESTION_HOLD_MS = 1000;
+
+    explicit LiveMetricsNotifier(uint32_t minIntervalMs) : mMinIntervalMs(minIntervalMs) {}
+
+    /**
+     * Call when the app subscribes, the current values go out with the next poll() no matter what was sent before.
+     */
+    void reset() {
+      mHasSent = false;
+      mHoldUntil = 0;
+      mHolding = false;
+    }
+
+    /**
+     * Takes the latest values, nothing is sent until poll().
+     */
+    void update(const LiveMetricsSnapshot& snapshot) {
+      mLatest = snapshot;
+    }
+
+    /**
+     * Sends the latest values if they changed since the last notification and the interval is up. Returns true
+     * if a notification went out.
+     */
+    bool poll(SyncTransport& transport, uint32_t now) {
+      if (mHasSent && mLatest == mSent) {
+        return false;
+      }
+      if (mHolding && (int32_t)(now - mHoldUntil) < 0) {
+        return false;
+      }
+      mHolding = false;
+      if (mHasSent && now - mLastSendTime < mMinIntervalMs) {
+        return false;
+      }
+
+      uint8_t payload[PAYLOAD_SIZE];
+      encode(mLatest, payload);
+      if (!transport.send(payload, sizeof(payload))) {
+        onCongestion(now);
+        return false;
+      }
+      mSent = mLatest;
+      mHasSent = true;
+      mLastSendTime = now;
+      return true;
+    }
+
+    /**
+     * The controller ran out of buffers, stop sending for a bit.
+     */
+    void onCongestion(uint32_t now) {
+      mHolding = true;
+      mHoldUntil = now + CONGESTION_HOLD_MS;
+    }
+
+    static void encode(const LiveMetricsSnapshot& snapshot, uint8_t* out) {
+      out[0] = FORMAT_VERSION;
+      out[1] = snapshot.active ? FLAG_ACTIVE : 0;
+      writeUint32(out + 2, snapshot.steps);
+      writeUint16(out + 6, snapshot.speed);
+      writeUint32(out + 8, snapshot.distanceMeters);
+      writeUint16(out + 12, snapshot.durationSecs);
+      writeUint16(out + 14, snapshot.calories);
+    }
+
+  private:
+    uint32_t mMinIntervalMs;
+    LiveMetricsSnapshot mLatest;
+    LiveMetricsSnapshot mSent;
+    bool mHasSent = false;
+    uint32_t mLastSendTime = 0;
+    bool mHolding = false;
+    uint32_t mHoldUntil = 0;
+
+    static void writeUint16(uint8_t* out, uint16_t value) {
+      out[0] = value >> 8;
+      out[1] = value;
+    }
+
+    static void writeUint32(uint8_t* out, uint32_t value) {
+      out[0] = value >> 24;
+      out[1] = value >> 16;
+      out[2] = value >> 8;
+      out[3] = value;
+    }
+};
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include "globals.h"
+#include "Crc16.h"
+
+/**
+ * Periodic checkpoints of the session that's in progress, so a reset mid-walk doesn't lose it.
+ *
+ * Checkpoints go into their own small "checkpoint" partition (2 sectors) instead of the session journal, so they
+ * never wear or fill it. Each checkpoint is a fixed size record appended to the active sector. When the sector is
+ * full the other one is erased and becomes the active one, so it's one erase per ~126 checkpoints. The record with
+ * the highest sequence number is the current state: either a running session or a CLOSED marker written when the
+ * session ended normally. A torn record fails its CRC and is skipped, the previous checkpoint still stands.
+ *
+ * Like the journal's, a sector starts with a magic that's written right after it was erased. A sector without it
+ * holds whatever was there before (SPIFFS, an older layout), it's never parsed and gets erased before the first
+ * checkpoint goes into it.
+ */
+class SessionCheckpoint {
+  public:
+    bool begin() {
+      mPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, PARTITION_SUBTYPE, PARTITION_LABEL);
+      if (!mPartition) {
+        Debug.println("No 'checkpoint' partition found, running sessions won't survive a reset.");
+        return false;
+      }
+      scan();
+      Debug.printf("Checkpoint: sector=%u, offset=%u, seq=%u, %s\n", mSector, mWriteOffset, mLatest.seq,
+                   (mLatest.state == STATE_RUNNING) ? "session was running" : "no running session");
+      return true;
+    }
+
+    /**
+     * Saves the state of the running session, updated is the time the values were current.
+     */
+    bool save(const TreadmillSession& session, uint32_t updated) {
+      CheckpointRecord rec;
+      rec.state = STATE_RUNNING;
+      rec.start = session.start;
+      rec.updated = updated;
+      rec.steps = session.steps;
+      rec.distanceMeters = session.distanceMeters;
+      rec.calories = session.calories;
+      rec.activeSecs = session.activeSecs;
+      return write(rec);
+    }
+
+    /**
+     * Marks the running session as done, called once it's in the session journal.
+     */
+    bool clear() {
+      if (mLatest.state != STATE_RUNNING) {
+        return true;
+      }
+      CheckpointRecord rec;
+      rec.state = STATE_CLOSED;
+      return write(rec);
+    }
+
+    /**
+     * If a session was still running when the device went down, returns its last checkpoint.
+     */
+    bool getOrphan(TreadmillSession& session, uint32_t& updated) const {
+      if (mLatest.state != STATE_RUNNING) {
+        return false;
+      }
+      session.start = mLatest.start;
+      session.stop = mLatest.updated;
+      session.steps = mLatest.steps;
+      session.distanceMeters = mLatest.distanceMeters;
+      session.calories = mLatest.calories;
+      session.activeSecs = mLatest.activeSecs;
+      updated = mLatest.updated;
+      return true;
+    }
+
+  private:
+    static constexpr const char* PARTITION_LABEL = "checkpoint";
+    static constexpr esp_partition_subtype_t PARTITION_SUBTYPE = (esp_partition_subtype_t)0x42;
+
+    static constexpr uint32_t SECTOR_SIZE = 4096;
+    static constexpr uint32_t SECTOR_MAGIC = 0x31435354;  // "TSC1"
+    static constexpr uint32_t SEQ_ERASED = 0xFFFFFFFF;
+    static constexpr uint8_t STATE_RUNNING = 0x01;
+    static constexpr uint8_t STATE_CLOSED = 0x02;
+
+    struct CheckpointRecord {
+      uint32_t seq = 0;
+      uint8_t state = STATE_CLOSED;
+      uint8_t reserved = 0xFF;
+      uint16_t crc = 0;  // CRC16 of the record with this field set to 0
+      uint32_t start = 0;
+      uint32_t updated = 0;
+      uint32_t steps = 0;
+      uint32_t distanceMeters = 0;
+      uint32_t calories = 0;
+      uint32_t activeSecs = 0;
+    };
+
+    // The magic takes the first record slot, so the records stay aligned.
+    static constexpr uint32_t HEADER_SIZE = sizeof(CheckpointRecord);
+
+    const esp_partition_t* mPartition = nullptr;
+    uint32_t mSector = 0;
+    uint32_t mWriteOffset = HEADER_SIZE;
+    bool mFormatted[2] = { false, false };  // The sector has the magic
+    CheckpointRecord mLatest;
+
+    void scan() {
+      mLatest = CheckpointRecord();
+      mSector = 0;
+      mWriteOffset = HEADER_SIZE;
+      bool found = false;
+
+      for (uint32_t sector = 0; sector < 2; sector++) {
+        uint32_t magic = 0;
+        mFormatted[sector] = esp_partition_read(mPartition, sector * SECTOR_SIZE, &magic, sizeof(magic)) == ESP_OK &&
+                             magic == SECTOR_MAGIC;
+        if (!mFormatted[sector]) {
+          continue;
+        }
+        for (uint32_t offset = HEADER_SIZE; offset + sizeof(CheckpointRecord) <= SECTOR_SIZE; offset += sizeof(CheckpointRecord)) {
+          CheckpointRecord rec;
+          if (esp_partition_read(mPartition, sector * SECTOR_SIZE + offset, &rec, sizeof(rec)) != ESP_OK ||
+              rec.seq == SEQ_ERASED) {
+            break;
+          }
+          if (!isValid(rec)) {
+            continue;  // Torn, the slot is used up but the previous checkpoint stands.
+          }
+          if (!found || (int32_t)(rec.seq - mLatest.seq) > 0) {
+            found = true;
+            mLatest = rec;
+            mSector = sector;
+          }
+        }
+      }
+
+      // Appends continue after the last used slot of the sector holding the latest record.
+      mWriteOffset = HEADER_SIZE;
+      CheckpointRecord rec;
+      while (mFormatted[mSector] && mWriteOffset + sizeof(rec) <= SECTOR_SIZE &&
+             esp_partition_read(mPartition, mSector * SECTOR_SIZE + mWriteOffset, &rec, sizeof(rec)) == ESP_OK &&
+             rec.seq != SEQ_ERASED) {
+        mWriteOffset += sizeof(rec);
+      }
+    }
+
+    bool write(CheckpointRecord& rec) {
+      if (!mPartition) {
+        return false;
+      }
+      if (!mFormatted[mSector]) {
+        if (!format(mSector)) {
+          return false;
+        }
+      } else if (mWriteOffset + sizeof(rec) > SECTOR_SIZE) {
+        if (!format(1 - mSector)) {
+          return false;
+        }
+      }
+
+      rec.seq = mLatest.seq + 1;
+      rec.crc = 0;
+      rec.crc = crc16((const uint8_t*)&rec, sizeof(rec));
+      esp_err_t err = esp_partition_write(mPartition, mSector * SECTOR_SIZE + mWriteOffset, &rec, sizeof(rec));
+      mWriteOffset += sizeof(rec);
+      if (err != ESP_OK) {
+        Debug.println("ERROR: Failed to write checkpoint");
+        return false;
+      }
+      mLatest = rec;
+      return true;
+    }
+
+    /**
+     * Erases a sector and writes its magic, it becomes the active one.
+     */
+    bool format(uint32_t sector) {
+      uint32_t magic = SECTOR_MAGIC;
+      if (esp_partition_erase_range(mPartition, sector * SECTOR_SIZE, SECTOR_SIZE) != ESP_OK ||
+          esp_partition_write(mPartition, sector * SECTOR_SIZE, &magic, sizeof(magic)) != ESP_OK) {
+        Debug.println("ERROR: Failed to erase checkpoint sector");
+        mFormatted[sector] = false;
+        return false;
+      }
+      mFormatted[sector] = true;
+      mSector = sector;
+      mWriteOffset = HEADER_SIZE;
+      return true;
+    }
+
+    static bool isValid(const CheckpointRecord& rec) {
+      CheckpointRecord copy = rec;
+      copy.crc = 0;
+      return rec.crc == crc16((const uint8_t*)&copy, sizeof(copy));
+    }
+};
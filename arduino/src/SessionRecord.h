@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdint.h>
+#include "Varint.h"
+
+/**
+ * A session as it's stored in the session journal.
+ *
+ * Only uses plain C++ (no Arduino headers) so the same encoder/decoder can be compiled on the host.
+ */
+struct SessionRecord {
+  uint32_t seq = 0;
+  uint32_t start = 0;
+  uint32_t stop = 0;
+  uint32_t steps = 0;
+  uint32_t distanceMeters = 0;  // Optional, 0 when the treadmill doesn't report it.
+  uint32_t calories = 0;        // Optional
+  uint32_t activeSecs = 0;      // Optional, time the belt was actually moving.
+};
+
+/**
+ * Compact, versioned encoding of a SessionRecord.
+ *
+ * Payload (VERSION 1), every number is an unsigned LEB128 varint:
+ *   fields        Bitmask of the optional fields that follow (FIELD_*).
+ *   seq           Delta from the previous session.
+ *   start         Zigzag delta from the start of the previous session.
+ *   duration      stop - start
+ *   steps
+ *   distance      Only if FIELD_DISTANCE is set.
+ *   calories      Only if FIELD_CALORIES is set.
+ *   activeSecs    Only if FIELD_ACTIVE_SECS is set.
+ *
+ * "Previous session" is the Anchor, it's reset at the start of every flash sector so a sector can be decoded on
+ * its own. A typical session with every field is ~14 bytes instead of the 16 the raw uint32 layout used for
+ * start/stop/steps alone.
+ *
+ * The version isn't part of the payload, the journal stores it in the record kind. A new layout gets a new kind
+ * and keeps this decoder around for the records already in flash.
+ */
+class SessionRecordCodec {
+  public:
+    static constexpr uint8_t VERSION = 1;
+    static constexpr uint32_t MAX_ENCODED_SIZE = 1 + 6 * Varint::MAX_SIZE;
+
+    static constexpr uint8_t FIELD_DISTANCE = 0x01;
+    static constexpr uint8_t FIELD_CALORIES = 0x02;
+    static constexpr uint8_t FIELD_ACTIVE_SECS = 0x04;
+    static constexpr uint8_t KNOWN_FIELDS = FIELD_DISTANCE | FIELD_CALORIES | FIELD_ACTIVE_SECS;
+
+    /**
+     * What deltas are relative to. Advance it with every record decoded or encoded.
+     */
+    struct Anchor {
+      uint32_t seq = 0;
+      uint32_t start = 0;
+
+      void advance(const SessionRecord& rec) {
+        seq = rec.seq;
+        start = rec.start;
+      }
+    };
+
+    /**
+     * Anchor for the first session of a sector whose first sequence number is firstSeq.
+     */
+    static Anchor sectorAnchor(uint32_t firstSeq) {
+      Anchor anchor;
+      anchor.seq = firstSeq - 1;
+      anchor.start = 0;
+      return anchor;
+    }
+
+    /**
+     * Writes rec into out (at least MAX_ENCODED_SIZE bytes) and returns the number of bytes used.
+     */
+    static uint32_t encode(const SessionRecord& rec, const Anchor& anchor, uint8_t* out) {
+      uint8_t fields = 0;
+      if (rec.distanceMeters) fields |= FIELD_DISTANCE;
+      if (rec.calories) fields |= FIELD_CALORIES;
+      if (rec.activeSecs) fields |= FIELD_ACTIVE_SECS;
+
+      uint32_t len = 0;
+      out[len++] = fields;
+      len += Varint::put(out + len, rec.seq - anchor.seq);
+      len += Varint::put(out + len, Varint::zigzag((int32_t)(rec.start - anchor.start)));
+      len += Varint::put(out + len, rec.stop - rec.start);
+      len += Varint::put(out + len, rec.steps);
+      if (fields & FIELD_DISTANCE) len += Varint::put(out + len, rec.distanceMeters);
+      if (fields & FIELD_CALORIES) len += Varint::put(out + len, rec.calories);
+      if (fields & FIELD_ACTIVE_SECS) len += Varint::put(out + len, rec.activeSecs);
+      return len;
+    }
+
+    /**
+     * Decodes len bytes of payload. Returns false if the payload is truncated, has trailing bytes or
+     * sets fields this version doesn't know about.
+     */
+    static bool decode(const uint8_t* in, uint32_t len, const Anchor& anchor, SessionRecord& rec) {
+      if (len < 1) {
+        return false;
+      }
+      uint8_t fields = in[0];
+      if (fields & ~KNOWN_FIELDS) {
+        return false;
+      }
+
+      uint32_t pos = 1;
+      uint32_t seqDelta, startDelta, duration;
+      if (!Varint::get(in, len, pos, seqDelta) || !Varint::get(in, len, pos, startDelta) ||
+          !Varint::get(in, len, pos, duration) || !Varint::get(in, len, pos, rec.steps)) {
+        return false;
+      }
+      rec.seq = anchor.seq + seqDelta;
+      rec.start = anchor.start + (uint32_t)Varint::unzigzag(startDelta);
+      rec.stop = rec.start + duration;
+
+      rec.distanceMeters = 0;
+      rec.calories = 0;
+      rec.activeSecs = 0;
+      if ((fields & FIELD_DISTANCE) && !Varint::get(in, len, pos, rec.distanceMeters)) return false;
+      if ((fields & FIELD_CALORIES) && !Varint::get(in, len, pos, rec.calories)) return false;
+      if ((fields & FIELD_ACTIVE_SECS) && !Varint::get(in, len, pos, rec.activeSecs)) return false;
+      return pos == len;
+    }
+};
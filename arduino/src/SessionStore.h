@@ -0,0 +1,960 @@
+#pragma once
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <esp_idf_version.h>
+#include <vector>
+#include "globals.h"
+#include "SessionRecord.h"
+#include "Crc16.h"
+
+/**
+ * Append-only, wear-leveled session journal.
+ *
+ * Sessions used to live in fixed 12-byte slots of the 512-byte EEPROM emulation with a count header in front of
+ * them. The header was rewritten every time a session ended and every time the mobile app synced, so the same
+ * few flash sectors got erased over and over.
+ *
+ * The journal lives in its own partition ("sessions" in partitions.csv) and treats it as a ring of 4KB sectors:
+ *  - Records are only ever appended after the last record of the newest sector (the head).
+ *  - When the head is full, the next sector in the ring is erased and becomes the new head. Each sector is erased
+ *    once per trip around the ring, which spreads the wear evenly over the whole partition.
+ *  - Every session gets a monotonically increasing sequence number. Syncing doesn't erase anything, it appends a
+ *    tiny ACK record holding the last sequence number the mobile app received.
+ *
+ * Sector layout:
+ *   [0..19]  SectorHeader
+ *   [20..]   Records back to back, each starting with a 1 byte kind and ending with a CRC16 of the kind and
+ *            payload. Erased flash (0xFF) marks the end of them.
+ *
+ * Record kinds:
+ *   KIND_ACK          Fixed 4 byte payload: last synced seq.
+ *   KIND_SESSION      1 byte length followed by a SessionRecordCodec payload. Deltas are relative to the previous
+ *                     session in the same sector.
+ *   KIND_DAY_SUMMARY  1 byte length, the last folded seq as a little-endian uint32, then a SessionRecordCodec
+ *                     payload. Written by compaction, see below.
+ *
+ * Crash consistency: a session is committed with a single flash write of its whole record. If power is cut
+ * half way through, the record's CRC won't match on the next boot. The torn record is dropped and the sector is
+ * closed so nothing is ever written after it. A new sector is committed by writing its header with the magic
+ * left erased and only then programming the magic, so a sector without a valid magic is never part of the
+ * journal. Either the whole session is there after a reboot or none of it is.
+ *
+ * The capacity comes from the size of the partition, not from EEPROM_SIZE. On boot every sector header is read
+ * once into a RAM table and the head sector is walked to find where the next record goes. After that appending
+ * never reads flash, finding the sector a sequence number lives in is a binary search of the table, and reading
+ * sessions in order (what a sync does) continues from a cursor instead of rescanning the sector. The partition is
+ * memory-mapped read-only, so a sync or printing every stored session decodes records in place, straight out of
+ * the flash cache, without a copy in RAM or a flash read call per record. If mapping fails the sector being read
+ * is loaded into a RAM buffer with one flash read instead and kept in sync with appends.
+ *
+ * Integrity: at boot every sector holding unsynced sessions is checked with one pass over the sector, within
+ * VERIFY_BUDGET_MS (sectors the budget didn't cover are checked the first time they're read). Sessions that
+ * can't be read back, from a record that fails its CRC to the end of its sector, are quarantined: read() refuses
+ * them, so a sync skips them instead of sending garbage, and they're dropped with the next ack.
+ *
+ * Retention: with RETENTION_KEEP_OLDEST a journal full of unsynced sessions refuses new ones until the mobile app
+ * syncs. With RETENTION_FOLD_INTO_DAYS, once fewer than COMPACTION_RESERVE_SECTORS sectors are free, compactStep()
+ * folds the unsynced sessions of the oldest sector into one KIND_DAY_SUMMARY per day (first start, last stop,
+ * summed steps, distance, calories and active time). A summary is a new session as far as syncing goes, and it
+ * also acknowledges the sessions it replaces, in the same record, so after a power cut either the summary or the
+ * sessions it folded are pending, never both. Once the oldest sector is folded it can be reclaimed like a synced
+ * one. Compaction reads at most COMPACTION_BATCH sessions and writes at most one record per call.
+ *
+ * The folded sessions stay readable until their sector is reclaimed, so the journal remembers the last seq it
+ * folded (foldSeq(), in every sector header and day summary like the ack). An app syncing with a cursor from
+ * before it starts after it: everything up to there was either folded into a summary it gets, or synced.
+ */
+class SessionStore {
+  public:
+    enum RetentionPolicy {
+      RETENTION_KEEP_OLDEST,     // A full journal refuses new sessions until the mobile app syncs.
+      RETENTION_FOLD_INTO_DAYS,  // The oldest unsynced sessions are folded into day summaries to make room.
+    };
+
+    // Local day number of a unix time, sessions are folded per day.
+    typedef uint32_t (*DayFunction)(time_t t);
+
+    /**
+     * Locates the partition and scans it. Returns false if the partition table has no "sessions" partition.
+     */
+    bool begin() {
+      mPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, PARTITION_SUBTYPE, PARTITION_LABEL);
+      if (!mPartition) {
+        Debug.println("ERROR: No 'sessions' partition found, was the firmware flashed with partitions.csv?");
+        return false;
+      }
+      mSectorCount = mPartition->size / SECTOR_SIZE;
+      mSectors.assign(mSectorCount, SectorInfo());
+      if (!mMapped) {
+        const void* mapped = nullptr;
+        if (esp_partition_mmap(mPartition, 0, mPartition->size, MMAP_DATA, &mapped, &mMapHandle) == ESP_OK) {
+          mMapped = (const uint8_t*)mapped;
+        } else {
+          Debug.println("Session journal: couldn't memory-map the partition, reading sectors into RAM instead.");
+        }
+      }
+
+      unsigned long scanStart = millis();
+      scan();
+      Debug.printf("Session journal: %u sectors (~%u sessions), head=%d, tail=%d, nextSeq=%u, ackSeq=%u, pending=%u, scan took %lums\n",
+                   mSectorCount, capacity(), mHeadSector, mTailSector, mNextSeq, mAckSeq, pendingCount(), millis() - scanStart);
+      verifyPending();
+      return true;
+    }
+
+    /**
+     * Appends a finished session. Returns false if it couldn't be stored.
+     */
+    bool append(const TreadmillSession& session) {
+      if (!mPartition) {
+        return false;
+      }
+
+      SessionRecord rec = toRecord(session, mNextSeq);
+      uint8_t frame[MAX_FRAME_SIZE];
+      uint32_t frameLen = encodeSessionFrame(rec, frame);
+
+      // Always leave room for an ACK behind the session, otherwise a full journal couldn't record a sync.
+      if (!hasRoom(frameLen + ACK_FRAME_SIZE)) {
+        if (!openNextSector()) {
+          Debug.printf("Session store is full (%u sessions). Cannot store more sessions.\n", pendingCount());
+          return false;
+        }
+        // Deltas restart in the new sector.
+        frameLen = encodeSessionFrame(rec, frame);
+      }
+      if (!writeAtHead(frame, frameLen)) {
+        return false;
+      }
+      mHeadAnchor.advance(rec);
+      mNextSeq++;
+      return true;
+    }
+
+    /**
+     * Marks every session up to and including seq as synced. The space they use is reclaimed
+     * when the journal wraps around onto their sector.
+     */
+    bool acknowledge(uint32_t seq) {
+      if (!mPartition || mHeadSector < 0) {
+        return false;
+      }
+      if (seq >= mNextSeq) {
+        seq = mNextSeq - 1;
+      }
+      if (seq <= mAckSeq) {
+        return true;
+      }
+
+      // Quarantined sessions that are now synced are simply gone.
+      while (!mQuarantine.empty() && mQuarantine.front().last <= seq) {
+        mQuarantine.erase(mQuarantine.begin());
+      }
+
+      // Update the RAM copy first, that way if the head is full the sector we open next may reuse synced
+      // sectors and its header already carries the new ack.
+      mAckSeq = seq;
+      mCompactionStalled = false;
+
+      uint8_t frame[ACK_FRAME_SIZE];
+      frame[0] = KIND_ACK;
+      memcpy(frame + 1, &seq, sizeof(seq));
+      appendCrc(frame, 1 + sizeof(seq));
+      if (!ensureRoom(sizeof(frame))) {
+        Debug.println("ERROR: No room left in the journal to record the ack.");
+        return false;
+      }
+      return writeAtHead(frame, sizeof(frame));
+    }
+
+    /**
+     * Marks every stored session as synced.
+     */
+    bool clear() {
+      return acknowledge(mNextSeq - 1);
+    }
+
+    /**
+     * Number of sessions that haven't been synced to the mobile app yet.
+     */
+    uint32_t pendingCount() const {
+      uint32_t first = firstPendingSeq();
+      return (mNextSeq > first) ? (mNextSeq - first) : 0;
+    }
+
+    /**
+     * Sequence number of the oldest session that hasn't been synced yet.
+     */
+    uint32_t firstPendingSeq() const {
+      uint32_t oldest = oldestStoredSeq();
+      return (mAckSeq + 1 > oldest) ? (mAckSeq + 1) : oldest;
+    }
+
+    /**
+     * Roughly how many unsynced sessions fit in the partition, records are variable length.
+     */
+    uint32_t capacity() const {
+      return mSectorCount * ((SECTOR_SIZE - sizeof(SectorHeader) - ACK_FRAME_SIZE) / TYPICAL_SESSION_FRAME_SIZE);
+    }
+
+    /**
+     * Reads the index'th unsynced session (0 is the oldest).
+     */
+    bool readPending(uint32_t index, TreadmillSession& out) {
+      if (index >= pendingCount()) {
+        return false;
+      }
+      return read(firstPendingSeq() + index, out);
+    }
+
+    /**
+     * Reads a session by sequence number. Reading the session right after the previous one picks up
+     * where the last read stopped.
+     */
+    bool read(uint32_t seq, TreadmillSession& out) {
+      if (!mPartition || mHeadSector < 0 || seq >= mNextSeq || seq < oldestStoredSeq() || isQuarantined(seq)) {
+        return false;
+      }
+
+      if (mCursor.seq == seq && mSectors[mCursor.sector].valid && mSectors[mCursor.sector].sectorSeq == mCursor.sectorSeq &&
+          readFromSector(mCursor.sector, mCursor.offset, mCursor.anchor, seq, out)) {
+        return true;
+      }
+      uint32_t sector = findSectorFor(seq);
+      return readFromSector(sector, sizeof(SectorHeader), SessionRecordCodec::sectorAnchor(mSectors[sector].firstSeq), seq, out);
+    }
+
+    uint32_t nextSeq() const { return mNextSeq; }
+    uint32_t ackSeq() const { return mAckSeq; }
+
+    /**
+     * Last seq compaction folded into a day summary, 0 if it never did. Sessions up to it are synced or replaced
+     * by a summary with a later seq, see RETENTION_FOLD_INTO_DAYS.
+     */
+    uint32_t foldSeq() const { return mFoldSeq; }
+
+    /**
+     * Sequence number of the oldest session still in the journal, synced or not.
+     */
+    uint32_t oldestStoredSeq() const {
+      return (mTailSector < 0) ? mNextSeq : mSectors[mTailSector].firstSeq;
+    }
+
+    /**
+     * Unsynced sessions that failed the integrity check and won't be synced.
+     */
+    uint32_t quarantinedCount() const {
+      uint32_t count = 0;
+      for (const SeqRange& range : mQuarantine) {
+        count += range.last - range.first + 1;
+      }
+      return count;
+    }
+
+    void setRetentionPolicy(RetentionPolicy policy, DayFunction dayOf) {
+      mRetention = policy;
+      mDayOf = dayOf;
+      mCompaction.active = false;
+    }
+
+    /**
+     * Does a slice of compaction if the journal is running out of room, see RETENTION_FOLD_INTO_DAYS. Call it
+     * regularly while no sync is running (folding acknowledges sessions a sync may be sending). Returns true
+     * while there's more to do.
+     */
+    bool compactStep() {
+      if (mRetention != RETENTION_FOLD_INTO_DAYS || !mDayOf || !mPartition || mHeadSector < 0 || mCompactionStalled) {
+        return false;
+      }
+      if (!mCompaction.active && !startCompaction()) {
+        return false;
+      }
+      // A sync since the last step acknowledged some of what's being folded, start over from the new first pending.
+      if (mCompaction.firstSeq != firstPendingSeq()) {
+        mCompaction.active = false;
+        return true;
+      }
+
+      for (uint32_t i = 0; i < COMPACTION_BATCH && mCompaction.nextSeq <= mCompaction.throughSeq; i++) {
+        TreadmillSession session;
+        if (isQuarantined(mCompaction.nextSeq)) {
+          mCompaction.nextSeq++;  // Dropped along with the sessions folded around it.
+          continue;
+        }
+        if (!read(mCompaction.nextSeq, session)) {
+          Debug.printf("Session journal: can't read session %u, compaction stopped.\n", mCompaction.nextSeq);
+          mCompaction.active = false;
+          return false;
+        }
+        uint32_t day = mDayOf(session.start);
+        if (mCompaction.folded > 0 && day != mCompaction.day) {
+          return writeDaySummary();
+        }
+        foldIntoSummary(session, day);
+        mCompaction.nextSeq++;
+        mCompaction.sessionsRead++;
+      }
+
+      if (mCompaction.nextSeq > mCompaction.throughSeq) {
+        bool ok = (mCompaction.folded > 0) ? writeDaySummary() : acknowledge(mCompaction.throughSeq);
+        mCompaction.active = false;
+        // Sessions are mostly day summaries already, folding again would churn the flash for little room.
+        if (mCompaction.summariesWritten * 2 > mCompaction.sessionsRead) {
+          Debug.println("Session journal: folding no longer frees enough room, waiting for a sync.");
+          mCompactionStalled = true;
+        }
+        return ok;
+      }
+      return true;
+    }
+
+  private:
+    // -----------------------------------------------------------------------
+    // Constants
+    // -----------------------------------------------------------------------
+    #if ESP_IDF_VERSION_MAJOR >= 5
+      typedef esp_partition_mmap_handle_t MmapHandle;
+      static constexpr esp_partition_mmap_memory_t MMAP_DATA = ESP_PARTITION_MMAP_DATA;
+    #else
+      typedef spi_flash_mmap_handle_t MmapHandle;
+      static constexpr spi_flash_mmap_memory_t MMAP_DATA = SPI_FLASH_MMAP_DATA;
+    #endif
+
+    static constexpr const char* PARTITION_LABEL = "sessions";
+    static constexpr esp_partition_subtype_t PARTITION_SUBTYPE = (esp_partition_subtype_t)0x40;
+
+    static constexpr uint32_t SECTOR_SIZE = 4096;
+    static constexpr uint32_t SECTOR_MAGIC = 0x334A5354;  // "TSJ3"
+    static constexpr uint32_t MAGIC_ERASED = 0xFFFFFFFF;
+
+    static constexpr uint8_t KIND_ACK = 0x02;
+    static constexpr uint8_t KIND_SESSION = 0x03;  // SessionRecordCodec::VERSION 1
+    static constexpr uint8_t KIND_DAY_SUMMARY = 0x04;
+    static constexpr uint8_t KIND_ERASED = 0xFF;
+
+    struct SectorHeader {
+      uint32_t magic;
+      uint32_t sectorSeq;  // Incremented each time a sector is opened, the highest one is the head.
+      uint32_t firstSeq;   // Sequence number the first session written into this sector gets.
+      uint32_t ackSeq;     // Last synced sequence number at the time the sector was opened.
+      uint32_t foldSeq;    // Last folded sequence number at the time the sector was opened.
+    };
+
+    static constexpr uint32_t CRC_SIZE = sizeof(uint16_t);
+    static constexpr uint32_t ACK_FRAME_SIZE = 1 + sizeof(uint32_t) + CRC_SIZE;
+    static constexpr uint32_t TYPICAL_SESSION_FRAME_SIZE = 18;
+    static constexpr uint32_t FOLD_SEQ_SIZE = sizeof(uint32_t);
+    static constexpr uint32_t MAX_FRAME_SIZE = 2 + FOLD_SEQ_SIZE + SessionRecordCodec::MAX_ENCODED_SIZE + CRC_SIZE;
+
+    static constexpr uint32_t COMPACTION_RESERVE_SECTORS = 2;
+    static constexpr uint32_t COMPACTION_BATCH = 8;
+
+    static constexpr unsigned long VERIFY_BUDGET_MS = 100;
+
+    // A record read back from flash.
+    struct JournalRecord {
+      uint8_t kind = KIND_ERASED;
+      uint32_t ack = 0;  // For KIND_ACK the synced seq, for KIND_DAY_SUMMARY the last folded seq.
+      SessionRecord session;
+    };
+
+    // RAM copy of a sector header. Built at boot and updated whenever a sector is opened.
+    struct SectorInfo {
+      bool valid = false;
+      bool verified = false;  // Its sessions went through verifySector() (or were written since boot).
+      uint32_t sectorSeq = 0;
+      uint32_t firstSeq = 0;
+    };
+
+    // Position of the record right after the last session read.
+    struct ReadCursor {
+      uint32_t seq = 0;
+      uint32_t sector = 0;
+      uint32_t sectorSeq = 0;
+      uint32_t offset = 0;
+      SessionRecordCodec::Anchor anchor;
+    };
+
+    // Where compaction of the oldest sector is up to.
+    struct Compaction {
+      bool active = false;
+      uint32_t firstSeq = 0;    // First session of the summary being built
+      uint32_t nextSeq = 0;     // Next session to fold
+      uint32_t throughSeq = 0;  // Last session of the sector being folded
+      uint32_t day = 0;
+      uint32_t folded = 0;      // Sessions in summary
+      SessionRecord summary;
+      uint32_t sessionsRead = 0;
+      uint32_t summariesWritten = 0;
+    };
+
+    struct SeqRange {
+      uint32_t first;
+      uint32_t last;
+    };
+
+    // -----------------------------------------------------------------------
+    // State
+    // -----------------------------------------------------------------------
+    const esp_partition_t* mPartition = nullptr;
+    uint32_t mSectorCount = 0;
+    std::vector<SectorInfo> mSectors;
+    int32_t mHeadSector = -1;  // -1 while the journal is empty
+    int32_t mTailSector = -1;
+    uint32_t mSpan = 0;        // Sectors from the tail to the head, inclusive.
+    uint32_t mWriteOffset = 0;
+    uint32_t mNextSeq = 1;
+    uint32_t mAckSeq = 0;
+    uint32_t mFoldSeq = 0;
+    SessionRecordCodec::Anchor mHeadAnchor;  // Previous session in the head sector, what the next one is encoded against.
+    ReadCursor mCursor;
+    const uint8_t* mMapped = nullptr;  // Read-only view of the whole partition, flash writes and erases show up in it.
+    MmapHandle mMapHandle = 0;
+    std::vector<uint8_t> mCache;  // Copy of one sector when the partition isn't mapped, see sectorData()
+    int32_t mCachedSector = -1;
+    RetentionPolicy mRetention = RETENTION_KEEP_OLDEST;
+    DayFunction mDayOf = nullptr;
+    Compaction mCompaction;
+    bool mCompactionStalled = false;  // Folding stopped paying off, wait for a sync.
+    std::vector<SeqRange> mQuarantine;  // Ascending, sessions that can't be read back.
+
+    // -----------------------------------------------------------------------
+    // Boot scan
+    // -----------------------------------------------------------------------
+    void scan() {
+      mHeadSector = -1;
+      mTailSector = -1;
+      mSpan = 0;
+      mNextSeq = 1;
+      mAckSeq = 0;
+      mFoldSeq = 0;
+      mQuarantine.clear();
+
+      SectorHeader hdr;
+      for (uint32_t i = 0; i < mSectorCount; i++) {
+        if (readHeader(i, hdr)) {
+          mSectors[i].valid = true;
+          mSectors[i].sectorSeq = hdr.sectorSeq;
+          mSectors[i].firstSeq = hdr.firstSeq;
+          if (mHeadSector < 0 || (int32_t)(hdr.sectorSeq - mSectors[mHeadSector].sectorSeq) > 0) {
+            mHeadSector = i;
+          }
+        }
+      }
+      if (mHeadSector < 0) {
+        Debug.println("Session journal is empty.");
+        return;
+      }
+
+      // Sectors are opened in ring order, so walking backwards from the head the sector sequence numbers go
+      // down by one each step until we reach the tail. Anything that breaks the chain is left over from an
+      // interrupted erase and isn't part of the journal.
+      mTailSector = mHeadSector;
+      mSpan = 1;
+      while (mSpan < mSectorCount) {
+        uint32_t prev = (mTailSector + mSectorCount - 1) % mSectorCount;
+        if (!mSectors[prev].valid || mSectors[prev].sectorSeq != mSectors[mTailSector].sectorSeq - 1) {
+          break;
+        }
+        mTailSector = prev;
+        mSpan++;
+      }
+      for (uint32_t i = 0; i < mSectorCount; i++) {
+        if (!isInJournal(i)) {
+          mSectors[i].valid = false;
+        }
+      }
+
+      readHeader(mHeadSector, hdr);
+      mNextSeq = hdr.firstSeq;
+      mAckSeq = hdr.ackSeq;
+      mFoldSeq = hdr.foldSeq;
+      mHeadAnchor = SessionRecordCodec::sectorAnchor(hdr.firstSeq);
+
+      // Walk the head sector to find the end of the records, the last seq and any acks written after it was opened.
+      uint32_t offset = sizeof(SectorHeader);
+      while (offset < SECTOR_SIZE) {
+        JournalRecord rec;
+        uint32_t len = readRecord(mHeadSector, offset, SECTOR_SIZE, mHeadAnchor, rec);
+        if (len == 0) {
+          if (rec.kind != KIND_ERASED) {
+            // Most likely power was cut while this record was being written. Flash can't be rewritten without
+            // an erase, so close the sector rather than appending after the damaged bytes.
+            Debug.printf("Session journal: discarding torn record 0x%02X at offset %u, closing sector.\n", rec.kind, offset);
+            offset = SECTOR_SIZE;
+          }
+          break;
+        }
+        if (rec.kind == KIND_ACK || rec.kind == KIND_DAY_SUMMARY) {
+          if (rec.ack > mAckSeq) mAckSeq = rec.ack;
+        }
+        if (rec.kind == KIND_DAY_SUMMARY && rec.ack > mFoldSeq) {
+          mFoldSeq = rec.ack;
+        }
+        if (rec.kind != KIND_ACK) {
+          mNextSeq = rec.session.seq + 1;
+        }
+        offset += len;
+      }
+      mWriteOffset = offset;
+      mSectors[mHeadSector].verified = true;  // Only the records walked above are ever read.
+    }
+
+    /**
+     * Verifies the sectors holding unsynced sessions, oldest first, until they're all done or the budget is used up.
+     */
+    void verifyPending() {
+      if (pendingCount() == 0) {
+        return;
+      }
+      unsigned long start = millis();
+      uint32_t checked = 0;
+      for (uint32_t sector = findSectorFor(firstPendingSeq()); sector != (uint32_t)mHeadSector; sector = (sector + 1) % mSectorCount) {
+        if (millis() - start >= VERIFY_BUDGET_MS) {
+          Debug.println("Session journal: verify budget used up, the remaining sectors are verified when read.");
+          break;
+        }
+        if (!mSectors[sector].verified) {
+          verifySector(sector);
+          checked++;
+        }
+      }
+      Debug.printf("Session journal: verified %u sectors in %lums, %u sessions quarantined\n",
+                   checked, millis() - start, quarantinedCount());
+    }
+
+    /**
+     * Walks the records of a closed sector, out of a single read of the whole sector, and quarantines every
+     * session from the first one that can't be read back to the end of the sector. Records are variable length
+     * and delta encoded, so nothing after a bad record can be trusted.
+     */
+    void verifySector(uint32_t sector) {
+      SectorInfo& info = mSectors[sector];
+      info.verified = true;
+      uint32_t lastSeq = mSectors[(sector + 1) % mSectorCount].firstSeq - 1;
+      if (lastSeq < info.firstSeq) {
+        return;  // Only acks in this sector.
+      }
+
+      SessionRecordCodec::Anchor anchor = SessionRecordCodec::sectorAnchor(info.firstSeq);
+      uint32_t expected = info.firstSeq;
+      uint32_t offset = sizeof(SectorHeader);
+      while (offset < SECTOR_SIZE && expected <= lastSeq) {
+        JournalRecord rec;
+        uint32_t len = readRecord(sector, offset, SECTOR_SIZE, anchor, rec);
+        if (len == 0) {
+          break;
+        }
+        offset += len;
+        if (rec.kind == KIND_ACK) {
+          continue;
+        }
+        if (rec.session.seq != expected) {
+          break;
+        }
+        expected++;
+      }
+
+      if (expected <= lastSeq && lastSeq > mAckSeq) {
+        uint32_t first = (expected > mAckSeq) ? expected : mAckSeq + 1;
+        Debug.printf("Session journal: sector %u is damaged at offset %u, quarantining sessions %u-%u\n",
+                     sector, offset, first, lastSeq);
+        quarantine(first, lastSeq);
+      }
+    }
+
+    void quarantine(uint32_t first, uint32_t last) {
+      size_t i = 0;
+      while (i < mQuarantine.size() && mQuarantine[i].first < first) {
+        i++;
+      }
+      mQuarantine.insert(mQuarantine.begin() + i, SeqRange{ first, last });
+    }
+
+    bool isQuarantined(uint32_t seq) const {
+      for (const SeqRange& range : mQuarantine) {
+        if (seq >= range.first && seq <= range.last) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    bool isInJournal(uint32_t sector) const {
+      if (mTailSector < 0) {
+        return false;
+      }
+      return ((sector + mSectorCount - mTailSector) % mSectorCount) < mSpan;
+    }
+
+    // -----------------------------------------------------------------------
+    // Writing
+    // -----------------------------------------------------------------------
+    bool hasRoom(uint32_t len) const {
+      return mHeadSector >= 0 && mWriteOffset + len <= SECTOR_SIZE;
+    }
+
+    bool ensureRoom(uint32_t len) {
+      return hasRoom(len) || openNextSector();
+    }
+
+    uint32_t encodeSessionFrame(const SessionRecord& rec, uint8_t* frame) const {
+      uint32_t len = SessionRecordCodec::encode(rec, mHeadAnchor, frame + 2);
+      frame[0] = KIND_SESSION;
+      frame[1] = (uint8_t)len;
+      return appendCrc(frame, 2 + len);
+    }
+
+    /**
+     * Erases the sector after the head and makes it the new head. Once the ring is full that sector is the
+     * tail, so it's refused if the tail still holds sessions the mobile app hasn't synced.
+     */
+    bool openNextSector() {
+      uint32_t target = (mHeadSector < 0) ? 0 : (mHeadSector + 1) % mSectorCount;
+      bool reclaimingTail = (mSpan == mSectorCount);
+
+      if (reclaimingTail) {
+        uint32_t lastSeqInTarget = mSectors[(target + 1) % mSectorCount].firstSeq - 1;
+        if (lastSeqInTarget > mAckSeq && lastSeqInTarget >= mSectors[target].firstSeq) {
+          return false;
+        }
+      }
+
+      // Drop the sector from the table before erasing it, if anything below fails it's simply not part of the ring.
+      mSectors[target].valid = false;
+      if (mCachedSector == (int32_t)target) {
+        mCachedSector = -1;
+      }
+      if (esp_partition_erase_range(mPartition, sectorAddress(target), SECTOR_SIZE) != ESP_OK) {
+        Debug.printf("ERROR: Failed to erase journal sector %u\n", target);
+        return false;
+      }
+
+      // Write the header with the magic still erased, then commit it by programming the magic on its own.
+      uint32_t sectorSeq = (mHeadSector < 0) ? 1 : mSectors[mHeadSector].sectorSeq + 1;
+      SectorHeader hdr = { MAGIC_ERASED, sectorSeq, mNextSeq, mAckSeq, mFoldSeq };
+      uint32_t magic = SECTOR_MAGIC;
+      if (esp_partition_write(mPartition, sectorAddress(target), &hdr, sizeof(hdr)) != ESP_OK ||
+          esp_partition_write(mPartition, sectorAddress(target), &magic, sizeof(magic)) != ESP_OK) {
+        Debug.printf("ERROR: Failed to write header of journal sector %u\n", target);
+        return false;
+      }
+
+      mSectors[target].valid = true;
+      mSectors[target].verified = true;
+      mSectors[target].sectorSeq = hdr.sectorSeq;
+      mSectors[target].firstSeq = hdr.firstSeq;
+
+      if (mHeadSector < 0) {
+        mTailSector = target;
+        mSpan = 1;
+      } else if (reclaimingTail) {
+        mTailSector = (mTailSector + 1) % mSectorCount;
+      } else {
+        mSpan++;
+      }
+      mHeadSector = target;
+      mWriteOffset = sizeof(SectorHeader);
+      mHeadAnchor = SessionRecordCodec::sectorAnchor(hdr.firstSeq);
+      Debug.printf("Session journal: opened sector %u (sectorSeq=%u, firstSeq=%u)\n", target, hdr.sectorSeq, hdr.firstSeq);
+      return true;
+    }
+
+    /**
+     * Sectors from the oldest one holding an unsynced session to the head, these can't be reclaimed.
+     */
+    uint32_t pendingSectors() const {
+      if (mHeadSector < 0 || pendingCount() == 0) {
+        return 0;
+      }
+      return (mHeadSector + mSectorCount - findSectorFor(firstPendingSeq())) % mSectorCount + 1;
+    }
+
+    /**
+     * Starts folding the oldest sector with unsynced sessions if the journal is running out of free sectors.
+     */
+    bool startCompaction() {
+      if (mSectorCount - pendingSectors() >= COMPACTION_RESERVE_SECTORS) {
+        return false;
+      }
+      uint32_t first = firstPendingSeq();
+      uint32_t sector = findSectorFor(first);
+      if (sector == (uint32_t)mHeadSector) {
+        return false;  // Everything pending is in the head, nothing to reclaim.
+      }
+      mCompaction = Compaction();
+      mCompaction.active = true;
+      mCompaction.firstSeq = first;
+      mCompaction.nextSeq = first;
+      mCompaction.throughSeq = mSectors[(sector + 1) % mSectorCount].firstSeq - 1;
+      Debug.printf("Session journal: %u of %u sectors hold unsynced sessions, folding sessions %u-%u into day summaries.\n",
+                   pendingSectors(), mSectorCount, mCompaction.firstSeq, mCompaction.throughSeq);
+      return true;
+    }
+
+    void foldIntoSummary(const TreadmillSession& session, uint32_t day) {
+      SessionRecord& sum = mCompaction.summary;
+      uint32_t activeSecs = session.activeSecs ? session.activeSecs : (session.stop - session.start);
+      if (mCompaction.folded == 0) {
+        sum = toRecord(session, 0);
+        sum.activeSecs = activeSecs;
+        mCompaction.day = day;
+      } else {
+        if (session.start < sum.start) sum.start = session.start;
+        if (session.stop > sum.stop) sum.stop = session.stop;
+        sum.steps += session.steps;
+        sum.distanceMeters += session.distanceMeters;
+        sum.calories += session.calories;
+        sum.activeSecs += activeSecs;
+      }
+      mCompaction.folded++;
+    }
+
+    /**
+     * Appends the summary of the sessions folded so far. The record acknowledges them at the same time.
+     */
+    bool writeDaySummary() {
+      uint32_t foldSeq = mCompaction.nextSeq - 1;
+      SessionRecord rec = mCompaction.summary;
+      rec.seq = mNextSeq;
+
+      uint8_t frame[MAX_FRAME_SIZE];
+      uint32_t frameLen = encodeDaySummaryFrame(rec, foldSeq, frame);
+      if (!hasRoom(frameLen + ACK_FRAME_SIZE)) {
+        if (!openNextSector()) {
+          Debug.println("ERROR: No room left in the journal for a day summary, compaction stopped.");
+          mCompaction.active = false;
+          return false;
+        }
+        frameLen = encodeDaySummaryFrame(rec, foldSeq, frame);
+      }
+      if (!writeAtHead(frame, frameLen)) {
+        mCompaction.active = false;
+        return false;
+      }
+      mHeadAnchor.advance(rec);
+      mNextSeq++;
+      mAckSeq = foldSeq;
+      mFoldSeq = foldSeq;
+
+      #ifdef VERBOSE_LOGGING
+        Debug.printf("Session journal: folded sessions %u-%u (%u steps) into session %u\n",
+                     mCompaction.firstSeq, foldSeq, rec.steps, rec.seq);
+      #endif
+      mCompaction.firstSeq = foldSeq + 1;
+      mCompaction.folded = 0;
+      mCompaction.summariesWritten++;
+      return true;
+    }
+
+    uint32_t encodeDaySummaryFrame(const SessionRecord& rec, uint32_t foldSeq, uint8_t* frame) const {
+      uint32_t len = SessionRecordCodec::encode(rec, mHeadAnchor, frame + 2 + FOLD_SEQ_SIZE);
+      frame[0] = KIND_DAY_SUMMARY;
+      frame[1] = (uint8_t)(FOLD_SEQ_SIZE + len);
+      memcpy(frame + 2, &foldSeq, FOLD_SEQ_SIZE);
+      return appendCrc(frame, 2 + FOLD_SEQ_SIZE + len);
+    }
+
+    bool writeAtHead(const void* data, uint32_t len) {
+      if (esp_partition_write(mPartition, sectorAddress(mHeadSector) + mWriteOffset, data, len) != ESP_OK) {
+        Debug.printf("ERROR: Journal write failed at sector %d offset %u, closing sector.\n", mHeadSector, mWriteOffset);
+        // Part of the record may have made it to flash, never write after it.
+        mWriteOffset = SECTOR_SIZE;
+        if (mCachedSector == mHeadSector) {
+          mCachedSector = -1;
+        }
+        return false;
+      }
+      if (mCachedSector == mHeadSector) {
+        memcpy(mCache.data() + mWriteOffset, data, len);
+      }
+      mWriteOffset += len;
+      return true;
+    }
+
+    // -----------------------------------------------------------------------
+    // Reading
+    // -----------------------------------------------------------------------
+
+    /**
+     * The sectors from the tail to the head start at ascending sequence numbers, so binary search them.
+     */
+    uint32_t findSectorFor(uint32_t seq) const {
+      uint32_t lo = 0;
+      uint32_t hi = mSpan - 1;
+      while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (mSectors[(mTailSector + mid) % mSectorCount].firstSeq <= seq) {
+          lo = mid;
+        } else {
+          hi = mid - 1;
+        }
+      }
+      return (mTailSector + lo) % mSectorCount;
+    }
+
+    /**
+     * Walks the records of a sector from offset until it finds the session, then leaves the cursor
+     * right behind it so the next sequential read is a single record read.
+     */
+    bool readFromSector(uint32_t sector, uint32_t offset, SessionRecordCodec::Anchor anchor, uint32_t seq, TreadmillSession& out) {
+      if (!mSectors[sector].verified) {
+        verifySector(sector);
+      }
+      if (isQuarantined(seq)) {
+        return false;
+      }
+      uint32_t end = (sector == (uint32_t)mHeadSector) ? mWriteOffset : SECTOR_SIZE;
+      while (offset < end) {
+        JournalRecord rec;
+        uint32_t len = readRecord(sector, offset, end, anchor, rec);
+        if (len == 0) {
+          break;
+        }
+        offset += len;
+        if (rec.kind == KIND_ACK) {
+          continue;
+        }
+        if (rec.session.seq == seq) {
+          out = fromRecord(rec.session);
+          mCursor = { seq + 1, sector, mSectors[sector].sectorSeq, offset, anchor };
+          return true;
+        }
+        if (rec.session.seq > seq) {
+          return false;
+        }
+      }
+
+      // The session after the last one in a sector is the first one of the next sector.
+      if (sector != (uint32_t)mHeadSector) {
+        uint32_t next = (sector + 1) % mSectorCount;
+        if (mSectors[next].valid && mSectors[next].firstSeq <= seq) {
+          return readFromSector(next, sizeof(SectorHeader), SessionRecordCodec::sectorAnchor(mSectors[next].firstSeq), seq, out);
+        }
+      }
+      return false;
+    }
+
+    /**
+     * Decodes the record at offset in place, see sectorData(). Sessions are decoded relative to anchor, which is
+     * advanced past them. Returns the size of the record, or 0 at the end of the records or if the record can't
+     * be parsed (rec.kind tells which).
+     */
+    uint32_t readRecord(uint32_t sector, uint32_t offset, uint32_t end, SessionRecordCodec::Anchor& anchor, JournalRecord& rec) {
+      const uint8_t* data = sectorData(sector);
+      rec.kind = KIND_ERASED;
+      if (!data || offset >= end) {
+        return 0;
+      }
+      const uint8_t* buf = data + offset;
+      uint32_t avail = (end - offset < MAX_FRAME_SIZE) ? (end - offset) : MAX_FRAME_SIZE;
+      rec.kind = buf[0];
+
+      // Size of the kind and payload, the CRC follows.
+      uint32_t len;
+      switch (rec.kind) {
+        case KIND_SESSION:
+        case KIND_DAY_SUMMARY: len = (avail >= 2) ? 2 + buf[1] : SECTOR_SIZE; break;
+        case KIND_ACK:         len = 1 + sizeof(uint32_t); break;
+        default:               return 0;
+      }
+      if (len + CRC_SIZE > avail) {
+        return 0;
+      }
+      uint16_t stored;
+      memcpy(&stored, buf + len, sizeof(stored));
+      if (stored != crc16(buf, len)) {
+        return 0;
+      }
+
+      switch (rec.kind) {
+        case KIND_SESSION:
+          if (!SessionRecordCodec::decode(buf + 2, len - 2, anchor, rec.session)) {
+            return 0;
+          }
+          anchor.advance(rec.session);
+          break;
+        case KIND_DAY_SUMMARY:
+          if (len < 2 + FOLD_SEQ_SIZE ||
+              !SessionRecordCodec::decode(buf + 2 + FOLD_SEQ_SIZE, len - 2 - FOLD_SEQ_SIZE, anchor, rec.session)) {
+            return 0;
+          }
+          memcpy(&rec.ack, buf + 2, FOLD_SEQ_SIZE);
+          anchor.advance(rec.session);
+          break;
+        case KIND_ACK:
+          memcpy(&rec.ack, buf + 1, sizeof(rec.ack));
+          break;
+      }
+      return len + CRC_SIZE;
+    }
+
+    static SessionRecord toRecord(const TreadmillSession& session, uint32_t seq) {
+      SessionRecord rec;
+      rec.seq = seq;
+      rec.start = session.start;
+      rec.stop = session.stop;
+      rec.steps = session.steps;
+      rec.distanceMeters = session.distanceMeters;
+      rec.calories = session.calories;
+      rec.activeSecs = session.activeSecs;
+      return rec;
+    }
+
+    static TreadmillSession fromRecord(const SessionRecord& rec) {
+      TreadmillSession session;
+      session.start = rec.start;
+      session.stop = rec.stop;
+      session.steps = rec.steps;
+      session.distanceMeters = rec.distanceMeters;
+      session.calories = rec.calories;
+      session.activeSecs = rec.activeSecs;
+      return session;
+    }
+
+    /**
+     * Returns the contents of a sector. That's the mapped flash itself if the partition is mapped, otherwise a
+     * RAM copy that's only read from flash if it isn't the sector already cached. Writes to the head go to the
+     * copy as well, so it never has to be reloaded while a sync is running.
+     */
+    const uint8_t* sectorData(uint32_t sector) {
+      if (mMapped) {
+        return mMapped + sectorAddress(sector);
+      }
+      if (mCachedSector != (int32_t)sector) {
+        mCache.resize(SECTOR_SIZE);
+        if (!readBytes(sector, 0, mCache.data(), SECTOR_SIZE)) {
+          mCachedSector = -1;
+          return nullptr;
+        }
+        mCachedSector = sector;
+      }
+      return mCache.data();
+    }
+
+    bool readHeader(uint32_t sector, SectorHeader& hdr) const {
+      return readBytes(sector, 0, &hdr, sizeof(hdr)) && hdr.magic == SECTOR_MAGIC;
+    }
+
+    /**
+     * Writes the CRC of the first len bytes of frame right behind them, returns the new length.
+     */
+    static uint32_t appendCrc(uint8_t* frame, uint32_t len) {
+      uint16_t crc = crc16(frame, len);
+      memcpy(frame + len, &crc, sizeof(crc));
+      return len + sizeof(crc);
+    }
+
+    bool readBytes(uint32_t sector, uint32_t offset, void* dst, uint32_t len) const {
+      if (mMapped) {
+        memcpy(dst, mMapped + sectorAddress(sector) + offset, len);
+        return true;
+      }
+      return esp_partition_read(mPartition, sectorAddress(sector) + offset, dst, len) == ESP_OK;
+    }
+
+    static uint32_t sectorAddress(uint32_t sector) {
+      return sector * SECTOR_SIZE;
+    }
+};
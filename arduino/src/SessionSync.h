@@ -0,0 +1,550 @@
+#pragma once
+
+#include <Arduino.h>
+#include "globals.h"
+#include "SessionStore.h"
+
+/**
+ * Where SessionSync's notifications go, the data characteristic on the device. LiveMetricsNotifier uses it too.
+ */
+class SyncTransport {
+  public:
+    virtual ~SyncTransport() {}
+    virtual bool send(const uint8_t* data, size_t len) = 0;
+};
+
+/**
+ * How far each app's sync got, kept across disconnects so a sync cut off by a flaky link resumes where it
+ * stopped instead of starting over. Apps name a sync with a random token they keep until it's complete (see
+ * SessionSync), an app that was restarted in between comes with a new token and gets everything again.
+ */
+class SyncResumeTable {
+  public:
+    static constexpr uint32_t MAX_SYNCS = 4;
+
+    /**
+     * Last seq the sync with this token got to (everything up to it arrived), 0 if it's not known.
+     */
+    uint32_t deliveredSeq(uint32_t token) const {
+      for (const Entry& entry : mEntries) {
+        if (token && entry.token == token) {
+          return entry.seq;
+        }
+      }
+      return 0;
+    }
+
+    void update(uint32_t token, uint32_t seq) {
+      if (!token) {
+        return;
+      }
+      Entry* target = &mEntries[0];
+      for (Entry& entry : mEntries) {
+        if (entry.token == token) {
+          target = &entry;
+          break;
+        }
+        if (entry.lastUsed < target->lastUsed) {
+          target = &entry;  // Least recently used, replaced if the token isn't in the table
+        }
+      }
+      target->token = token;
+      target->seq = seq;
+      target->lastUsed = ++mUseCount;
+    }
+
+  private:
+    struct Entry {
+      uint32_t token = 0;
+      uint32_t seq = 0;
+      uint32_t lastUsed = 0;
+    };
+
+    Entry mEntries[MAX_SYNCS];
+    uint32_t mUseCount = 0;
+};
+
+/**
+ * Sends the unsynced sessions to the mobile app over the data characteristic.
+ *
+ * Legacy format, what older app builds understand: every notification is one 12 byte session, start (4),
+ * stop (4) and steps (4), big-endian, and the next one goes out when the app writes 0x01 (confirm) to the
+ * confirm characteristic. A notification the stack couldn't queue is sent again, but one that went out is never
+ * resent on a timeout: the stop-and-wait formats have no seq, so the app would store a resent session twice and
+ * a late confirm would be taken for the resend's, putting every later confirm one behind. The link layer
+ * retransmits what it queued until the connection drops.
+ *
+ * The app can ask for a newer format by writing a hello, [0x02][version], to the confirm characteristic before
+ * subscribing. They all pack as many sessions per notification as fit the negotiated MTU:
+ *  - Version 1, stop-and-wait: [0xB1][1][count][sessions], one batch per confirm.
+ *  - Version 2, windowed: [0xB1][2][count][batch seq][sessions]. Up to WINDOW_SIZE batches are in flight. The app
+ *    acks with [0x03][seq][bitmap]: every batch up to seq arrived, plus bit i for batch seq + 1 + i that arrived
+ *    out of order. Batch seqs start at 1 for every sync and wrap around after 255. A batch that isn't acked within
+ *    RETRANSMIT_MS, or whose notification couldn't be queued, is sent again. Congestion (a failed notify or a
+ *    busy status from the stack) halves the window, every ack that moves it grows it by one again.
+ *  - Version 3, windowed with cursors: like version 2, but each session is prefixed with its journal seq (4) and
+ *    the hello carries a cursor, [0x02][3][seq (4)], meaning the app has durably stored every session up to seq.
+ *    The sync sends what comes after it, as far back as the journal still has sessions: a durable ack lets the
+ *    journal free the space of the sessions it covers once it needs it, it doesn't hide them from an app whose
+ *    cursor is further behind (another phone). Sessions compaction folded into day summaries are the exception,
+ *    a cursor from before the last fold starts after it, so the app gets the summaries and not the sessions
+ *    they replace as well. An app without a cursor (0) gets the unsynced sessions.
+ *    The done marker is [0xFF][seq (4)], the last seq the sync covered. Nothing is marked as synced until the app
+ *    writes a durable ack, [0x04][seq (4)], once the sessions are safely stored on the phone. The done marker is
+ *    sent again every RETRANSMIT_MS until that ack arrives, so a lost one doesn't stall the sync. A cursor in the
+ *    hello counts as a durable ack too, so a lost ack only means the next sync starts with it. All seqs are
+ *    big-endian.
+ *    The hello can also carry a sync token, [0x02][3][seq (4)][token (4)]. If a sync with the same token was
+ *    cut off, it resumes after the last batch the app acked (see SyncResumeTable), the app keeps what it got
+ *    before the disconnect. Sessions may still arrive twice across a reconnect, the app drops seqs it has.
+ *
+ * In versions 0 to 2 the done marker is a single 0xFF that goes out once the app has confirmed or acked everything
+ * sent, and that's when the sessions sent are marked as synced. The app disconnects when it gets it, until then
+ * it's sent again every RETRANSMIT_MS in case it was lost.
+ */
+class SessionSync {
+  public:
+    static constexpr uint8_t CONFIRM = 0x01;
+    static constexpr uint8_t HELLO = 0x02;
+    static constexpr uint8_t ACK = 0x03;
+    static constexpr uint8_t DURABLE_ACK = 0x04;
+    static constexpr uint8_t BATCH_MARKER = 0xB1;
+    static constexpr uint8_t DONE_MARKER = 0xFF;
+    static constexpr uint8_t FORMAT_BATCHED = 1;
+    static constexpr uint8_t FORMAT_WINDOWED = 2;
+    static constexpr uint8_t FORMAT_CURSORS = 3;
+    static constexpr uint8_t FORMAT_VERSION = FORMAT_CURSORS;  // Newest one we speak
+
+    static constexpr uint32_t MAX_PAYLOAD = 512;  // Longest attribute value
+    static constexpr uint16_t DEFAULT_MTU = 23;
+
+    static constexpr uint32_t WINDOW_SIZE = 6;
+    static constexpr uint32_t RETRANSMIT_MS = 1000;
+    static constexpr uint32_t BACKOFF_MS = 20;  // After congestion, before sending again
+    static constexpr uint32_t MAX_DONE_RETRANSMITS = 60;  // Gives up on the durable ack or disconnect after that
+
+    SessionSync(SessionStore& store, SyncResumeTable& resume) : mStore(store), mResume(resume) {}
+
+    /**
+     * For a new connection: legacy format and the default MTU until the app says otherwise.
+     */
+    void reset() {
+      mVersion = 0;
+      mMtu = DEFAULT_MTU;
+      mCursor = 0;
+      mToken = 0;
+      mActive = false;
+    }
+
+    /**
+     * Starts a sync from the first unsynced session. With a cursor it starts right after the cursor instead, or
+     * at the oldest session the journal still has if that's later, and never before the sessions compaction
+     * folded (the app gets the day summaries that replaced them, see SessionStore::foldSeq()).
+     */
+    void start() {
+      mActive = true;
+      mNextSeq = mStore.firstPendingSeq();
+      if (mCursor) {
+        mNextSeq = mCursor + 1;
+        if (mNextSeq < mStore.oldestStoredSeq()) {
+          mNextSeq = mStore.oldestStoredSeq();
+        }
+        if (mNextSeq <= mStore.foldSeq()) {
+          mNextSeq = mStore.foldSeq() + 1;
+        }
+      }
+      mStartSeq = mNextSeq;
+      uint32_t delivered = mResume.deliveredSeq(mToken);
+      if (delivered >= mNextSeq && delivered < mStore.nextSeq()) {
+        Debug.printf("Resuming the interrupted sync after session %u\n", delivered);
+        mNextSeq = delivered + 1;
+      }
+      mInFlightCount = 0;
+      mNextBatchSeq = 1;
+      mWindow = WINDOW_SIZE;
+      mBackoffUntil = 0;
+      mDoneSent = false;
+      mDoneRetransmits = 0;
+    }
+
+    void setMtu(uint16_t mtu) {
+      mMtu = mtu;
+    }
+
+    /**
+     * The app's hello, [0x02][newest format it understands] with the cursor for version 3. Returns the seq the
+     * cursor durably acknowledges, 0 if none. A cursor past the newest session (the journal was formatted since)
+     * is ignored.
+     */
+    uint32_t handleHello(const uint8_t* data, size_t len) {
+      if (len < 2 || data[0] != HELLO) {
+        return 0;
+      }
+      mVersion = (data[1] < FORMAT_VERSION) ? data[1] : FORMAT_VERSION;
+      mCursor = 0;
+      mToken = (hasCursors() && len >= 10) ? readUint32(data + 6) : 0;
+      if (hasCursors() && len >= 6) {
+        uint32_t cursor = readUint32(data + 2);
+        if (cursor < mStore.nextSeq()) {
+          mCursor = cursor;
+        } else {
+          Debug.printf("Sync cursor %u is past the newest session %u, ignored.\n", cursor, mStore.nextSeq() - 1);
+        }
+      }
+      return mCursor;
+    }
+
+    /**
+     * The app's durable ack, [0x04][seq]. Returns the seq, 0 if it's malformed.
+     */
+    static uint32_t parseDurableAck(const uint8_t* data, size_t len) {
+      if (len < 5 || data[0] != DURABLE_ACK) {
+        return 0;
+      }
+      return readUint32(data + 1);
+    }
+
+    /**
+     * Version 3: the app durably acked seq. Once that covers the done marker the sync is over. Returns true if
+     * it ended the sync.
+     */
+    bool handleDurableAck(uint32_t seq) {
+      if (!mActive || !mDoneSent || seq < mNextSeq - 1) {
+        return false;
+      }
+      mActive = false;
+      return true;
+    }
+
+    uint8_t version() const {
+      return mVersion;
+    }
+
+    bool isBatching() const {
+      return mVersion >= FORMAT_BATCHED;
+    }
+
+    bool isWindowed() const {
+      return mVersion >= FORMAT_WINDOWED;
+    }
+
+    bool hasCursors() const {
+      return mVersion >= FORMAT_CURSORS;
+    }
+
+    /**
+     * A sync was started and isn't over: the app hasn't disconnected after the done marker, or for version 3
+     * hasn't durably acked it. Needs pump() called.
+     */
+    bool isActive() const {
+      return mActive;
+    }
+
+    /**
+     * Sessions per notification at the current MTU.
+     */
+    uint32_t batchCapacity() const {
+      if (!isBatching()) {
+        return 1;
+      }
+      uint32_t payload = (mMtu > 3) ? mMtu - 3 : 0;
+      if (payload > MAX_PAYLOAD) {
+        payload = MAX_PAYLOAD;
+      }
+      uint32_t capacity = (payload > headerSize()) ? (payload - headerSize()) / recordSize() : 0;
+      return (capacity < 1) ? 1 : capacity;
+    }
+
+    /**
+     * Stop-and-wait formats: the app confirmed the notification in flight, pump() sends the next one. Returns
+     * false if nothing was waiting for it.
+     */
+    bool handleConfirm() {
+      if (!mActive || isWindowed() || mInFlightCount == 0) {
+        return false;
+      }
+      mInFlightCount = 0;
+      return true;
+    }
+
+    /**
+     * Windowed formats: an ack from the app, [0x03][seq][bitmap]. Returns false if it's malformed.
+     */
+    bool handleAck(const uint8_t* data, size_t len) {
+      if (!mActive || !isWindowed() || len < 2 || data[0] != ACK) {
+        return false;
+      }
+      uint8_t cumulative = data[1];
+      uint8_t bitmap = (len >= 3) ? data[2] : 0;
+
+      int32_t lastSelective = -1;
+      for (uint32_t i = 0; i < mInFlightCount; i++) {
+        InFlight& batch = mInFlight[i];
+        uint8_t ahead = (uint8_t)(batch.seq - cumulative);  // 0 or "negative" means covered by the cumulative ack
+        if (ahead == 0 || ahead >= 128) {
+          batch.acked = true;
+        } else if (ahead <= 8 && (bitmap & (1 << (ahead - 1)))) {
+          batch.acked = true;
+          lastSelective = i;
+        }
+      }
+
+      // Notifications arrive in order, so a gap before a batch that was acked selectively was lost. Resend it
+      // now rather than after RETRANSMIT_MS, once, after that the timeout takes over.
+      for (int32_t i = 0; i < lastSelective; i++) {
+        InFlight& batch = mInFlight[i];
+        if (!batch.acked && !batch.fastRetransmitted) {
+          batch.fastRetransmitted = true;
+          batch.queued = false;
+        }
+      }
+
+      bool advanced = false;
+      while (mInFlightCount > 0 && mInFlight[0].acked) {
+        mResume.update(mToken, mInFlight[0].end - 1);
+        for (uint32_t i = 1; i < mInFlightCount; i++) {
+          mInFlight[i - 1] = mInFlight[i];
+        }
+        mInFlightCount--;
+        advanced = true;
+      }
+      if (advanced && mWindow < WINDOW_SIZE) {
+        mWindow++;
+      }
+      return true;
+    }
+
+    /**
+     * The stack couldn't queue a notification (out of buffers, busy), back off and shrink the window.
+     */
+    void onCongestion(uint32_t now) {
+      if ((int32_t)(now - mBackoffUntil) < 0) {
+        return;  // Already backing off for this one
+      }
+      mWindow = (mWindow > 1) ? mWindow / 2 : 1;
+      mBackoffUntil = now + BACKOFF_MS;
+      Debug.printf("Sync congested, window down to %u\n", mWindow);
+    }
+
+    /**
+     * Sends new batches while the window has room (one for the stop-and-wait formats) and retransmits the ones
+     * that couldn't be queued or, windowed, timed out. Call it from the loop and after every confirm or ack. Returns true once the done marker went
+     * out, ackSeq is then the seq of the last session sent, 0 if there was none or the app acks durably. Sessions
+     * that failed the integrity check are skipped, acking past them drops them. After that it resends the done
+     * marker until the app disconnects, or for version 3 until the durable ack, see handleDurableAck().
+     */
+    bool pump(SyncTransport& transport, uint32_t now, uint32_t& ackSeq) {
+      if (!mActive || (int32_t)(now - mBackoffUntil) < 0) {
+        return false;
+      }
+      if (mDoneSent) {
+        resendDoneMarker(transport, now);
+        return false;
+      }
+
+      // Retransmit what never made it out, and for the windowed formats what timed out.
+      for (uint32_t i = 0; i < mInFlightCount; i++) {
+        InFlight& batch = mInFlight[i];
+        if (batch.acked || (batch.queued && (!isWindowed() || now - batch.sentAt < RETRANSMIT_MS))) {
+          continue;
+        }
+        if (!sendBatch(transport, batch, now)) {
+          onCongestion(now);
+          return false;
+        }
+      }
+
+      // New batches.
+      uint8_t payload[MAX_PAYLOAD];
+      uint32_t window = isWindowed() ? mWindow : 1;
+      while (mInFlightCount < window) {
+        InFlight& batch = mInFlight[mInFlightCount];
+        batch.seq = mNextBatchSeq;
+        batch.first = mNextSeq;
+        uint32_t count = fillBatch(batch.first, mStore.nextSeq(), batch.end, payload);
+        mNextSeq = batch.end;  // Past any unreadable sessions even if nothing was left to send
+        if (count == 0) {
+          break;
+        }
+        mNextBatchSeq++;
+        batch.acked = false;
+        batch.queued = false;
+        batch.fastRetransmitted = false;
+        mInFlightCount++;
+        if (!sendBatch(transport, batch, now, payload, count)) {
+          onCongestion(now);
+          return false;
+        }
+      }
+
+      if (mInFlightCount > 0 || mNextSeq < mStore.nextSeq()) {
+        return false;
+      }
+      if (!finish(transport, ackSeq)) {
+        return false;
+      }
+      mDoneSentAt = now;
+      return true;
+    }
+
+  private:
+    struct InFlight {
+      uint8_t seq = 0;
+      bool acked = false;
+      bool queued = false;  // The stack took the notification
+      bool fastRetransmitted = false;
+      uint32_t first = 0;   // Journal seqs [first, end)
+      uint32_t end = 0;
+      uint32_t sentAt = 0;
+    };
+
+    SessionStore& mStore;
+    SyncResumeTable& mResume;
+    uint8_t mVersion = 0;
+    uint16_t mMtu = DEFAULT_MTU;
+    uint32_t mCursor = 0;    // The app has everything up to here, version 3
+    uint32_t mToken = 0;     // The app's name for this sync, 0 if it didn't give one
+    bool mActive = false;
+    uint32_t mStartSeq = 0;
+    uint32_t mNextSeq = 0;   // Next session to send
+
+    InFlight mInFlight[WINDOW_SIZE];  // Oldest first
+    uint32_t mInFlightCount = 0;
+    uint32_t mWindow = WINDOW_SIZE;
+    uint8_t mNextBatchSeq = 1;
+    uint32_t mBackoffUntil = 0;
+
+    bool mDoneSent = false;  // Waiting for the disconnect, or the durable ack for version 3
+    uint32_t mDoneSentAt = 0;
+    uint32_t mDoneRetransmits = 0;
+
+    uint32_t headerSize() const {
+      return isWindowed() ? 4 : isBatching() ? 3 : 0;
+    }
+
+    uint32_t recordSize() const {
+      return hasCursors() ? 16 : 12;
+    }
+
+    /**
+     * Reads the readable sessions from seq first on, up to limit, into a notification payload, header included,
+     * until it's full. end is the seq after the last one looked at. Sessions folded since the sync started are
+     * skipped like unreadable ones, their day summary comes later.
+     */
+    uint32_t fillBatch(uint32_t first, uint32_t limit, uint32_t& end, uint8_t* payload) {
+      uint32_t capacity = batchCapacity();
+      uint8_t* records = payload + headerSize();
+      uint32_t count = 0;
+      end = first;
+      while (count < capacity && end < limit) {
+        TreadmillSession s;
+        if (end <= mStore.foldSeq()) {
+          end = (mStore.foldSeq() + 1 < limit) ? mStore.foldSeq() + 1 : limit;
+          continue;
+        }
+        if (mStore.read(end, s)) {
+          encodeRecord(end, s, records + count * recordSize());
+          count++;
+        } else {
+          Debug.printf("Skipping unreadable session %u\n", end);
+        }
+        end++;
+      }
+      if (isBatching()) {
+        payload[0] = BATCH_MARKER;
+        payload[1] = mVersion;
+        payload[2] = (uint8_t)count;
+      }
+      return count;
+    }
+
+    bool sendBatch(SyncTransport& transport, InFlight& batch, uint32_t now) {
+      uint8_t payload[MAX_PAYLOAD];
+      // The MTU can only grow during a connection, so the batch still fits. Sessions recorded since stay out of it.
+      uint32_t end;
+      uint32_t count = fillBatch(batch.first, batch.end, end, payload);
+      return sendBatch(transport, batch, now, payload, count);
+    }
+
+    bool sendBatch(SyncTransport& transport, InFlight& batch, uint32_t now, uint8_t* payload, uint32_t count) {
+      if (isWindowed()) {
+        payload[3] = batch.seq;
+      }
+      batch.queued = transport.send(payload, headerSize() + count * recordSize());
+      batch.sentAt = now;
+      if (batch.queued && isWindowed()) {
+        Debug.printf(">> Notifying batch %u, sessions %u..%u\n", batch.seq, batch.first, batch.end - 1);
+      } else if (batch.queued) {
+        Debug.printf(">> Notifying %u session(s), up to session %u\n", count, batch.end - 1);
+      }
+      return batch.queued;
+    }
+
+    /**
+     * Sends the done marker. ackSeq is the seq of the last session sent unless the app acks durably. Without
+     * cursors the sync is over once the marker went out, version 3 waits for the durable ack.
+     */
+    bool finish(SyncTransport& transport, uint32_t& ackSeq) {
+      if (!sendDoneMarker(transport)) {
+        return false;  // pump() tries again
+      }
+      ackSeq = (!hasCursors() && mNextSeq > mStartSeq) ? mNextSeq - 1 : 0;
+      mResume.update(mToken, mNextSeq - 1);
+      mDoneSent = true;
+      return true;
+    }
+
+    bool sendDoneMarker(SyncTransport& transport) {
+      uint8_t done[5] = { DONE_MARKER };
+      uint32_t len = 1;
+      if (hasCursors()) {
+        writeUint32(done + 1, mNextSeq - 1);
+        len = 5;
+      }
+      return transport.send(done, len);
+    }
+
+    /**
+     * The done marker got lost if the app didn't disconnect (or for version 3, ack durably) within RETRANSMIT_MS.
+     */
+    void resendDoneMarker(SyncTransport& transport, uint32_t now) {
+      if (now - mDoneSentAt < RETRANSMIT_MS) {
+        return;
+      }
+      if (mDoneRetransmits >= MAX_DONE_RETRANSMITS) {
+        if (hasCursors()) {
+          Debug.printf("No durable ack for the done marker, giving up, the sessions stay unsynced.\n");
+        }
+        mActive = false;
+        return;
+      }
+      if (!sendDoneMarker(transport)) {
+        onCongestion(now);
+        return;
+      }
+      mDoneSentAt = now;
+      mDoneRetransmits++;
+      Debug.printf(">> Resending the done marker\n");
+    }
+
+    void encodeRecord(uint32_t seq, const TreadmillSession& s, uint8_t* p) const {
+      if (hasCursors()) {
+        writeUint32(p, seq);
+        p += 4;
+      }
+      writeUint32(p, s.start);
+      writeUint32(p + 4, s.stop);
+      writeUint32(p + 8, s.steps);
+    }
+
+    static void writeUint32(uint8_t* p, uint32_t value) {
+      p[0] = (value >> 24) & 0xFF;
+      p[1] = (value >> 16) & 0xFF;
+      p[2] = (value >> 8) & 0xFF;
+      p[3] = value & 0xFF;
+    }
+
+    static uint32_t readUint32(const uint8_t* p) {
+      return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+};
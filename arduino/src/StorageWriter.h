@@ -0,0 +1,202 @@
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "globals.h"
+#include "TelemetryCodec.h"
+
+struct StorageOp;
+typedef void (*StorageCallback)(const StorageOp& op);
+
+/**
+ * One flash write for the storage task, see StorageWriter.
+ */
+struct StorageOp {
+  enum Type : uint8_t {
+    NONE,
+    RECORD_SESSION,    // session
+    ACKNOWLEDGE,       // value: last synced seq
+    SAVE_CHECKPOINT,   // session, value: time the values were current
+    CLEAR_CHECKPOINT,
+    TELEMETRY_START,   // value: series key
+    TELEMETRY_SAMPLE,  // sample
+    TELEMETRY_FINISH,
+  };
+
+  Type type = NONE;
+  bool ok = false;                   // Set once the op ran
+  uint32_t value = 0;
+  TreadmillSession session;
+  TelemetrySample sample;
+  StorageCallback onDone = nullptr;  // Called on the loop task once the op ran, see dispatchCompletions()
+
+  StorageOp() {}
+  explicit StorageOp(Type type) : type(type) {}
+
+  /**
+   * The next op of its kind replaces it, so it's the first to go when the queue fills up.
+   */
+  bool isPeriodic() const {
+    return type == SAVE_CHECKPOINT || type == TELEMETRY_SAMPLE;
+  }
+};
+
+/**
+ * Runs the flash writes (session journal, daily rollups, checkpoints, telemetry) on their own FreeRTOS task.
+ *
+ * Erasing a sector takes tens of milliseconds and programming one a few, with the flash cache disabled. Done
+ * inline that stalled whoever triggered it: the loop at the end of a session (dropped treadmill notifications,
+ * a TFT hitch) and the BLE host task when the app confirmed a sync. Producers now submit() a StorageOp and carry
+ * on. submit() never blocks, it fails if the queue is full. Periodic ops (see StorageOp::isPeriodic()) leave the
+ * last RESERVED_SLOTS to the others, so a backlog of telemetry samples can't crowd out a session.
+ *
+ * The task runs ops one at a time in the order they were submitted with the storage lock held, and while the
+ * queue is empty it calls the idle handler (compaction) every IDLE_INTERVAL_MS. Code on the loop task that reads
+ * stored data takes the lock with StorageLock. The NimBLE host task never does, an erase or a compaction step
+ * holds the lock for tens of milliseconds and the host would stall every connection meanwhile. Completions go
+ * back to the loop task through a second queue, so callbacks can touch the display and the globals like the
+ * rest of the loop does.
+ */
+class StorageWriter {
+  public:
+    typedef bool (*Executor)(StorageOp& op);
+    typedef bool (*IdleHandler)();  // Returns true while it has more to do
+
+    static constexpr uint32_t QUEUE_DEPTH = 16;
+    static constexpr uint32_t RESERVED_SLOTS = 4;
+    static constexpr uint32_t IDLE_INTERVAL_MS = 100;
+
+    /**
+     * Starts the task. Until it's running submit() fails, so callers fall back to writing inline.
+     */
+    bool begin(Executor executor, IdleHandler idle) {
+      mExecutor = executor;
+      mIdle = idle;
+      mMutex = xSemaphoreCreateRecursiveMutex();
+      mQueue = xQueueCreate(QUEUE_DEPTH, sizeof(StorageOp));
+      mDone = xQueueCreate(QUEUE_DEPTH, sizeof(StorageOp));
+      if (!mMutex || !mQueue || !mDone) {
+        Debug.println("ERROR: Not enough memory for the storage writer, flash writes stay inline.");
+        return false;
+      }
+      // Same core as the loop, the BLE host keeps the other one to itself.
+      if (xTaskCreatePinnedToCore(taskMain, "storage", TASK_STACK_SIZE, this, TASK_PRIORITY, &mTask, xPortGetCoreID()) != pdPASS) {
+        Debug.println("ERROR: Couldn't start the storage writer task, flash writes stay inline.");
+        mTask = nullptr;
+        return false;
+      }
+      return true;
+    }
+
+    /**
+     * Queues an op without blocking. Returns false if the writer isn't running or the queue is full, see
+     * isRunning() to tell them apart.
+     */
+    bool submit(const StorageOp& op) {
+      if (!mTask) {
+        return false;
+      }
+      if (op.isPeriodic() && uxQueueSpacesAvailable(mQueue) <= RESERVED_SLOTS) {
+        Debug.printf("Storage queue is almost full, periodic op %u dropped.\n", op.type);
+        return false;
+      }
+      if (xQueueSend(mQueue, &op, 0) != pdTRUE) {
+        Debug.printf("Storage queue is full (%u ops), op %u not queued.\n", QUEUE_DEPTH, op.type);
+        return false;
+      }
+      return true;
+    }
+
+    /**
+     * Calls the callbacks of the ops that completed since the last call. Call it from the loop.
+     */
+    void dispatchCompletions() {
+      if (!mDone) {
+        return;
+      }
+      StorageOp op;
+      while (xQueueReceive(mDone, &op, 0) == pdTRUE) {
+        op.onDone(op);
+      }
+    }
+
+    bool isRunning() const {
+      return mTask != nullptr;
+    }
+
+    /**
+     * Ops that are queued and not yet running.
+     */
+    uint32_t queued() const {
+      return mQueue ? uxQueueMessagesWaiting(mQueue) : 0;
+    }
+
+    bool lock(TickType_t wait = portMAX_DELAY) {
+      return !mMutex || xSemaphoreTakeRecursive(mMutex, wait) == pdTRUE;
+    }
+
+    void unlock() {
+      if (mMutex) {
+        xSemaphoreGiveRecursive(mMutex);
+      }
+    }
+
+  private:
+    static constexpr uint32_t TASK_STACK_SIZE = 6144;
+    static constexpr UBaseType_t TASK_PRIORITY = 1;  // Same as the loop, they take turns.
+
+    Executor mExecutor = nullptr;
+    IdleHandler mIdle = nullptr;
+    SemaphoreHandle_t mMutex = nullptr;
+    QueueHandle_t mQueue = nullptr;
+    QueueHandle_t mDone = nullptr;
+    TaskHandle_t mTask = nullptr;
+
+    static void taskMain(void* arg) {
+      ((StorageWriter*)arg)->run();
+    }
+
+    void run() {
+      bool idleBusy = false;
+      for (;;) {
+        StorageOp op;
+        TickType_t wait = idleBusy ? 1 : pdMS_TO_TICKS(IDLE_INTERVAL_MS);
+        if (xQueueReceive(mQueue, &op, wait) == pdTRUE) {
+          lock();
+          op.ok = mExecutor(op);
+          unlock();
+          if (op.onDone && xQueueSend(mDone, &op, 0) != pdTRUE) {
+            Debug.printf("Storage completion queue is full, callback of op %u dropped.\n", op.type);
+          }
+        } else if (mIdle) {
+          lock();
+          idleBusy = mIdle();
+          unlock();
+        }
+      }
+    }
+};
+
+/**
+ * Holds the storage lock for as long as it's in scope. With a wait of 0 it doesn't block, check locked().
+ * Only for the loop task, it may wait for an erase. NimBLE callbacks hand their work to the loop instead.
+ */
+class StorageLock {
+  public:
+    explicit StorageLock(StorageWriter& writer, TickType_t wait = portMAX_DELAY) : mWriter(writer), mLocked(writer.lock(wait)) {}
+
+    ~StorageLock() {
+      if (mLocked) {
+        mWriter.unlock();
+      }
+    }
+
+    bool locked() const { return mLocked; }
+
+  private:
+    StorageWriter& mWriter;
+    bool mLocked;
+};
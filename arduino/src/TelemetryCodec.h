@@ -0,0 +1,239 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "Varint.h"
+
+/**
+ * One telemetry sample, taken about once a second while a session is running.
+ */
+struct TelemetrySample {
+  uint32_t time = 0;      // Unix time
+  uint32_t steps = 0;     // Steps so far in the session
+  uint32_t speed = 0;     // 0.01 km/h
+  uint32_t distance = 0;  // Meters so far in the session
+};
+
+/**
+ * Delta-of-delta compression of a run of TelemetrySamples into a self contained chunk.
+ *
+ * Chunk layout:
+ *   key           varint, identifies the series (the session's start time).
+ *   count         varint, number of samples in the chunk.
+ *   first sample  varint time, steps, speed, distance.
+ *   bitstream     For every following sample and every channel (in the order above), the difference between
+ *                 this delta and the previous delta (the first delta is taken against 0), MSB first:
+ *                   0                  dod == 0
+ *                   10   + 3 bits      dod in [-4, 3]
+ *                   110  + 7 bits      dod in [-64, 63]
+ *                   1110 + 12 bits     dod in [-2048, 2047]
+ *                   1111 + 32 bits     anything else
+ *
+ * At a steady pace the time and speed channels cost a bit each and steps/distance jitter by one or two, so a
+ * sample is ~10 bits and an hour of 1Hz samples is ~5KB.
+ *
+ * Only uses plain C++ so the same encoder/decoder can be compiled on the host.
+ */
+class TelemetryCodec {
+  public:
+    static constexpr uint32_t CHANNELS = 4;
+    static constexpr uint32_t MAX_CHUNK_SIZE = 160;  // Fits in one notification at the MTU iOS negotiates (185).
+    static constexpr uint32_t MAX_HEADER_SIZE = (2 + CHANNELS) * Varint::MAX_SIZE;
+    static constexpr uint32_t MAX_BITS_PER_SAMPLE = CHANNELS * (4 + 32);
+    static constexpr uint32_t MAX_SAMPLES_PER_CHUNK = 1 + ((MAX_CHUNK_SIZE - MAX_HEADER_SIZE) * 8) / CHANNELS;
+
+    /**
+     * Builds one chunk. add() samples until it returns false, then finish() and reset() for the next chunk.
+     */
+    class Encoder {
+      public:
+        void reset(uint32_t key) {
+          mKey = key;
+          mCount = 0;
+          mBitCount = 0;
+          memset(mBits, 0, sizeof(mBits));
+        }
+
+        /**
+         * Returns false, without adding it, if the sample might not fit in the chunk anymore.
+         */
+        bool add(const TelemetrySample& sample) {
+          uint32_t values[CHANNELS];
+          toValues(sample, values);
+
+          if (mCount == 0) {
+            for (uint32_t ch = 0; ch < CHANNELS; ch++) {
+              mFirst[ch] = values[ch];
+              mPrev[ch] = values[ch];
+              mPrevDelta[ch] = 0;
+            }
+          } else {
+            if (mBitCount + MAX_BITS_PER_SAMPLE > sizeof(mBits) * 8) {
+              return false;
+            }
+            for (uint32_t ch = 0; ch < CHANNELS; ch++) {
+              int32_t delta = (int32_t)(values[ch] - mPrev[ch]);
+              putDod(delta - mPrevDelta[ch]);
+              mPrevDelta[ch] = delta;
+              mPrev[ch] = values[ch];
+            }
+          }
+          mCount++;
+          return true;
+        }
+
+        uint32_t count() const { return mCount; }
+        uint32_t key() const { return mKey; }
+
+        /**
+         * Writes the chunk to out (at least MAX_CHUNK_SIZE bytes) and returns its length.
+         */
+        uint32_t finish(uint8_t* out) const {
+          uint32_t len = 0;
+          len += Varint::put(out + len, mKey);
+          len += Varint::put(out + len, mCount);
+          for (uint32_t ch = 0; ch < CHANNELS; ch++) {
+            len += Varint::put(out + len, mFirst[ch]);
+          }
+          uint32_t bitBytes = (mBitCount + 7) / 8;
+          memcpy(out + len, mBits, bitBytes);
+          return len + bitBytes;
+        }
+
+      private:
+        uint32_t mKey = 0;
+        uint32_t mCount = 0;
+        uint32_t mFirst[CHANNELS] = {};
+        uint32_t mPrev[CHANNELS] = {};
+        int32_t mPrevDelta[CHANNELS] = {};
+        uint8_t mBits[MAX_CHUNK_SIZE - MAX_HEADER_SIZE];
+        uint32_t mBitCount = 0;
+
+        void putBits(uint32_t value, uint32_t bits) {
+          for (int32_t i = bits - 1; i >= 0; i--) {
+            if ((value >> i) & 1) {
+              mBits[mBitCount / 8] |= 0x80 >> (mBitCount % 8);
+            }
+            mBitCount++;
+          }
+        }
+
+        void putDod(int32_t dod) {
+          if (dod == 0) {
+            putBits(0x0, 1);
+          } else if (dod >= -4 && dod <= 3) {
+            putBits(0x2, 2);
+            putBits((uint32_t)dod & 0x7, 3);
+          } else if (dod >= -64 && dod <= 63) {
+            putBits(0x6, 3);
+            putBits((uint32_t)dod & 0x7F, 7);
+          } else if (dod >= -2048 && dod <= 2047) {
+            putBits(0xE, 4);
+            putBits((uint32_t)dod & 0xFFF, 12);
+          } else {
+            putBits(0xF, 4);
+            putBits((uint32_t)dod, 32);
+          }
+        }
+    };
+
+    /**
+     * Reads just the series key of a chunk.
+     */
+    static bool readKey(const uint8_t* in, uint32_t len, uint32_t& key) {
+      uint32_t pos = 0;
+      return Varint::get(in, len, pos, key);
+    }
+
+    /**
+     * Decodes a chunk into out (room for MAX_SAMPLES_PER_CHUNK samples). Returns false if it's malformed.
+     */
+    static bool decode(const uint8_t* in, uint32_t len, uint32_t& key, TelemetrySample* out, uint32_t& count) {
+      uint32_t pos = 0;
+      uint32_t values[CHANNELS];
+      if (!Varint::get(in, len, pos, key) || !Varint::get(in, len, pos, count) ||
+          count == 0 || count > MAX_SAMPLES_PER_CHUNK) {
+        return false;
+      }
+      for (uint32_t ch = 0; ch < CHANNELS; ch++) {
+        if (!Varint::get(in, len, pos, values[ch])) {
+          return false;
+        }
+      }
+      out[0] = fromValues(values);
+
+      BitReader reader = { in + pos, (len - pos) * 8, 0 };
+      int32_t prevDelta[CHANNELS] = {};
+      for (uint32_t i = 1; i < count; i++) {
+        for (uint32_t ch = 0; ch < CHANNELS; ch++) {
+          int32_t dod;
+          if (!reader.getDod(dod)) {
+            return false;
+          }
+          prevDelta[ch] += dod;
+          values[ch] += (uint32_t)prevDelta[ch];
+        }
+        out[i] = fromValues(values);
+      }
+      return true;
+    }
+
+  private:
+    struct BitReader {
+      const uint8_t* data;
+      uint32_t bitLen;
+      uint32_t pos;
+
+      bool getBits(uint32_t bits, uint32_t& value) {
+        if (pos + bits > bitLen) {
+          return false;
+        }
+        value = 0;
+        for (uint32_t i = 0; i < bits; i++, pos++) {
+          value = (value << 1) | ((data[pos / 8] >> (7 - pos % 8)) & 1);
+        }
+        return true;
+      }
+
+      bool getDod(int32_t& dod) {
+        static const uint32_t widths[] = { 3, 7, 12, 32 };
+        uint32_t prefix = 0;
+        uint32_t bit;
+        while (prefix < 4) {
+          if (!getBits(1, bit)) return false;
+          if (!bit) break;
+          prefix++;
+        }
+        if (prefix == 0) {
+          dod = 0;
+          return true;
+        }
+        uint32_t width = widths[prefix - 1];
+        uint32_t raw;
+        if (!getBits(width, raw)) return false;
+        dod = (width == 32) ? (int32_t)raw : signExtend(raw, width);
+        return true;
+      }
+
+      static int32_t signExtend(uint32_t value, uint32_t bits) {
+        uint32_t sign = 1u << (bits - 1);
+        return (int32_t)((value ^ sign) - sign);
+      }
+    };
+
+    static void toValues(const TelemetrySample& s, uint32_t* values) {
+      values[0] = s.time;
+      values[1] = s.steps;
+      values[2] = s.speed;
+      values[3] = s.distance;
+    }
+
+    static TelemetrySample fromValues(const uint32_t* values) {
+      TelemetrySample s;
+      s.time = values[0];
+      s.steps = values[1];
+      s.speed = values[2];
+      s.distance = values[3];
+      return s;
+    }
+};
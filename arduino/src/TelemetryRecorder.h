@@ -0,0 +1,285 @@
+#pragma once
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include "globals.h"
+#include "TelemetryCodec.h"
+#include "Crc16.h"
+
+/**
+ * Records a ~1Hz time series (steps, speed, distance) of every session into the "telemetry" partition.
+ *
+ * Samples are compressed into TelemetryCodec chunks in RAM. A chunk is written to flash when it's full (every
+ * couple of minutes at a steady pace) and when the session ends, so a power cut loses at most one chunk.
+ *
+ * The partition is a ring of 4KB sectors, like the session journal but simpler: telemetry is best effort, so when
+ * the ring is full the oldest sector is erased no matter what's in it.
+ *
+ * Sector layout:
+ *   [0..7]  SectorHeader
+ *   [8..]   Frames back to back: 1 byte chunk length, the chunk, CRC16 of the chunk. A 0xFF length (erased flash)
+ *           marks the end of the frames.
+ */
+class TelemetryRecorder {
+  public:
+    /**
+     * Locates the partition and finds where the next chunk goes. Returns false if there's no "telemetry" partition,
+     * recording is a no-op after that.
+     */
+    bool begin() {
+      mPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, PARTITION_SUBTYPE, PARTITION_LABEL);
+      if (!mPartition) {
+        Debug.println("No 'telemetry' partition found, session telemetry is disabled.");
+        return false;
+      }
+      mSectorCount = mPartition->size / SECTOR_SIZE;
+      scan();
+      Debug.printf("Telemetry: %u sectors, head=%d, offset=%u\n", mSectorCount, mHeadSector, mWriteOffset);
+      return true;
+    }
+
+    /**
+     * Starts a new series, key is the start time of the session it belongs to.
+     */
+    void startSeries(uint32_t key) {
+      finishSeries();
+      mEncoder.reset(key);
+      mRecording = true;
+      mLastSampleTime = 0;
+    }
+
+    /**
+     * Adds a sample to the current series. Samples taken in the same second as the previous one are dropped,
+     * which keeps the series at ~1Hz however often the treadmill notifies.
+     */
+    void sample(const TelemetrySample& s) {
+      if (!mRecording || s.time == mLastSampleTime) {
+        return;
+      }
+      mLastSampleTime = s.time;
+      if (!mEncoder.add(s)) {
+        flushChunk();
+        mEncoder.reset(mEncoder.key());
+        mEncoder.add(s);
+      }
+    }
+
+    /**
+     * Writes whatever is left of the current series to flash.
+     */
+    void finishSeries() {
+      if (mRecording) {
+        flushChunk();
+        mRecording = false;
+      }
+    }
+
+    /**
+     * Where a retrieval is up to, see readNextChunk().
+     */
+    struct ReadCursor {
+      uint32_t key = 0;
+      uint32_t sectorsLeft = 0;
+      uint32_t sector = 0;
+      uint32_t sectorSeq = 0;
+      uint32_t offset = 0;
+      bool unflushedSent = false;
+    };
+
+    /**
+     * Starts a retrieval of every chunk of the series with the given key, oldest first. Only reads, the chunk
+     * that's still in RAM is sent as it is (see readNextChunk()) instead of being flushed here, so retrievals
+     * never write flash outside the storage task.
+     */
+    void beginRead(uint32_t key, ReadCursor& cursor) {
+      cursor.key = key;
+      cursor.sectorsLeft = (mHeadSector < 0) ? 0 : mSectorCount;
+      cursor.sector = (mHeadSector < 0) ? 0 : (mHeadSector + 1) % mSectorCount;  // The oldest sector
+      cursor.sectorSeq = 0;
+      cursor.offset = 0;
+      cursor.unflushedSent = false;
+    }
+
+    /**
+     * Copies the next chunk of the series into out (at least TelemetryCodec::MAX_CHUNK_SIZE bytes).
+     * Returns its length, 0 once there are no more. After the stored chunks comes the one still in RAM, if the
+     * series is being recorded. Call it with the storage lock held, the storage task adds the samples.
+     */
+    uint32_t readNextChunk(ReadCursor& cursor, uint8_t* out) {
+      SectorHeader hdr;
+      while (cursor.sectorsLeft > 0) {
+        if (cursor.offset == 0) {
+          // Entering a sector, skip it if it was never written.
+          if (!readHeader(cursor.sector, hdr)) {
+            nextSector(cursor);
+            continue;
+          }
+          cursor.sectorSeq = hdr.sectorSeq;
+          cursor.offset = sizeof(SectorHeader);
+        } else if (!readHeader(cursor.sector, hdr) || hdr.sectorSeq != cursor.sectorSeq) {
+          // The ring wrapped onto this sector while we were reading it.
+          nextSector(cursor);
+          continue;
+        }
+
+        uint32_t len;
+        while ((len = readFrame(cursor.sector, cursor.offset, out)) > 0) {
+          cursor.offset += FRAME_OVERHEAD + len;
+          uint32_t key;
+          if (TelemetryCodec::readKey(out, len, key) && key == cursor.key) {
+            return len;
+          }
+        }
+        nextSector(cursor);
+      }
+
+      if (!cursor.unflushedSent && mRecording && mEncoder.key() == cursor.key && mEncoder.count() > 0) {
+        cursor.unflushedSent = true;
+        return mEncoder.finish(out);
+      }
+      return 0;
+    }
+
+  private:
+    // -----------------------------------------------------------------------
+    // Constants
+    // -----------------------------------------------------------------------
+    static constexpr const char* PARTITION_LABEL = "telemetry";
+    static constexpr esp_partition_subtype_t PARTITION_SUBTYPE = (esp_partition_subtype_t)0x41;
+
+    static constexpr uint32_t SECTOR_SIZE = 4096;
+    static constexpr uint32_t SECTOR_MAGIC = 0x314C5454;  // "TTL1"
+    static constexpr uint32_t MAGIC_ERASED = 0xFFFFFFFF;
+    static constexpr uint8_t LEN_ERASED = 0xFF;
+    static constexpr uint32_t FRAME_OVERHEAD = 1 + sizeof(uint16_t);
+
+    struct SectorHeader {
+      uint32_t magic;
+      uint32_t sectorSeq;  // Incremented each time a sector is opened, the highest one is the head.
+    };
+
+    // -----------------------------------------------------------------------
+    // State
+    // -----------------------------------------------------------------------
+    const esp_partition_t* mPartition = nullptr;
+    uint32_t mSectorCount = 0;
+    int32_t mHeadSector = -1;  // -1 while nothing was recorded yet
+    uint32_t mHeadSectorSeq = 0;
+    uint32_t mWriteOffset = 0;
+
+    TelemetryCodec::Encoder mEncoder;
+    bool mRecording = false;
+    uint32_t mLastSampleTime = 0;
+
+    void scan() {
+      SectorHeader hdr;
+      for (uint32_t i = 0; i < mSectorCount; i++) {
+        if (readHeader(i, hdr) && (mHeadSector < 0 || (int32_t)(hdr.sectorSeq - mHeadSectorSeq) > 0)) {
+          mHeadSector = i;
+          mHeadSectorSeq = hdr.sectorSeq;
+        }
+      }
+      if (mHeadSector < 0) {
+        return;
+      }
+
+      uint8_t chunk[TelemetryCodec::MAX_CHUNK_SIZE];
+      uint32_t offset = sizeof(SectorHeader);
+      uint32_t len;
+      while ((len = readFrame(mHeadSector, offset, chunk)) > 0) {
+        offset += FRAME_OVERHEAD + len;
+      }
+      uint8_t next = LEN_ERASED;
+      if (offset < SECTOR_SIZE) {
+        readBytes(mHeadSector, offset, &next, 1);
+      }
+      if (next != LEN_ERASED) {
+        Debug.printf("Telemetry: discarding torn chunk at offset %u, closing sector.\n", offset);
+        offset = SECTOR_SIZE;
+      }
+      mWriteOffset = offset;
+    }
+
+    void flushChunk() {
+      if (!mPartition || mEncoder.count() == 0) {
+        return;
+      }
+
+      uint8_t frame[FRAME_OVERHEAD + TelemetryCodec::MAX_CHUNK_SIZE];
+      uint32_t len = mEncoder.finish(frame + 1);
+      frame[0] = (uint8_t)len;
+      uint16_t crc = crc16(frame + 1, len);
+      memcpy(frame + 1 + len, &crc, sizeof(crc));
+
+      if ((mHeadSector < 0 || mWriteOffset + FRAME_OVERHEAD + len > SECTOR_SIZE) && !openNextSector()) {
+        return;
+      }
+      if (esp_partition_write(mPartition, sectorAddress(mHeadSector) + mWriteOffset, frame, FRAME_OVERHEAD + len) != ESP_OK) {
+        Debug.printf("ERROR: Telemetry write failed at sector %d offset %u\n", mHeadSector, mWriteOffset);
+        mWriteOffset = SECTOR_SIZE;
+        return;
+      }
+      mWriteOffset += FRAME_OVERHEAD + len;
+      #ifdef VERBOSE_LOGGING
+        Debug.printf("Telemetry: wrote %u samples in %u bytes\n", mEncoder.count(), len);
+      #endif
+    }
+
+    bool openNextSector() {
+      uint32_t target = (mHeadSector < 0) ? 0 : (mHeadSector + 1) % mSectorCount;
+      if (esp_partition_erase_range(mPartition, sectorAddress(target), SECTOR_SIZE) != ESP_OK) {
+        Debug.printf("ERROR: Failed to erase telemetry sector %u\n", target);
+        return false;
+      }
+
+      // Header first with the magic left erased, the magic commits it.
+      SectorHeader hdr = { MAGIC_ERASED, mHeadSectorSeq + 1 };
+      uint32_t magic = SECTOR_MAGIC;
+      if (esp_partition_write(mPartition, sectorAddress(target), &hdr, sizeof(hdr)) != ESP_OK ||
+          esp_partition_write(mPartition, sectorAddress(target), &magic, sizeof(magic)) != ESP_OK) {
+        Debug.printf("ERROR: Failed to write header of telemetry sector %u\n", target);
+        return false;
+      }
+      mHeadSector = target;
+      mHeadSectorSeq = hdr.sectorSeq;
+      mWriteOffset = sizeof(SectorHeader);
+      return true;
+    }
+
+    /**
+     * Reads the frame at offset and returns the length of its chunk, 0 at the end of the frames or if the frame
+     * is damaged.
+     */
+    uint32_t readFrame(uint32_t sector, uint32_t offset, uint8_t* chunk) const {
+      uint8_t len;
+      if (offset + FRAME_OVERHEAD > SECTOR_SIZE || !readBytes(sector, offset, &len, 1) ||
+          len == LEN_ERASED || len == 0 || len > TelemetryCodec::MAX_CHUNK_SIZE ||
+          offset + FRAME_OVERHEAD + len > SECTOR_SIZE) {
+        return 0;
+      }
+      uint16_t crc;
+      if (!readBytes(sector, offset + 1, chunk, len) || !readBytes(sector, offset + 1 + len, &crc, sizeof(crc)) ||
+          crc != crc16(chunk, len)) {
+        return 0;
+      }
+      return len;
+    }
+
+    void nextSector(ReadCursor& cursor) const {
+      cursor.sector = (cursor.sector + 1) % mSectorCount;
+      cursor.sectorsLeft--;
+      cursor.offset = 0;
+    }
+
+    bool readHeader(uint32_t sector, SectorHeader& hdr) const {
+      return readBytes(sector, 0, &hdr, sizeof(hdr)) && hdr.magic == SECTOR_MAGIC;
+    }
+
+    bool readBytes(uint32_t sector, uint32_t offset, void* dst, uint32_t len) const {
+      return esp_partition_read(mPartition, sectorAddress(sector) + offset, dst, len) == ESP_OK;
+    }
+
+    static uint32_t sectorAddress(uint32_t sector) {
+      return sector * SECTOR_SIZE;
+    }
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <Arduino.h>
+#include <NimBLEDevice.h>
+#include <Preferences.h>
+#include "globals.h"
+
+/**
+ * Remembers the address of the treadmill we last connected to, in NVS so it survives a reboot.
+ *
+ * With it the BLE treadmill drivers don't have to scan before every (re)connect. They ask the controller to connect
+ * to the remembered address directly, which completes as soon as the treadmill advertises, and only scan when that
+ * times out (a different treadmill, or one that changes its address). Each driver uses its own key, so after
+ * switching the treadmill type the address of the old one isn't tried.
+ */
+class TreadmillAddressCache {
+  public:
+    /**
+     * How long a direct connect waits for the treadmill to advertise before the driver falls back to a scan.
+     * The controller does the waiting, the main loop keeps running.
+     */
+    static constexpr uint32_t DIRECT_CONNECT_TIMEOUT_MS = 10000;
+
+    explicit TreadmillAddressCache(const char* key) : mKey(key) {}
+
+    /**
+     * Sets address to the remembered treadmill, returns false if there's none.
+     */
+    bool load(NimBLEAddress& address) {
+      if (!mLoaded) {
+        read();
+      }
+      if (!mHasAddress) {
+        return false;
+      }
+      address = mAddress;
+      return true;
+    }
+
+    /**
+     * Remembers the treadmill we're connected to, flash is only written if it changed.
+     */
+    void save(const NimBLEAddress& address) {
+      if (!mLoaded) {
+        read();
+      }
+      if (mHasAddress && mAddress == address) {
+        return;
+      }
+
+      char value[24];
+      snprintf(value, sizeof(value), "%u %s", address.getType(), address.toString().c_str());
+      Preferences prefs;
+      prefs.begin(NVS_NAMESPACE, false);
+      bool ok = prefs.putString(mKey, value) > 0;
+      prefs.end();
+      if (!ok) {
+        Debug.printf("ERROR: Failed to remember treadmill %s\n", address.toString().c_str());
+        return;
+      }
+      Debug.printf("Remembered treadmill %s for fast reconnects\n", address.toString().c_str());
+      mAddress = address;
+      mHasAddress = true;
+    }
+
+  private:
+    static constexpr const char* NVS_NAMESPACE = "treadmill";
+
+    const char* mKey;
+    NimBLEAddress mAddress;
+    bool mHasAddress = false;
+    bool mLoaded = false;
+
+    /**
+     * Stored as "<address type> <address>", e.g. "1 c8:3a:35:00:12:9f".
+     */
+    void read() {
+      mLoaded = true;
+      Preferences prefs;
+      prefs.begin(NVS_NAMESPACE, true);
+      String value = prefs.getString(mKey, "");
+      prefs.end();
+
+      int space = value.indexOf(' ');
+      if (space <= 0) {
+        return;
+      }
+      uint8_t type = (uint8_t)value.substring(0, space).toInt();
+      mAddress = NimBLEAddress(std::string(value.substring(space + 1).c_str()), type);
+      mHasAddress = !mAddress.isNull();
+    }
+};
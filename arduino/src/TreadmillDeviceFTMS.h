@@ -5,6 +5,8 @@
 #include "globals.h"
 #include "TreadmillDevice.h"
 #include "HasElapsed.h"
+#include "TreadmillAddressCache.h"
+#include "GattHandleCache.h"
 
 // ... existing includes / code ...
 
@@ -15,10 +17,7 @@ class TreadmillDeviceFTMS : public TreadmillDevice {
         mSpeedBelowThresholdStart(0),
         mIsConnected(false),
         mFoundTreadmill(false),
-        mClient(nullptr),
-        mTreadmillDataChar(nullptr),
-        mFtmsStatusChar(nullptr),
-        mControlPointChar(nullptr)  // << Added
+        mClient(nullptr)
     {
       // empty
     }
@@ -83,15 +82,25 @@ class TreadmillDeviceFTMS : public TreadmillDevice {
   bool mFoundTreadmill;
 
   // BLE client references
-  NimBLEClient*               mClient;
-  NimBLERemoteCharacteristic* mTreadmillDataChar;
-  NimBLERemoteCharacteristic* mFtmsStatusChar;
-  NimBLERemoteCharacteristic* mControlPointChar;  // << Added
+  NimBLEClient* mClient;
+
+  // Handles of the characteristics we use, 0 where the treadmill doesn't have one (see GattHandleCache)
+  enum HandleIndex : uint8_t { H_DATA, H_DATA_CCCD, H_STATUS, H_STATUS_CCCD, H_CONTROL_POINT };
+  uint16_t mHandles[GattHandleCache::MAX_HANDLES] = {0};
+  GattLink mGatt;
+  GattHandleCache mGattCache{"ftms"};
 
   // State
   bool mIsConnected;
   HasElapsed mConnectionRetryTimer;
 
+  // Fast reconnects to the treadmill we last connected to, a scan is the fallback
+  TreadmillAddressCache mAddressCache{"ftms"};
+  volatile bool mDirectConnectPending = false;  // Waiting for the remembered treadmill to advertise
+  volatile bool mDirectConnectDone = false;     // It connected, discovery is left to the main loop
+  volatile bool mScanNext = false;              // The last direct connect timed out
+  volatile bool mConnectFailed = false;         // Set by onConnectFail, the main loop retries right away
+
   bool mResetPending = false;
   unsigned long mResetStartTime = 0;
 
@@ -139,17 +148,34 @@ class TreadmillDeviceFTMS : public TreadmillDevice {
   // For speed-based session end detection:
   unsigned long mSpeedBelowThresholdStart; // 0 if currently above threshold
 
-  // A global pointer so static callbacks can delegate to 'this'
-  static TreadmillDeviceFTMS* sSelf;
-
   private:
   // -----------------------------------------------------------------------
   // Connection Logic
   // -----------------------------------------------------------------------
   void connectionStateMachine() {
+    if (mDirectConnectPending) {
+      return;  // The controller is waiting for the treadmill, onConnect or onConnectFail moves on
+    }
+    if (mConnectFailed) {
+      mConnectFailed = false;
+      mConnectionRetryTimer.runNextTimeIn(0);
+    }
+    if (mDirectConnectDone) {
+      mDirectConnectDone = false;
+      Debug.println("Connected to the remembered FTMS treadmill. Discovering service...");
+      if (!setupConnectedTreadmill()) {
+        dropConnection();
+        mScanNext = true;  // Maybe it isn't the same treadmill anymore
+      }
+      return;
+    }
     if (mConnectionRetryTimer.isIntervalUp()) {
       if (!mFoundTreadmill) {
-        startScan();
+        if (!mScanNext && !NimBLEDevice::getScan()->isScanning() && mAddressCache.load(mFtmsAddress)) {
+          startDirectConnect();
+        } else {
+          startScan();
+        }
       } else {
         // Attempt to connect if not scanning
         if (!NimBLEDevice::getScan()->isScanning()) {
@@ -162,11 +188,43 @@ class TreadmillDeviceFTMS : public TreadmillDevice {
   void startScan() {
     Debug.println("Scanning for FTMS treadmill (Service 0x1826)...");
     mFoundTreadmill = false;
+    mScanNext = false;
 
     NimBLEScan* scan = NimBLEDevice::getScan();
     scan->setScanCallbacks(&mScanCallbacks, false /* not using duplicates */);
     scan->setActiveScan(true);
     scan->start(SCAN_DURATION_MS, false, true);
+
+    NimBLEAddress remembered;
+    if (mAddressCache.load(remembered)) {
+      // Go back to waiting for the remembered treadmill right after the scan
+      mConnectionRetryTimer.runNextTimeIn(SCAN_DURATION_MS + 100);
+    }
+  }
+
+  /**
+   * Asks the controller to connect to the treadmill we were last connected to. It doesn't block, the controller
+   * connects the moment the treadmill advertises, so there's no scan between powering it on and the first data.
+   */
+  void startDirectConnect() {
+    NimBLEClient* client = getClient();
+    Debug.printf("Waiting for the remembered FTMS treadmill at %s\n", mFtmsAddress.toString().c_str());
+    mDirectConnectPending = true;
+    if (!client->connect(mFtmsAddress, true, true /* async */)) {
+      Debug.println("Failed to start a direct connect, scanning instead.");
+      mDirectConnectPending = false;
+      mScanNext = true;
+    }
+  }
+
+  NimBLEClient* getClient() {
+    // One client for all reconnects, a new one each time would run out of them
+    if (!mClient) {
+      mClient = NimBLEDevice::createClient();
+      mClient->setClientCallbacks(&mClientCallbacks, false);
+      mClient->setConnectTimeout(TreadmillAddressCache::DIRECT_CONNECT_TIMEOUT_MS);
+    }
+    return mClient;
   }
 
 void printCharacteristicAndHandleMap(NimBLEClient* pClient) {
@@ -214,8 +272,7 @@ void printCharacteristicAndHandleMap(NimBLEClient* pClient) {
     mFoundTreadmill = false;
     mIsConnected = false;
 
-    mClient = NimBLEDevice::createClient();
-    mClient->setClientCallbacks(&mClientCallbacks);
+    getClient();
 
     Debug.printf("Attempting to connect to FTMS device at %s\n",
                 mFtmsAddress.toString().c_str());
@@ -225,52 +282,139 @@ void printCharacteristicAndHandleMap(NimBLEClient* pClient) {
       return;
     }
 
+    Debug.println("Connected to FTMS. Discovering service...");
+    if (!setupConnectedTreadmill()) {
+      dropConnection();
+    }
+  }
+
+  /**
+   * Gives up on a connection whose setup failed. The treadmill may still be connected (a subscription or the
+   * start command failed), then onDisconnect never comes and loopHandler() wouldn't look for it again.
+   */
+  void dropConnection() {
+    mIsConnected = false;
+    mClient->disconnect();
+  }
+
+  /**
+   * Subscribes to the data of the connected treadmill, with the handles from the last connect when they're still
+   * good and a discovery of the FTMS service otherwise. Returns false (and disconnects) if the service isn't there.
+   */
+  bool setupConnectedTreadmill() {
+    mGatt.attach(mClient->getConnHandle());
+    if (mGattCache.restore(mFtmsAddress, mGatt, mHandles)) {
+      if (subscribeByHandles()) {
+        Debug.println("Reused the FTMS handles from the last connect, skipped discovery.");
+        return finishSetup();
+      }
+      Debug.println("The remembered FTMS handles didn't work, discovering again.");
+      mGattCache.forget();
+      mGatt.attach(mClient->getConnHandle());
+    }
+
+    if (!discoverHandles()) {
+      return false;
+    }
+    // Only handles that worked are remembered, a reconnect would otherwise keep trying the failing ones first.
+    if (subscribeByHandles()) {
+      mGattCache.store(mFtmsAddress, mGatt, mHandles);
+    } else {
+      Debug.println("Not remembering the FTMS handles, a subscription failed.");
+      mGattCache.forget();
+    }
+    return finishSetup();
+  }
+
+  bool finishSetup() {
+    mIsConnected = true;
+    mFoundTreadmill = true;
+    mAddressCache.save(mFtmsAddress);
+    return true;
+  }
+
+  /**
+   * Service discovery, fills mHandles. It's the slow part of connecting, a few round trips per characteristic.
+   */
+  bool discoverHandles() {
     #if VERBOSE_LOGGING
       printCharacteristicAndHandleMap(mClient);
     #endif
 
-    Debug.println("Connected to FTMS. Discovering service...");
-
     NimBLERemoteService* service = mClient->getService(FTMS_SERVICE_UUID);
     if (!service) {
       Debug.println("Failed to find FTMS service. Disconnecting...");
       mClient->disconnect();
-      return;
+      return false;
     }
 
     // Print out the treadmill's features if present
     //readAndPrintFeature(service, FTMS_CHARACTERISTIC_FEATURE,    "Fitness Machine Feature");
     readTreadmillFeatures(service, FTMS_CHARACTERISTIC_FEATURE, "Fitness Machine Feature");
 
+    memset(mHandles, 0, sizeof(mHandles));
+
     // Get Treadmill Data (0x2ACD)
-    mTreadmillDataChar = service->getCharacteristic(FTMS_CHARACTERISTIC_TREADMILL);
-    if (mTreadmillDataChar && mTreadmillDataChar->canNotify()) {
-      sSelf = this; // so static callback can call into our member
-      //mTreadmillDataChar->canIndicate() i think sperax can't do indicate.
-      // Fun FAc
-      mTreadmillDataChar->subscribe(true, onTreadmillDataNotify, mTreadmillDataChar->canIndicate());
-      Debug.printf("Subscribed to Treadmill Data (0x2ACD). Supports Indicate?: %d\n", mTreadmillDataChar->canIndicate());
+    NimBLERemoteCharacteristic* treadmillDataChar = service->getCharacteristic(FTMS_CHARACTERISTIC_TREADMILL);
+    if (treadmillDataChar && treadmillDataChar->canNotify()) {
+      //treadmillDataChar->canIndicate() i think sperax can't do indicate.
+      mHandles[H_DATA] = treadmillDataChar->getHandle();
+      mHandles[H_DATA_CCCD] = cccdHandleOf(treadmillDataChar);
+      Debug.printf("Found Treadmill Data (0x2ACD). Supports Indicate?: %d\n", treadmillDataChar->canIndicate());
     } else {
       Debug.println("Treadmill Data (0x2ACD) not found or not notifiable.");
     }
 
     // Get Fitness Machine Status (0x2ADA)
-    mFtmsStatusChar = service->getCharacteristic(FTMS_CHARACTERISTIC_STATUS);
-    if (mFtmsStatusChar && mFtmsStatusChar->canNotify()) {
-      mFtmsStatusChar->subscribe(true, onFtmsStatusNotify);
-      Debug.println("Subscribed to Fitness Machine Status (0x2ADA).");
+    NimBLERemoteCharacteristic* ftmsStatusChar = service->getCharacteristic(FTMS_CHARACTERISTIC_STATUS);
+    if (ftmsStatusChar && ftmsStatusChar->canNotify()) {
+      mHandles[H_STATUS] = ftmsStatusChar->getHandle();
+      mHandles[H_STATUS_CCCD] = cccdHandleOf(ftmsStatusChar);
     }
 
     // ** Control Point (2AD9) - for sending reset command, etc. **
-    mControlPointChar = service->getCharacteristic(FTMS_CHARACTERISTIC_CONTROLPOINT);
-    if (mControlPointChar) {
+    NimBLERemoteCharacteristic* controlPointChar = service->getCharacteristic(FTMS_CHARACTERISTIC_CONTROLPOINT);
+    if (controlPointChar) {
+      mHandles[H_CONTROL_POINT] = controlPointChar->getHandle();
       Debug.println("Found FTMS Control Point (0x2AD9).");
     } else {
       Debug.println("No FTMS Control Point (0x2AD9) found on treadmill.");
     }
+    return true;
+  }
 
-    mIsConnected = true;
-    mFoundTreadmill = true;
+  static uint16_t cccdHandleOf(NimBLERemoteCharacteristic* characteristic) {
+    NimBLERemoteDescriptor* cccd = characteristic->getDescriptor(NimBLEUUID(uint16_t(0x2902)));
+    return cccd ? cccd->getHandle() : GattLink::NO_HANDLE;
+  }
+
+  /**
+   * Returns false if a subscription the handles call for failed.
+   *
+   * Always notifications, like before the handles were cached: the old subscribe(true, callback, canIndicate())
+   * asked for notifications too, its third argument only chose a CCCD write with or without response. Only
+   * characteristics that can notify get a handle (see discoverHandles()), and GattLink writes the CCCD with
+   * response, which every GATT server has to answer.
+   */
+  bool subscribeByHandles() {
+    bool ok = true;
+    if (mHandles[H_DATA]) {
+      if (mGatt.subscribe(mHandles[H_DATA], mHandles[H_DATA_CCCD], onTreadmillDataNotify, this)) {
+        Debug.println("Subscribed to Treadmill Data (0x2ACD).");
+      } else {
+        Debug.println("Failed to subscribe to Treadmill Data (0x2ACD).");
+        ok = false;
+      }
+    }
+    if (mHandles[H_STATUS]) {
+      if (mGatt.subscribe(mHandles[H_STATUS], mHandles[H_STATUS_CCCD], onFtmsStatusNotify, this)) {
+        Debug.println("Subscribed to Fitness Machine Status (0x2ADA).");
+      } else {
+        Debug.println("Failed to subscribe to Fitness Machine Status (0x2ADA).");
+        ok = false;
+      }
+    }
+    return ok;
   }
 
   void readTreadmillFeatures(NimBLERemoteService* service, const char* uuid, const char* label) {
@@ -368,7 +512,19 @@ void printCharacteristicAndHandleMap(NimBLEClient* pClient) {
       InternalClientCallbacks(TreadmillDeviceFTMS* parent) : mParent(parent) {}
       void onConnect(NimBLEClient* pclient) override {
         Debug.println("FTMS treadmill connected (callback).");
-        mParent->mIsConnected = true;
+        if (mParent->mDirectConnectPending) {
+          // Discovery blocks, that's for the main loop and not this callback
+          mParent->mDirectConnectPending = false;
+          mParent->mDirectConnectDone = true;
+          return;
+        }
+        // setupConnectedTreadmill() marks it connected once the data is subscribed
+      }
+      void onConnectFail(NimBLEClient* pclient, int reason) override {
+        Debug.printf("FTMS treadmill didn't show up for a direct connect, reason=%d\n", reason);
+        mParent->mScanNext = true;
+        mParent->mConnectFailed = true;  // The retry timer is the loop's, it reschedules
+        mParent->mDirectConnectPending = false;
       }
       void onDisconnect(NimBLEClient* pclient, int reason) override {
         Debug.println("!!! FTMS treadmill disconnected.");
@@ -381,18 +537,12 @@ void printCharacteristicAndHandleMap(NimBLEClient* pClient) {
   // -----------------------------------------------------------------------
   // Notification callbacks
   // -----------------------------------------------------------------------
-  static void onTreadmillDataNotify(NimBLERemoteCharacteristic* pChar,
-                                    uint8_t* data, size_t length, bool isNotify) {
-    if (sSelf) {
-      sSelf->handleTreadmillData(data, length);
-    }
+  static void onTreadmillDataNotify(void* self, uint8_t* data, size_t length) {
+    static_cast<TreadmillDeviceFTMS*>(self)->handleTreadmillData(data, length);
   }
 
-  static void onFtmsStatusNotify(NimBLERemoteCharacteristic* pChar,
-                                uint8_t* data, size_t length, bool isNotify) {
-    if (sSelf) {
-      sSelf->handleFtmsStatus(data, length);
-    }
+  static void onFtmsStatusNotify(void* self, uint8_t* data, size_t length) {
+    static_cast<TreadmillDeviceFTMS*>(self)->handleFtmsStatus(data, length);
   }
 
   // -----------------------------------------------------------------------
@@ -447,6 +597,7 @@ void printCharacteristicAndHandleMap(NimBLEClient* pClient) {
     if (!(flags & 0x0001)) {
         uint16_t speedInMetersPerSecond = data[offset] | (data[offset + 1] << 8);
         uint16_t speedInKmPerHour = speedInMetersPerSecond * 3.6f;
+        gSpeedInKm = speedInMetersPerSecond * 0.01f;  // FTMS reports instantaneous speed in 0.01 km/h
 
   //           // Speed in FTMS is in units of 0.001 m/s
   //           float speedInMph = ftmsSpeedToMPH(speedRaw);
@@ -601,21 +752,21 @@ void printCharacteristicAndHandleMap(NimBLEClient* pClient) {
         }
         Debug.println();
     } 
+
+    treadmillDataUpdated();
   }
 
   void sendResetCommand() {
     Debug.println("\n----------------------\n=-=-=-=-\nEntered. RESET wrapper\n=-=-=-=\n---------------------------------");
     // now attempt to reset treadmill
-    if (mControlPointChar && mIsConnected) {
+    if (mHandles[H_CONTROL_POINT] && mIsConnected) {
       // Typically you do "Request Control (0x00)" then "Reset (0x01)"
-      std::vector<uint8_t> cmd;
-
-      uint16_t handle = mControlPointChar->getHandle();
+      uint16_t handle = mHandles[H_CONTROL_POINT];
       Debug.printf("Control Point characteristic handle: 0x%04X\n", handle);
 
       // 0x01 = Reset
-      cmd = { 0x08, 0x01 };
-      mControlPointChar->writeValue(cmd);
+      const uint8_t cmd[] = { 0x08, 0x01 };
+      mGatt.write(handle, cmd, sizeof(cmd), false);
 
       Debug.printf("Sent FTMS Request Control + Reset opcodes to treadmill via Handle (0x%04X)\n", handle);
     } else {
@@ -771,6 +922,3 @@ void printCharacteristicAndHandleMap(NimBLEClient* pClient) {
     }
   }
 };
-
-// Initialize static pointer
-TreadmillDeviceFTMS* TreadmillDeviceFTMS::sSelf = nullptr;
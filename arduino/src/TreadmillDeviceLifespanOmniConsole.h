@@ -4,6 +4,8 @@
 #include "globals.h"
 #include "TreadmillDevice.h"
 #include "HasElapsed.h"
+#include "TreadmillAddressCache.h"
+#include "GattHandleCache.h"
 
 /**
  * Simple helper to estimate miles-per-hour from the integer “speed” value.
@@ -83,8 +85,19 @@ private:
 
     // BLE client references for the console
     NimBLEClient* consoleClient = nullptr;
-    NimBLERemoteCharacteristic* consoleNotifyCharacteristic = nullptr;
-    NimBLERemoteCharacteristic* consoleWriteCharacteristic = nullptr;
+
+    // Handles of FFF1/FFF2, see GattHandleCache
+    enum HandleIndex : uint8_t { H_FFF1, H_FFF1_CCCD, H_FFF2 };
+    uint16_t handles[GattHandleCache::MAX_HANDLES] = {0};
+    uint16_t consoleWriteHandle = GattLink::NO_HANDLE;  // 0 while disconnected
+    GattLink gatt;
+    GattHandleCache gattCache{"omni"};
+
+    // Writes to the console don't get a response, so a wrong cached FFF2 handle only shows as
+    // the console never answering. After this many unanswered opcodes we discover again.
+    static constexpr uint8_t CACHED_HANDLES_MAX_UNANSWERED = 3;
+    bool usingCachedHandles = false;  // Until the console answered once
+    uint8_t unansweredWithCachedHandles = 0;
 
     bool consoleIsConnected = false;
     int consoleCommandIndex = 0;
@@ -100,20 +113,45 @@ private:
     int8_t   lastSessionStatus = -1;
 
 private:
-    // We'll store a single global pointer (singleton approach), so we can
-    // reference 'this' inside the static callback:
-    static TreadmillDeviceLifespanOmniConsole* globalInstance;
     HasElapsed connectionRetryTimer;
 
+    // Fast reconnects to the console we last connected to, a scan is the fallback
+    TreadmillAddressCache addressCache{"omni"};
+    volatile bool directConnectPending = false;  // Waiting for the remembered console to advertise
+    volatile bool directConnectDone = false;     // It connected, discovery is left to the main loop
+    volatile bool scanNext = false;              // The last direct connect timed out
+    volatile bool connectFailed = false;         // Set by onConnectFail, the main loop retries right away
+
     // -----------------------------------------------------------------------
     // Connection Step 0: Orchestrates everything.
-    // 1. Starts Scans
-    // 2. If found, we connect
+    // 1. Waits for the console we remember, if any (see startDirectConnect)
+    // 2. Otherwise starts Scans
+    // 3. If found, we connect
     // -----------------------------------------------------------------------
     void connectionStateMachine() {
+      if (directConnectPending) {
+        return;  // The controller is waiting for the console, onConnect or onConnectFail moves on
+      }
+      if (connectFailed) {
+        connectFailed = false;
+        connectionRetryTimer.runNextTimeIn(0);
+      }
+      if (directConnectDone) {
+        directConnectDone = false;
+        consoleIsConnected = true;
+        Debug.printf("Connected to the remembered Omni Console. Discovering services..\n");
+        if (!setupConnectedConsole()) {
+          scanNext = true;  // Maybe it isn't the same console anymore
+        }
+        return;
+      }
       if (connectionRetryTimer.isIntervalUp()) {
         if (!foundConsole) {
-          startScanForBLEPeripherals();
+          if (!scanNext && !NimBLEDevice::getScan()->isScanning() && addressCache.load(foundConsoleAddress)) {
+            startDirectConnect();
+          } else {
+            startScanForBLEPeripherals();
+          }
         }
         else {
           // Only connect if scanning has completely stopped (probably not needed)
@@ -133,8 +171,41 @@ private:
     void startScanForBLEPeripherals() {
       Debug.printf("Scanning for LifeSpan Omni Console...\n");
       foundConsole = false;
+      scanNext = false;
       NimBLEDevice::getScan()->setScanCallbacks(&mScanCallbacks, false);
       NimBLEDevice::getScan()->start(3000, false, true);
+
+      NimBLEAddress remembered;
+      if (addressCache.load(remembered)) {
+        // Go back to waiting for the remembered console right after the scan
+        connectionRetryTimer.runNextTimeIn(3100);
+      }
+    }
+
+    // -----------------------------------------------------------------------
+    // Connection Step 1 (fast): Ask the controller to connect to the console we were last
+    // connected to. It doesn't block, the controller connects the moment the console
+    // advertises, so there's no scan between powering it on and the first data.
+    // -----------------------------------------------------------------------
+    void startDirectConnect() {
+      NimBLEClient* client = getConsoleClient();
+      Debug.printf("Waiting for the remembered Omni Console at %s\n", foundConsoleAddress.toString().c_str());
+      directConnectPending = true;
+      if (!client->connect(foundConsoleAddress, true, true /* async */)) {
+        Debug.printf("Failed to start a direct connect, scanning instead.\n");
+        directConnectPending = false;
+        scanNext = true;
+      }
+    }
+
+    NimBLEClient* getConsoleClient() {
+      // One client for all reconnects, a new one each time would run out of them
+      if (!consoleClient) {
+        consoleClient = NimBLEDevice::createClient();
+        consoleClient->setClientCallbacks(&mClientCallbacks, false);
+        consoleClient->setConnectTimeout(TreadmillAddressCache::DIRECT_CONNECT_TIMEOUT_MS);
+      }
+      return consoleClient;
     }
 
     // -----------------------------------------------------------------------
@@ -182,10 +253,7 @@ private:
     // -----------------------------------------------------------------------
     void connectToFoundConsole() {
       foundConsole = false; consoleIsConnected = false; //mark them as fails, gets fixed if makes till end.
-      consoleWriteCharacteristic = nullptr;
-      consoleNotifyCharacteristic = nullptr;
-      consoleClient = NimBLEDevice::createClient();
-      consoleClient->setClientCallbacks(&mClientCallbacks);
+      getConsoleClient();
 
       Debug.printf("Attempting to connect to: %s\n", foundConsoleAddress.toString().c_str());
       if (!consoleClient->connect(foundConsoleAddress)) {
@@ -194,39 +262,77 @@ private:
       }
 
       Debug.printf("Connected to Omni Console. Discovering services..\n");
+      setupConnectedConsole();
+    }
+
+    /**
+     * Subscribes to FFF1 of the connected console, with the handles from the last connect when
+     * they're still good and a discovery of FFF0 otherwise. Returns false (and disconnects) if
+     * FFF1/FFF2 aren't there or FFF1 can't be subscribed to.
+     */
+    bool setupConnectedConsole() {
+      gatt.attach(consoleClient->getConnHandle());
+      unansweredWithCachedHandles = 0;
+      if (gattCache.restore(foundConsoleAddress, gatt, handles)) {
+        if (gatt.subscribe(handles[H_FFF1], handles[H_FFF1_CCCD], onConsoleNotify, this)) {
+          Debug.printf("Reused the console handles from the last connect, skipped discovery.\n");
+          usingCachedHandles = true;
+          return finishSetup();
+        }
+        Debug.printf("The remembered console handles didn't work, discovering again.\n");
+        gattCache.forget();
+        gatt.attach(consoleClient->getConnHandle());
+      }
+
+      usingCachedHandles = false;
+      memset(handles, 0, sizeof(handles));
       NimBLERemoteService* service = consoleClient->getService(CONSOLE_SERVICE_UUID);
       if (!service) {
         Debug.printf("Failed to find FFF0 service. Disconnecting...\n");
         consoleClient->disconnect();
-        return;
+        return false;
       }
 
       // FFF1 = notify
-      consoleNotifyCharacteristic = service->getCharacteristic(CONSOLE_CHAR_UUID_FFF1);
+      NimBLERemoteCharacteristic* consoleNotifyCharacteristic = service->getCharacteristic(CONSOLE_CHAR_UUID_FFF1);
       if (!consoleNotifyCharacteristic) {
         Debug.println("Failed to find FFF1 char. Disconnecting...");
         consoleClient->disconnect();
-        return;
+        return false;
       }
-      // We attach ourselves as a global instance for the callback
-      globalInstance = this;
-
-      if (consoleNotifyCharacteristic->canNotify()) {
-        consoleNotifyCharacteristic->subscribe(true, onConsoleNotify);
-        Debug.printf("Subbed to notifications on FFF1.\n");
+      handles[H_FFF1] = consoleNotifyCharacteristic->getHandle();
+
+      // Every answer of the console comes as an FFF1 notification, without them the connection is useless
+      // (and its handles mustn't be remembered).
+      NimBLERemoteDescriptor* cccd = consoleNotifyCharacteristic->getDescriptor(NimBLEUUID(uint16_t(0x2902)));
+      handles[H_FFF1_CCCD] = cccd ? cccd->getHandle() : GattLink::NO_HANDLE;
+      if (!consoleNotifyCharacteristic->canNotify() ||
+          !gatt.subscribe(handles[H_FFF1], handles[H_FFF1_CCCD], onConsoleNotify, this)) {
+        Debug.println("Failed to subscribe to FFF1. Disconnecting...");
+        consoleClient->disconnect();
+        return false;
       }
+      Debug.printf("Subbed to notifications on FFF1.\n");
 
       // FFF2 = write
-      consoleWriteCharacteristic = service->getCharacteristic(CONSOLE_CHAR_UUID_FFF2);
+      NimBLERemoteCharacteristic* consoleWriteCharacteristic = service->getCharacteristic(CONSOLE_CHAR_UUID_FFF2);
       if (!consoleWriteCharacteristic || !consoleWriteCharacteristic->canWrite()) {
         Debug.printf("FFF2 characteristic not found or not writable.\n");
         consoleClient->disconnect();
-        consoleWriteCharacteristic = nullptr;
-        return;
+        return false;
       }
+      handles[H_FFF2] = consoleWriteCharacteristic->getHandle();
 
+      gattCache.store(foundConsoleAddress, gatt, handles);
+      return finishSetup();
+    }
+
+    bool finishSetup() {
+      consoleWriteHandle = handles[H_FFF2];
       consoleIsConnected = true;
       foundConsole = true;
+      addressCache.save(foundConsoleAddress);
+      return true;
     }
 
     // -----------------------------------------------------------------------
@@ -239,12 +345,24 @@ private:
         InternalClientCallback(TreadmillDeviceLifespanOmniConsole* parent) : mParent(parent) {}
         void onConnect(NimBLEClient* pclient) override {
             Debug.printf("Console client connected.\n");
+            if (mParent->directConnectPending) {
+              // Discovery blocks, that's for the main loop and not this callback
+              mParent->directConnectPending = false;
+              mParent->directConnectDone = true;
+              return;
+            }
             mParent->consoleIsConnected = true;
         }
+        void onConnectFail(NimBLEClient* pclient, int reason) override {
+            Debug.printf("Omni Console didn't show up for a direct connect, reason: %d\n", reason);
+            mParent->scanNext = true;
+            mParent->connectFailed = true;  // The retry timer is the loop's, it reschedules
+            mParent->directConnectPending = false;
+        }
         void onDisconnect(NimBLEClient* pclient, int reason) override {
             Debug.printf("!!! Console client disconnected.\n");
             mParent->consoleIsConnected = false;
-            mParent->consoleWriteCharacteristic = nullptr;
+            mParent->consoleWriteHandle = GattLink::NO_HANDLE;
         }
       private:
         TreadmillDeviceLifespanOmniConsole* mParent;
@@ -269,7 +387,7 @@ private:
       if (canSend || forcedSend) {
         lastConsoleCommandSentAt = millis();
 
-        if (!consoleWriteCharacteristic) {
+        if (!consoleWriteHandle) {
           Debug.println("WARN: Tried to send opcode, but write characteristic is null.");
           return;
         }
@@ -280,10 +398,17 @@ private:
         if (!commandResponseReceived) {
             Debug.printf("ERROR: No response from opcode 0x%02X\n", lastConsoleCommandOpcode);
             neverRecvCIDCount++;
+            if (usingCachedHandles && ++unansweredWithCachedHandles >= CACHED_HANDLES_MAX_UNANSWERED) {
+              Debug.println("Console doesn't answer on the remembered handles, reconnecting with discovery.");
+              usingCachedHandles = false;
+              gattCache.forget();
+              consoleClient->disconnect();
+              return;
+            }
         }
 
         Debug.printf("Sending opcode 0x%02X (idx=%d)\n", opcode, consoleCommandIndex);
-        consoleWriteCharacteristic->writeValue((const uint8_t*)consoleCmdBuf, sizeof(consoleCmdBuf));
+        gatt.write(consoleWriteHandle, consoleCmdBuf, sizeof(consoleCmdBuf), false);
 
         lastConsoleCommandIndex  = consoleCommandIndex;
         lastConsoleCommandOpcode = opcode;
@@ -292,14 +417,9 @@ private:
       }
     }
 
-    static void onConsoleNotify(
-        NimBLERemoteCharacteristic* pCharacteristic,
-        uint8_t* data, size_t length, bool isNotify)
-    {
-        if (!globalInstance) {
-            return;
-        }
-        globalInstance->handleConsoleNotification(data, length); // allow us to get access to class variables.
+    static void onConsoleNotify(void* self, uint8_t* data, size_t length) {
+        // allow us to get access to class variables.
+        static_cast<TreadmillDeviceLifespanOmniConsole*>(self)->handleConsoleNotification(data, length);
     }
 
     void handleConsoleNotification(uint8_t* data, size_t length) {
@@ -393,6 +513,7 @@ private:
           break;
       }
       commandResponseReceived = true;
+      usingCachedHandles = false;
     }
 
     void requestDataFromOmniConsole() {
@@ -419,7 +540,7 @@ private:
         }
 
         Debug.printf("Sending opcode 0x%02X (idx=%d)\n", opcode, consoleCommandIndex);
-        consoleWriteCharacteristic->writeValue((const uint8_t*)consoleCmdBuf, sizeof(consoleCmdBuf));
+        gatt.write(consoleWriteHandle, consoleCmdBuf, sizeof(consoleCmdBuf), false);
 
         lastConsoleCommandIndex  = consoleCommandIndex;
         lastConsoleCommandOpcode = opcode;
@@ -429,6 +550,3 @@ private:
       }
     }
 };
-
-// Initialize the static pointer to null
-TreadmillDeviceLifespanOmniConsole* TreadmillDeviceLifespanOmniConsole::globalInstance = nullptr;
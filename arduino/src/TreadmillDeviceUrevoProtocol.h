@@ -5,6 +5,8 @@
 #include "globals.h"
 #include "TreadmillDevice.h"
 #include "HasElapsed.h"
+#include "TreadmillAddressCache.h"
+#include "GattHandleCache.h"
 
 /**
  * This implementation is like a hybrid between FTMS and a proprietary protocol.
@@ -22,10 +24,7 @@ class TreadmillDeviceUrevoProtocol : public TreadmillDevice {
         mSpeedBelowThresholdStart(0),
         mIsConnected(false),
         mFoundTreadmill(false),
-        mClient(nullptr),
-        mTreadmillDataChar(nullptr),
-        mFtmsStatusChar(nullptr),
-        mControlPointChar(nullptr)  // << Added
+        mClient(nullptr)
     {
       // empty
     }
@@ -92,17 +91,25 @@ class TreadmillDeviceUrevoProtocol : public TreadmillDevice {
   bool mFoundTreadmill;
 
   // BLE client references
-  NimBLEClient*               mClient;
-  NimBLERemoteCharacteristic* mTreadmillDataChar;
-  NimBLERemoteCharacteristic* mFtmsStatusChar;
-  NimBLERemoteCharacteristic* mControlPointChar;  // << Added
-  
-  NimBLERemoteCharacteristic* mRevoWriteChar;
+  NimBLEClient* mClient;
+
+  // Handles of the characteristics we use, 0 where the treadmill doesn't have one (see GattHandleCache)
+  enum HandleIndex : uint8_t { H_CONTROL_POINT, H_UREVO_DATA, H_UREVO_DATA_CCCD, H_UREVO_WRITE };
+  uint16_t mHandles[GattHandleCache::MAX_HANDLES] = {0};
+  GattLink mGatt;
+  GattHandleCache mGattCache{"urevo"};
 
   // State
   bool mIsConnected;
   HasElapsed mConnectionRetryTimer;
 
+  // Fast reconnects to the treadmill we last connected to, a scan is the fallback
+  TreadmillAddressCache mAddressCache{"urevo"};
+  volatile bool mDirectConnectPending = false;  // Waiting for the remembered treadmill to advertise
+  volatile bool mDirectConnectDone = false;     // It connected, discovery is left to the main loop
+  volatile bool mScanNext = false;              // The last direct connect timed out
+  volatile bool mConnectFailed = false;         // Set by onConnectFail, the main loop retries right away
+
   bool mResetPending = false;
   unsigned long mResetStartTime = 0;
 
@@ -150,17 +157,34 @@ class TreadmillDeviceUrevoProtocol : public TreadmillDevice {
   // For speed-based session end detection:
   unsigned long mSpeedBelowThresholdStart; // 0 if currently above threshold
 
-  // A global pointer so static callbacks can delegate to 'this'
-  static TreadmillDeviceUrevoProtocol* sSelf;
-
   private:
   // -----------------------------------------------------------------------
   // Connection Logic
   // -----------------------------------------------------------------------
   void connectionStateMachine() {
+    if (mDirectConnectPending) {
+      return;  // The controller is waiting for the treadmill, onConnect or onConnectFail moves on
+    }
+    if (mConnectFailed) {
+      mConnectFailed = false;
+      mConnectionRetryTimer.runNextTimeIn(0);
+    }
+    if (mDirectConnectDone) {
+      mDirectConnectDone = false;
+      Debug.println("Connected to the remembered UREVO. Discovering service...");
+      if (!setupConnectedTreadmill()) {
+        dropConnection();
+        mScanNext = true;  // Maybe it isn't the same treadmill anymore
+      }
+      return;
+    }
     if (mConnectionRetryTimer.isIntervalUp()) {
       if (!mFoundTreadmill) {
-        startScan();
+        if (!mScanNext && !NimBLEDevice::getScan()->isScanning() && mAddressCache.load(mFtmsAddress)) {
+          startDirectConnect();
+        } else {
+          startScan();
+        }
       } else {
         // Attempt to connect if not scanning
         if (!NimBLEDevice::getScan()->isScanning()) {
@@ -173,19 +197,50 @@ class TreadmillDeviceUrevoProtocol : public TreadmillDevice {
   void startScan() {
     Debug.println("Scanning for FTMS treadmill (Service 0x1826)...");
     mFoundTreadmill = false;
+    mScanNext = false;
 
     NimBLEScan* scan = NimBLEDevice::getScan();
     scan->setScanCallbacks(&mScanCallbacks, false /* not using duplicates */);
     scan->setActiveScan(true);
     scan->start(SCAN_DURATION_MS, false, true);
+
+    NimBLEAddress remembered;
+    if (mAddressCache.load(remembered)) {
+      // Go back to waiting for the remembered treadmill right after the scan
+      mConnectionRetryTimer.runNextTimeIn(SCAN_DURATION_MS + 100);
+    }
+  }
+
+  /**
+   * Asks the controller to connect to the treadmill we were last connected to. It doesn't block, the controller
+   * connects the moment the treadmill advertises, so there's no scan between powering it on and the first data.
+   */
+  void startDirectConnect() {
+    NimBLEClient* client = getClient();
+    Debug.printf("Waiting for the remembered UREVO at %s\n", mFtmsAddress.toString().c_str());
+    mDirectConnectPending = true;
+    if (!client->connect(mFtmsAddress, true, true /* async */)) {
+      Debug.println("Failed to start a direct connect, scanning instead.");
+      mDirectConnectPending = false;
+      mScanNext = true;
+    }
+  }
+
+  NimBLEClient* getClient() {
+    // One client for all reconnects, a new one each time would run out of them
+    if (!mClient) {
+      mClient = NimBLEDevice::createClient();
+      mClient->setClientCallbacks(&mClientCallbacks, false);
+      mClient->setConnectTimeout(TreadmillAddressCache::DIRECT_CONNECT_TIMEOUT_MS);
+    }
+    return mClient;
   }
 
   void connectToFoundTreadmill() {
     mFoundTreadmill = false;
     mIsConnected = false;
 
-    mClient = NimBLEDevice::createClient();
-    mClient->setClientCallbacks(&mClientCallbacks);
+    getClient();
 
     Debug.printf("Attempting to connect to UREVO device at %s\n",
                 mFtmsAddress.toString().c_str());
@@ -195,8 +250,49 @@ class TreadmillDeviceUrevoProtocol : public TreadmillDevice {
       return;
     }
     Debug.println("Connected to UREVO. Discovering service...");
+    if (!setupConnectedTreadmill()) {
+      dropConnection();
+    }
+  }
+
+  /**
+   * Gives up on a connection whose setup failed. The treadmill may still be connected (a subscription or the
+   * start command failed), then onDisconnect never comes and loopHandler() wouldn't look for it again.
+   */
+  void dropConnection() {
+    mIsConnected = false;
+    mClient->disconnect();
+  }
+
+  /**
+   * Subscribes to the UREVO data of the connected treadmill, with the handles from the last connect when they're
+   * still good and a discovery of the services otherwise. Returns false if that didn't work out.
+   */
+  bool setupConnectedTreadmill() {
+    mGatt.attach(mClient->getConnHandle());
+    if (mGattCache.restore(mFtmsAddress, mGatt, mHandles)) {
+      if (subscribeToUrevo()) {
+        Debug.println("Reused the UREVO handles from the last connect, skipped discovery.");
+        mAddressCache.save(mFtmsAddress);
+        return true;
+      }
+      Debug.println("The remembered UREVO handles didn't work, discovering again.");
+      mGattCache.forget();
+      mGatt.attach(mClient->getConnHandle());
+    }
 
+    if (!discoverHandles() || !subscribeToUrevo()) {
+      return false;
+    }
+    mGattCache.store(mFtmsAddress, mGatt, mHandles);
+    mAddressCache.save(mFtmsAddress);
+    return true;
+  }
 
+  /**
+   * Service discovery, fills mHandles. It's the slow part of connecting, a few round trips per characteristic.
+   */
+  bool discoverHandles() {
     #if VERBOSE_LOGGING
       printCharacteristicAndHandleMap(mClient);
 
@@ -208,67 +304,72 @@ class TreadmillDeviceUrevoProtocol : public TreadmillDevice {
     if (!service) {
       Debug.println("Failed to find FTMS service. Disconnecting...");
       mClient->disconnect();
-      return;
+      return false;
     }
 
+    memset(mHandles, 0, sizeof(mHandles));
+
     // ** Control Point (2AD9) - for sending reset command, etc. **
-    mControlPointChar = service->getCharacteristic(FTMS_CHARACTERISTIC_CONTROLPOINT);
-    if (mControlPointChar) {
+    NimBLERemoteCharacteristic* controlPointChar = service->getCharacteristic(FTMS_CHARACTERISTIC_CONTROLPOINT);
+    if (controlPointChar) {
+      mHandles[H_CONTROL_POINT] = controlPointChar->getHandle();
       Debug.println("Found FTMS Control Point (0x2AD9).");
     } else {
       Debug.println("No FTMS Control Point (0x2AD9) found on treadmill.");
     }
 
-    subscribeToUrevo();
-  }
-
-  void subscribeToUrevo() {
     NimBLERemoteService* uRevoService = mClient->getService("FFF0");
-    if( uRevoService ) {
-      NimBLERemoteCharacteristic* uRevoChar = uRevoService->getCharacteristic("FFF1");
-      if( uRevoChar ) {
-        if (!uRevoChar->subscribe(true, onURevoDataNotify)) {
-          Debug.println("Subscribe failed.");
-          return;
-        } else {
-          sSelf = this; // so static callback can call into our member
-          Debug.println("Subbed to UREVO!");
-          // TODO if this is called more than once.
-          mRevoWriteChar = uRevoService->getCharacteristic("FFF2");
-          if( mRevoWriteChar ) {
-            writeStartCommand();
-            mIsConnected = true;
-            mFoundTreadmill = true;
-            return;
-          }
-          else {
-            Debug.println("didn't find urevo write.");
-            return;
-          }
-
-        }
-      } else {
-        Debug.println("Didn't find FFF1 characteristic (the urevo service");
-        return;
-      }
-    } else {
+    if( !uRevoService ) {
       Debug.println("Didn't find FFFO (the urevo service");
-      return;
+      return false;
+    }
+    NimBLERemoteCharacteristic* uRevoChar = uRevoService->getCharacteristic("FFF1");
+    if( !uRevoChar ) {
+      Debug.println("Didn't find FFF1 characteristic (the urevo service");
+      return false;
+    }
+    NimBLERemoteDescriptor* uRevoCccd = uRevoChar->getDescriptor(NimBLEUUID(uint16_t(0x2902)));
+    NimBLERemoteCharacteristic* uRevoWriteChar = uRevoService->getCharacteristic("FFF2");
+    if( !uRevoWriteChar ) {
+      Debug.println("didn't find urevo write.");
+      return false;
+    }
+    mHandles[H_UREVO_DATA] = uRevoChar->getHandle();
+    mHandles[H_UREVO_DATA_CCCD] = uRevoCccd ? uRevoCccd->getHandle() : GattLink::NO_HANDLE;
+    mHandles[H_UREVO_WRITE] = uRevoWriteChar->getHandle();
+    return true;
+  }
+
+  bool subscribeToUrevo() {
+    if (!mGatt.subscribe(mHandles[H_UREVO_DATA], mHandles[H_UREVO_DATA_CCCD], onURevoDataNotify, this)) {
+      Debug.println("Subscribe failed.");
+      return false;
+    }
+    Debug.println("Subbed to UREVO!");
+    if (!writeStartCommand()) {
+      return false;
     }
+    mIsConnected = true;
+    mFoundTreadmill = true;
+    return true;
   }
 
   /**
    * write this payload causes data to stream.
    * When you write the reset command via FTMS you have to resend the command.
    */
-  void writeStartCommand() {
-    if( mRevoWriteChar ) {
-      std::vector<uint8_t> cmd;
-      cmd = { 0x02, 0x51, 0x0B, 0x03 };
-      const bool writeStatus = mRevoWriteChar->writeValue(cmd, true);
+  bool writeStartCommand() {
+    if( mHandles[H_UREVO_WRITE] ) {
+      const uint8_t cmd[] = { 0x02, 0x51, 0x0B, 0x03 };
+      const bool writeStatus = mGatt.write(mHandles[H_UREVO_WRITE], cmd, sizeof(cmd), true);
       Debug.printf("Wrote thing to start stuff... %d\n", writeStatus);
+      if (!writeStatus) {
+        mGattCache.forget();  // Rediscover on the next connect in case the handle moved
+      }
+      return writeStatus;
     } else {
-      Debug.println("ERROR: mRevoWriteChar is not truthy");
+      Debug.println("ERROR: UREVO write handle is not set");
+      return false;
     }
   }
 
@@ -307,7 +408,19 @@ class TreadmillDeviceUrevoProtocol : public TreadmillDevice {
       InternalClientCallbacks(TreadmillDeviceUrevoProtocol* parent) : mParent(parent) {}
       void onConnect(NimBLEClient* pclient) override {
         Debug.println("FTMS treadmill connected (callback).");
-        mParent->mIsConnected = true;
+        if (mParent->mDirectConnectPending) {
+          // Discovery blocks, that's for the main loop and not this callback
+          mParent->mDirectConnectPending = false;
+          mParent->mDirectConnectDone = true;
+          return;
+        }
+        // setupConnectedTreadmill() marks it connected once the data is subscribed
+      }
+      void onConnectFail(NimBLEClient* pclient, int reason) override {
+        Debug.printf("UREVO didn't show up for a direct connect, reason=%d\n", reason);
+        mParent->mScanNext = true;
+        mParent->mConnectFailed = true;  // The retry timer is the loop's, it reschedules
+        mParent->mDirectConnectPending = false;
       }
       void onDisconnect(NimBLEClient* pclient, int reason) override {
         Debug.println("!!! FTMS treadmill disconnected.");
@@ -335,11 +448,8 @@ class TreadmillDeviceUrevoProtocol : public TreadmillDevice {
   //                                                                      ^---- Steps
   // -----------------------------------------------------------------------
   
-  static void onURevoDataNotify(NimBLERemoteCharacteristic* pChar,
-                                    uint8_t* data, size_t length, bool isNotify) {
-    if (sSelf) {
-      sSelf->handleURevoDataNotify(data, length);
-    }
+  static void onURevoDataNotify(void* self, uint8_t* data, size_t length) {
+    static_cast<TreadmillDeviceUrevoProtocol*>(self)->handleURevoDataNotify(data, length);
   }
 
   float milesTenthsToMeters(uint16_t tenthsOfMile) {
@@ -396,24 +506,24 @@ class TreadmillDeviceUrevoProtocol : public TreadmillDevice {
       gDistanceInMeters = milesTenthsToMeters(distanceInPoint1Miles);
       gSteps = data[UREVO_STEP_IDX+1] << 8 | data[UREVO_STEP_IDX];
       gDurationInSecs = data[UREVO_DURATION_IDX+1] << 8 | data[UREVO_DURATION_IDX];
+      gSpeedInKm = data[UREVO_SPEED_IDX] * 0.160934f;  // 0.1 mph increments
       
       Debug.printf("Steps: %lu, meters: %lu, duration: %lu\n", gSteps, gDistanceInMeters, gDurationInSecs);
+      treadmillDataUpdated();
     }
   }
 
   void sendResetCommand() {
     Debug.println("\n----------------------\n=-=-=-=-\nEntered. RESET wrapper\n=-=-=-=\n---------------------------------");
     // now attempt to reset treadmill
-    if (mControlPointChar && mIsConnected) {
+    if (mHandles[H_CONTROL_POINT] && mIsConnected) {
       // Typically you do "Request Control (0x00)" then "Reset (0x01)"
-      std::vector<uint8_t> cmd;
-
-      uint16_t handle = mControlPointChar->getHandle();
+      uint16_t handle = mHandles[H_CONTROL_POINT];
       Debug.printf("Control Point characteristic handle: 0x%04X\n", handle);
 
       // 0x01 = Reset
-      cmd = { 0x08, 0x01 };
-      mControlPointChar->writeValue(cmd);
+      const uint8_t cmd[] = { 0x08, 0x01 };
+      mGatt.write(handle, cmd, sizeof(cmd), false);
       Debug.printf("Sent FTMS Request Control + Reset opcodes to treadmill via Handle (0x%04X)\n", handle);
       delay(1000);
       writeStartCommand();
@@ -784,6 +894,3 @@ class TreadmillDeviceUrevoProtocol : public TreadmillDevice {
   //   }
   // }
 };
-
-// Initialize static pointer
-TreadmillDeviceUrevoProtocol* TreadmillDeviceUrevoProtocol::sSelf = nullptr;
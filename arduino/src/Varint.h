@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Unsigned LEB128 varints and zigzag mapping, shared by the flash record codecs (SessionRecord.h, TelemetryCodec.h).
+ * Plain C++ so the codecs can be compiled on the host.
+ */
+namespace Varint {
+  static constexpr uint32_t MAX_SIZE = 5;  // uint32_t
+
+  inline uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+  }
+
+  inline int32_t unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+  }
+
+  /**
+   * Writes value to out (at least MAX_SIZE bytes) and returns the number of bytes used.
+   */
+  inline uint32_t put(uint8_t* out, uint32_t value) {
+    uint32_t len = 0;
+    while (value >= 0x80) {
+      out[len++] = (uint8_t)(value | 0x80);
+      value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+  }
+
+  /**
+   * Reads a varint at in[pos] and advances pos past it. Returns false if it runs past len.
+   */
+  inline bool get(const uint8_t* in, uint32_t len, uint32_t& pos, uint32_t& value) {
+    value = 0;
+    for (uint32_t shift = 0; shift < 35 && pos < len; shift += 7) {
+      uint8_t b = in[pos++];
+      value |= (uint32_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  }
+}
@@ -4,9 +4,12 @@
 #include "DebugWrapper.h"
 
 struct TreadmillSession {
-  uint32_t start;
-  uint32_t stop;
-  uint32_t steps;
+  uint32_t start = 0;
+  uint32_t stop = 0;
+  uint32_t steps = 0;
+  uint32_t distanceMeters = 0;  // 0 when the treadmill doesn't report these
+  uint32_t calories = 0;
+  uint32_t activeSecs = 0;
 };
 
 // ---------------------------------------------------------------------------
@@ -42,3 +45,8 @@ void sessionStartedDetected();
  * Called by your treadmill device when a session ends
  */
 void sessionEndedDetected();
+
+/**
+ * Called by your treadmill device after it updated gSteps, gSpeedInKm and gDistanceInMeters
+ */
+void treadmillDataUpdated();
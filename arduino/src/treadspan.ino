@@ -54,6 +54,11 @@
 //#define HAS_RTC_DS3231                        // ⏰ UNCOMMON: Enable support for DS3231 Real-Time Clock (RTC)
 //#define SESSION_SIMULATION_BUTTONS_ENABLED 1  // 🕹️ Enable test buttons for session simulation
 //#define LCD_4x20_ENABLED 1                    // 🖨️ UNCOMMON: Enable 4x20 I2C LCD screen support
+#define TELEMETRY_ENABLED 1                     // 📈 Record a ~1Hz steps/speed/distance series of every session (telemetry partition)
+#define FOLD_OLD_SESSIONS_WHEN_FULL 1           // 🗜️ When storage fills up, fold the oldest unsynced sessions into one per day instead of dropping new ones
+//#define L2CAP_EXPORT_ENABLED 1                 // 🚚 UNCOMMON: Bulk export of sessions and telemetry over an L2CAP channel (also uncomment CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM in platformio.ini)
+#define MAX_MOBILE_APPS 3                       // 📱 Phones that can sync at the same time, the device keeps advertising until this many are connected
+#define LIVE_METRICS_INTERVAL_MS 250            // 📶 Live steps/speed/distance go to a subscribed app at most this often, changes in between are coalesced
 
 #ifndef LOAD_WIFI_CREDENTIALS_FROM_EEPROM
   const char* ssid = "Angela";
@@ -62,7 +67,7 @@
 
 #ifdef SESSION_SIMULATION_BUTTONS_ENABLED
   #define BUTTON_PIN 2  // 🔘 D2 - Press to simulate a treadmill session
-  #define CLEAR_PIN 0   // 🔘 D3 - Press to clear all sessions in EEPROM
+  #define CLEAR_PIN 0   // 🔘 D3 - Press to clear all stored sessions
 #endif
 
 /******************************************************************************************
@@ -111,6 +116,14 @@
 
 #include "TreadmillDevice.h"
 #include "globals.h"
+#include "SessionStore.h"
+#include "TelemetryRecorder.h"
+#include "DailyRollups.h"
+#include "SessionCheckpoint.h"
+#include "StorageWriter.h"
+#include "SessionSync.h"
+#include "LiveMetrics.h"
+#include "BulkExport.h"
 
 #include "TreadmillDeviceLifespanOmniConsole.h"
 #include "TreadmillDeviceLifespanRetroConsole.h"
@@ -158,9 +171,47 @@
 #define MAX_SSID_LENGTH 32
 #define SSID_INDEX 0
 #define PASSWORDS_INDEX 32
-#define SESSIONS_START_INDEX 64
-#define SESSION_SIZE_BYTES sizeof(TreadmillSession)
-#define MAX_SESSIONS ((EEPROM_SIZE - (SESSIONS_START_INDEX + 4)) / SESSION_SIZE_BYTES)
+#define LEGACY_SESSIONS_START_INDEX 64
+#define LEGACY_SESSION_SIZE_BYTES 12
+#define LEGACY_MAX_SESSIONS ((EEPROM_SIZE - (LEGACY_SESSIONS_START_INDEX + 4)) / LEGACY_SESSION_SIZE_BYTES)
+
+SessionStore sessionStore;
+DailyRollups dailyRollups;
+SessionCheckpoint sessionCheckpoint;
+StorageWriter storageWriter;  // Runs the flash writes of the storage classes on their own task
+
+// Checkpointing of the running session, so a reset mid-walk doesn't lose it
+#define CHECKPOINT_INTERVAL_MS (60 * 1000)   // Checkpoint at least this often while walking...
+#define CHECKPOINT_STEPS 250                 // ...and whenever this many steps were added
+#define RESUME_WINDOW_SECS (10 * 60)         // A session interrupted by a reset is resumed if the treadmill is still going within this time
+
+#ifdef TELEMETRY_ENABLED
+  TelemetryRecorder telemetryRecorder;
+  TelemetryRecorder::ReadCursor telemetryReadCursor;
+  volatile bool telemetryReadPending = false;
+  uint16_t telemetryConnHandle = BLE_HS_CONN_HANDLE_NONE;  // The phone that asked
+  uint32_t telemetryRequestKey = 0;
+  uint16_t telemetryRequestConnHandle = BLE_HS_CONN_HANDLE_NONE;
+  volatile bool telemetryRequestPending = false;  // Set by the characteristic callback, the loop starts the read
+#endif
+
+#ifdef L2CAP_EXPORT_ENABLED
+  #if CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM < 1
+    #error "L2CAP_EXPORT_ENABLED needs -D CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM=1 in the build flags"
+  #endif
+  #define L2CAP_EXPORT_PSM 0x0080  // First dynamic LE PSM, the app reads it from the export PSM characteristic
+  #define L2CAP_EXPORT_MTU 512
+
+  #ifdef TELEMETRY_ENABLED
+    BulkExport bulkExport(sessionStore, &telemetryRecorder);
+  #else
+    BulkExport bulkExport(sessionStore, nullptr);
+  #endif
+  NimBLEL2CAPChannel* exportChannel = nullptr;
+  uint8_t exportRequest[8];
+  volatile uint32_t exportRequestLen = 0;  // Set by the channel callback, the loop starts the export
+  volatile bool exportCancelPending = false;
+#endif
 
 
 
@@ -174,16 +225,129 @@ static const char* BLE_DATA_CHAR_UUID = "0000A51A-12BB-C111-1337-00099AACDEF1";
 static const char* BLE_CONFIRM_CHAR_UUID = "0000A51A-12BB-C111-1337-00099AACDEF2";
 static const char* BLE_TIME_READ_CHAR_UUID = "0000A51A-12BB-C111-1337-00099AACDEF3";
 static const char* BLE_TIME_WRITE_CHAR_UUID = "0000A51A-12BB-C111-1337-00099AACDEF4";
+static const char* BLE_TELEMETRY_CHAR_UUID = "0000A51A-12BB-C111-1337-00099AACDEF5";
+static const char* BLE_DAILY_HISTORY_CHAR_UUID = "0000A51A-12BB-C111-1337-00099AACDEF6";
+static const char* BLE_LIVE_METRICS_CHAR_UUID = "0000A51A-12BB-C111-1337-00099AACDEF7";
+static const char* BLE_EXPORT_PSM_CHAR_UUID = "0000A51A-12BB-C111-1337-00099AACDEF8";
+
+// BLE link parameters of the mobile app connection. Intervals are in 1.25ms units and timeouts in 10ms units,
+// both sets stay within Apple's accessory guidelines (max >= min + 15ms, max * (latency + 1) <= 2s).
+#define BLE_PREFERRED_MTU 517          // Largest ATT MTU, a batch of sessions then fits in one notification
+#define BLE_DATA_LENGTH_OCTETS 251     // Data length extension, one link layer packet per notification
+#define BLE_FAST_INTERVAL_MIN 12       // 15ms while syncing or streaming history/telemetry...
+#define BLE_FAST_INTERVAL_MAX 24       // ...up to 30ms
+#define BLE_FAST_LATENCY 0
+#define BLE_FAST_TIMEOUT 400           // 4s
+#define BLE_IDLE_INTERVAL_MIN 80       // 100ms once the transfers are over...
+#define BLE_IDLE_INTERVAL_MAX 160      // ...up to 200ms
+#define BLE_IDLE_LATENCY 4             // The phone may skip 4 events, the idle link is mostly live metrics
+#define BLE_IDLE_TIMEOUT 600           // 6s
+#define BLE_RELAX_DELAY_MS 3000        // Idle this long before relaxing, apps ask for history right after a sync
 
 // BLE Peripheral Variables (modified for NimBLE)
 NimBLEServer* pServer = nullptr;
 NimBLECharacteristic* dataCharacteristic = nullptr;
 NimBLECharacteristic* confirmCharacteristic = nullptr;
-bool isMobileAppConnected = false;
-bool isMobileAppSubscribed = false;
-bool haveNotifiedMobileAppOfFirstSession = false;
 
-int currentSessionIndex = 0;
+// The treadmill takes one connection, the phones get the rest. The Arduino IDE builds NimBLE with its default of
+// 3 connections, so fewer phones than MAX_MOBILE_APPS can connect there (platformio.ini raises it).
+#if defined(CONFIG_BT_NIMBLE_MAX_CONNECTIONS) && (MAX_MOBILE_APPS + 1 > CONFIG_BT_NIMBLE_MAX_CONNECTIONS)
+  #warning "CONFIG_BT_NIMBLE_MAX_CONNECTIONS is too low for MAX_MOBILE_APPS phones and the treadmill, serving fewer phones"
+  #undef MAX_MOBILE_APPS
+  #if CONFIG_BT_NIMBLE_MAX_CONNECTIONS > 1
+    #define MAX_MOBILE_APPS (CONFIG_BT_NIMBLE_MAX_CONNECTIONS - 1)
+  #else
+    #define MAX_MOBILE_APPS 1
+  #endif
+#endif
+
+SyncResumeTable syncResumeTable;  // Outlives connections, so an interrupted sync picks up where it stopped
+
+/**
+ * A connected phone. Each one syncs on its own (format, cursor, window) and gets its own link parameters.
+ * The slots and everything in them are guarded by MobileAppsLock.
+ */
+struct MobileApp {
+  uint16_t connHandle = BLE_HS_CONN_HANDLE_NONE;  // NONE while the slot is free
+  bool isSubscribed = false;
+  bool haveNotifiedOfFirstSession = false;
+  bool isLiveMetricsSubscribed = false;
+  bool isLinkFast = false;
+  uint32_t lastBusy = 0;
+  SessionSync sync;
+
+  MobileApp() : sync(sessionStore, syncResumeTable) {}
+};
+MobileApp mobileApps[MAX_MOBILE_APPS];
+
+/**
+ * Guards mobileApps. The NimBLE callbacks take it to update a slot and the loop to drive the syncs, it's only
+ * ever held for RAM updates and sending what was read, never across a flash erase like the storage lock, so the
+ * host task doesn't wait for one. The loop takes the storage lock first when it needs both.
+ */
+SemaphoreHandle_t mobileAppsMutex = nullptr;
+
+class MobileAppsLock {
+  public:
+    MobileAppsLock() {
+      if (mobileAppsMutex) {
+        xSemaphoreTakeRecursive(mobileAppsMutex, portMAX_DELAY);
+      }
+    }
+
+    ~MobileAppsLock() {
+      if (mobileAppsMutex) {
+        xSemaphoreGiveRecursive(mobileAppsMutex);
+      }
+    }
+};
+
+/**
+ * A write to the confirm characteristic, ConfirmCallback copies it for the loop, see handleAppWrites().
+ */
+struct AppWrite {
+  static constexpr uint32_t MAX_LEN = 16;  // The longest is the version 3 hello, 10 bytes
+
+  uint16_t connHandle;
+  uint8_t len;
+  uint8_t data[MAX_LEN];
+};
+#define APP_WRITE_QUEUE_DEPTH 16
+QueueHandle_t appWriteQueue = nullptr;
+
+/**
+ * The phone on this connection, nullptr if there's none. With BLE_HS_CONN_HANDLE_NONE it finds a free slot.
+ */
+MobileApp* findMobileApp(uint16_t connHandle) {
+  for (MobileApp& app : mobileApps) {
+    if (app.connHandle == connHandle) {
+      return &app;
+    }
+  }
+  return nullptr;
+}
+
+uint32_t mobileAppCount() {
+  uint32_t count = 0;
+  for (MobileApp& app : mobileApps) {
+    count += (app.connHandle != BLE_HS_CONN_HANDLE_NONE);
+  }
+  return count;
+}
+
+bool isMobileAppConnected() {
+  return mobileAppCount() > 0;
+}
+
+bool isMobileAppSubscribed() {
+  for (MobileApp& app : mobileApps) {
+    if (app.connHandle != BLE_HS_CONN_HANDLE_NONE && app.isSubscribed) {
+      return true;
+    }
+  }
+  return false;
+}
+
 int sessionsStored = 0;
 bool clearedSessions = false;
 bool areWifiCredentialsSet = false;
@@ -191,6 +355,11 @@ bool areWifiCredentialsSet = false;
 // NEW: Pointers to the new time characteristics
 NimBLECharacteristic* timeReadCharacteristic = nullptr;   // NEW
 NimBLECharacteristic* timeWriteCharacteristic = nullptr;  // NEW
+NimBLECharacteristic* telemetryCharacteristic = nullptr;
+NimBLECharacteristic* dailyHistoryCharacteristic = nullptr;
+NimBLECharacteristic* liveMetricsCharacteristic = nullptr;
+volatile bool liveMetricsResetPending = false;
+LiveMetricsNotifier liveMetrics(LIVE_METRICS_INTERVAL_MS);
 
 // COMMON STATE VARIABLES (RETRO / OMNI)
 uint32_t gSteps = 0;
@@ -199,6 +368,7 @@ uint32_t gDistance = 0;
 uint32_t gDistanceInMeters = 0;        
 bool gIsTreadmillActive = 0;
 float gSpeedFloat = 0;
+float gSpeedInKm = 0;
 uint16_t gDurationInSecs = 0;
 
 volatile bool gResetRequested = 0;
@@ -207,16 +377,28 @@ volatile bool gResetRequested = 0;
 //float avgSpeedFloat = 0;  // only omni console
 //int speedInt = 0;
 
-// NEW: Global variables for tracking today's steps
-String lastRecordedDate = "";       //YYYY-MM-DD
-unsigned long totalStepsToday = 0;  //
 TreadmillSession gCurrentSession;
 
+// Session that was running when the device reset, or one the full storage queue didn't take, see
+// handleOrphanedSession()
+TreadmillSession orphanedSession;
+uint32_t orphanedSessionUpdated = 0;
+bool hasOrphanedSession = false;
+TreadmillSession resumedSession;  // Totals at the last checkpoint of a resumed session
+bool wasSessionResumed = false;
+uint32_t lastCheckpointSteps = 0;
+
+// Daily history requested over BLE, see DailyHistoryCallbacks
+uint16_t historyConnHandle = BLE_HS_CONN_HANDLE_NONE;  // The phone that asked
+uint32_t historyNextDay = 0;
+uint32_t historyLastDay = 0;
+volatile bool historyReadPending = false;
+
 
 //------------------- COMMON TIME SETTING --------------------//
+uint32_t getLocalDayNumber(time_t t);
 String getFormattedTimeYMD();
 String getFormattedTimeHMS();
-String getFormattedDate();
 void tftWifiConnectingScreen(const char*);
 
 /**
@@ -447,83 +629,75 @@ String getFormattedTimeYMD() {
 
 
 // ---------------------------------------------------------------------------
-// EEPROM Layout & Session Struct
+// EEPROM Layout
 // ---------------------------------------------------------------------------
 //  - [0...31]   : WiFi SSID
 //  - [32..63]   : WiFi PASS
-//  - [64..67]   : uint32_t sessionCount
-//  - [68..end] : session data in blocks of 12 bytes each
+//  - [64..67]   : uint32_t sessionCount   (LEGACY, only read to migrate old sessions)
+//  - [68..end] : session data in blocks of 12 bytes each (LEGACY)
 //
-// Each session block:
+// Each legacy session block:
 //    Byte 0..3  : start time (Big-endian)
 //    Byte 4..7  : stop time  (Big-endian)
 //    Byte 8..11 : steps      (Big-endian)
-
-uint32_t getSessionCountFromEEPROM() {
-  uint32_t count = 0;
-  count |= (EEPROM.read(SESSIONS_START_INDEX + 0) << 24);
-  count |= (EEPROM.read(SESSIONS_START_INDEX + 1) << 16);
-  count |= (EEPROM.read(SESSIONS_START_INDEX + 2) << 8);
-  count |= EEPROM.read(SESSIONS_START_INDEX + 3);
-
-  if (count >= MAX_SESSIONS) {
-    count = 0;
-    Debug.println("DETECTED UNINITED EEPROM");
-  }
-
-  sessionsStored = count;
-  return count;
-}
-
-void setSessionCountInEEPROM(uint32_t count) {
-  sessionsStored = count;
-  EEPROM.write(SESSIONS_START_INDEX + 0, (count >> 24) & 0xFF);
-  EEPROM.write(SESSIONS_START_INDEX + 1, (count >> 16) & 0xFF);
-  EEPROM.write(SESSIONS_START_INDEX + 2, (count >> 8) & 0xFF);
-  EEPROM.write(SESSIONS_START_INDEX + 3, count & 0xFF);
-  EEPROM.commit();
-}
-
-TreadmillSession readSessionFromEEPROM(int index) {
-  TreadmillSession session;
-  int startAddress = SESSIONS_START_INDEX + 4 + (index * SESSION_SIZE_BYTES);
-
-  session.start = ((uint32_t)EEPROM.read(startAddress)     << 24) |
-                  ((uint32_t)EEPROM.read(startAddress + 1) << 16) |
-                  ((uint32_t)EEPROM.read(startAddress + 2) <<  8) |
-                   (uint32_t)EEPROM.read(startAddress + 3);
-
-  session.stop  = ((uint32_t)EEPROM.read(startAddress + 4) << 24) |
-                  ((uint32_t)EEPROM.read(startAddress + 5) << 16) |
-                  ((uint32_t)EEPROM.read(startAddress + 6) <<  8) |
-                   (uint32_t)EEPROM.read(startAddress + 7);
-
-  session.steps = ((uint32_t)EEPROM.read(startAddress + 8)  << 24) |
-                  ((uint32_t)EEPROM.read(startAddress + 9)  << 16) |
-                  ((uint32_t)EEPROM.read(startAddress + 10) <<  8) |
-                   (uint32_t)EEPROM.read(startAddress + 11);
-
-  return session;
+//
+// Sessions are now stored in the session journal (see SessionStore.h), firmware
+// before the journal existed stored them in the EEPROM layout above.
+
+uint32_t readLegacyUint32FromEEPROM(int address) {
+  return ((uint32_t)EEPROM.read(address)     << 24) |
+         ((uint32_t)EEPROM.read(address + 1) << 16) |
+         ((uint32_t)EEPROM.read(address + 2) <<  8) |
+          (uint32_t)EEPROM.read(address + 3);
 }
 
-void writeSessionToEEPROM(int index, TreadmillSession session) {
-  int startAddress = SESSIONS_START_INDEX + 4 + (index * SESSION_SIZE_BYTES);
+/**
+ * Moves sessions recorded by older firmware from the EEPROM into the session journal, then zeroes the
+ * legacy count so it only happens once. If an append fails the EEPROM is left alone and the next boot tries
+ * again, skipping the sessions that already made it into the journal (same start and stop).
+ */
+void migrateLegacyEepromSessions() {
+  uint32_t count = readLegacyUint32FromEEPROM(LEGACY_SESSIONS_START_INDEX);
+  if (count == 0 || count >= LEGACY_MAX_SESSIONS) {
+    return;
+  }
 
-  EEPROM.write(startAddress, (session.start >> 24) & 0xFF);
-  EEPROM.write(startAddress + 1, (session.start >> 16) & 0xFF);
-  EEPROM.write(startAddress + 2, (session.start >> 8) & 0xFF);
-  EEPROM.write(startAddress + 3, (session.start) & 0xFF);
+  TreadmillSession legacy[LEGACY_MAX_SESSIONS];
+  bool inJournal[LEGACY_MAX_SESSIONS] = { false };
+  for (uint32_t i = 0; i < count; i++) {
+    int startAddress = LEGACY_SESSIONS_START_INDEX + 4 + (i * LEGACY_SESSION_SIZE_BYTES);
+    legacy[i].start = readLegacyUint32FromEEPROM(startAddress);
+    legacy[i].stop  = readLegacyUint32FromEEPROM(startAddress + 4);
+    legacy[i].steps = readLegacyUint32FromEEPROM(startAddress + 8);
+  }
 
-  EEPROM.write(startAddress + 4, (session.stop >> 24) & 0xFF);
-  EEPROM.write(startAddress + 5, (session.stop >> 16) & 0xFF);
-  EEPROM.write(startAddress + 6, (session.stop >> 8) & 0xFF);
-  EEPROM.write(startAddress + 7, (session.stop) & 0xFF);
+  // One pass over the journal, it's empty unless an earlier migration was cut short.
+  uint32_t alreadyMigrated = 0;
+  for (uint32_t seq = sessionStore.oldestStoredSeq(); seq < sessionStore.nextSeq(); seq++) {
+    TreadmillSession stored;
+    if (!sessionStore.read(seq, stored)) {
+      continue;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      if (!inJournal[i] && legacy[i].start == stored.start && legacy[i].stop == stored.stop) {
+        inJournal[i] = true;
+        alreadyMigrated++;
+        break;
+      }
+    }
+  }
 
-  EEPROM.write(startAddress + 8, (session.steps >> 24) & 0xFF);
-  EEPROM.write(startAddress + 9, (session.steps >> 16) & 0xFF);
-  EEPROM.write(startAddress + 10, (session.steps >> 8) & 0xFF);
-  EEPROM.write(startAddress + 11, (session.steps) & 0xFF);
+  Debug.printf("Migrating %u session(s) from EEPROM into the session journal, %u already there...\n", count, alreadyMigrated);
+  for (uint32_t i = 0; i < count; i++) {
+    if (!inJournal[i] && !sessionStore.append(legacy[i])) {
+      Debug.println("ERROR: Migration failed, leaving legacy sessions in EEPROM.");
+      return;
+    }
+  }
 
+  for (int i = 0; i < 4; i++) {
+    EEPROM.write(LEGACY_SESSIONS_START_INDEX + i, 0);
+  }
   EEPROM.commit();
 }
 
@@ -543,43 +717,130 @@ void printSessionDetails(TreadmillSession s, int index) {
   Debug.printf("  Start: %s (Unix: %u)\n", startStr, s.start);
   Debug.printf("  Stop : %s (Unix: %u)\n", stopStr, s.stop);
   Debug.printf("  Steps: %u\n", s.steps);
+  Debug.printf("  Distance: %um, Calories: %u, Active: %us\n", s.distanceMeters, s.calories, s.activeSecs);
 }
 
-void printAllSessionsInEEPROM() {
-  uint32_t count = getSessionCountFromEEPROM();
-  uint32_t printCount = (count > MAX_SESSIONS) ? MAX_SESSIONS : count;
+void printAllStoredSessions() {
+  StorageLock lock(storageWriter);
+  uint32_t count = sessionStore.pendingCount();
 
-  Debug.printf("\n--- EEPROM Debug: Found %u session(s) stored ---\n", count);
-  if (count > MAX_SESSIONS) {
-    Debug.printf("Printing only the first %u session(s)...\n", MAX_SESSIONS);
+  Debug.printf("\n--- Session Journal: Found %u unsynced session(s), %u quarantined ---\n", count, sessionStore.quarantinedCount());
+  for (uint32_t i = 0; i < count; i++) {
+    TreadmillSession s;
+    if (sessionStore.readPending(i, s)) {
+      printSessionDetails(s, i);
+    }
   }
+  Debug.println("----------------------------------------------\n");
+}
 
-  for (uint32_t i = 0; i < printCount; i++) {
-    TreadmillSession s = readSessionFromEEPROM(i);
-    printSessionDetails(s, i);
+// ---------------------------------------------------------------------------
+// Storage writes, see StorageWriter
+// ---------------------------------------------------------------------------
+/**
+ * Runs a StorageOp, on the storage task (or inline if it couldn't be queued) with the storage lock held.
+ */
+bool executeStorageOp(StorageOp& op) {
+  switch (op.type) {
+    case StorageOp::RECORD_SESSION: {
+      // Update the totals of the day the session started on, even if the journal has no room left for the session.
+      const TreadmillSession& session = op.session;
+      if (session.start >= 100000) {
+        uint32_t activeSecs = session.activeSecs ? session.activeSecs : (session.stop - session.start);
+        dailyRollups.addSession(getLocalDayNumber(session.start), session.steps, activeSecs);
+      }
+      if (!sessionStore.append(session)) {
+        return false;
+      }
+      op.value = sessionStore.nextSeq() - 1;
+      return true;
+    }
+    case StorageOp::ACKNOWLEDGE:
+      return sessionStore.acknowledge(op.value);
+    case StorageOp::SAVE_CHECKPOINT:
+      return sessionCheckpoint.save(op.session, op.value);
+    case StorageOp::CLEAR_CHECKPOINT:
+      return sessionCheckpoint.clear();
+    #ifdef TELEMETRY_ENABLED
+      case StorageOp::TELEMETRY_START:
+        telemetryRecorder.startSeries(op.value);
+        return true;
+      case StorageOp::TELEMETRY_SAMPLE:
+        telemetryRecorder.sample(op.sample);
+        return true;
+      case StorageOp::TELEMETRY_FINISH:
+        telemetryRecorder.finishSeries();
+        return true;
+    #endif
+    default:
+      return false;
   }
-  Debug.println("----------------------------------------------\n");
 }
 
-void recordSessionToEEPROM(TreadmillSession session) {
-  uint32_t count = getSessionCountFromEEPROM();
-  if (count >= MAX_SESSIONS) {
-    Debug.println("EEPROM is full. Cannot store more sessions.");
-    return;
+/**
+ * Runs on the storage task whenever it has nothing queued. Folding replaces sessions the app may be downloading
+ * with a day summary, so never while the app may be syncing.
+ */
+bool storageIdleWork() {
+  if (isMobileAppConnected() || !sessionStore.compactStep()) {
+    return false;
   }
-  writeSessionToEEPROM(count, session);
-  setSessionCountInEEPROM(count + 1);
-  EEPROM.commit();
+  sessionsStored = sessionStore.pendingCount();
+  return true;
+}
+
+/**
+ * Hands an op to the storage task. Only if the task couldn't be started the op runs right here instead. A full
+ * queue drops it rather than waiting, the treadmill drivers end sessions from the NimBLE host task. Returns false
+ * if the op was dropped.
+ */
+bool submitStorageOp(StorageOp& op) {
+  if (storageWriter.submit(op)) {
+    return true;
+  }
+  if (storageWriter.isRunning()) {
+    return false;
+  }
+  StorageLock lock(storageWriter);
+  op.ok = executeStorageOp(op);
+  if (op.onDone) {
+    op.onDone(op);
+  }
+  return true;
+}
 
-  Debug.printf("Session stored at index=%u. Steps=%u\n", count, session.steps);
+bool submitStorageOp(StorageOp::Type type) {
+  StorageOp op(type);
+  return submitStorageOp(op);
+}
 
-  // Update today's steps total
-  String today = getFormattedDate();
-  if (lastRecordedDate != today) {
-    lastRecordedDate = today;
-    totalStepsToday = 0;
+void onStoredSessionsChanged(const StorageOp& op) {
+  sessionsStored = sessionStore.pendingCount();
+  if (op.type == StorageOp::RECORD_SESSION && op.ok) {
+    Debug.printf("Session stored, seq=%u. Steps=%u\n", op.value, op.session.steps);
   }
-  totalStepsToday += session.steps;
+}
+
+/**
+ * Marks every session up to seq as synced. The journal has one sync position for all phones: a session is
+ * synced once any phone has it. Phones with a cursor (format version 3) still get the sessions after their own
+ * cursor for as long as the journal keeps them, see SessionSync::start(), older apps only get what's unsynced.
+ */
+void acknowledgeSessions(uint32_t seq) {
+  StorageOp op(StorageOp::ACKNOWLEDGE);
+  op.value = seq;
+  op.onDone = onStoredSessionsChanged;
+  submitStorageOp(op);
+}
+
+/**
+ * Queues a finished session. Returns false if the storage queue was full, its checkpoint should then be kept.
+ */
+bool recordSession(TreadmillSession session) {
+  StorageOp op(StorageOp::RECORD_SESSION);
+  op.session = session;
+  op.onDone = onStoredSessionsChanged;
+  return submitStorageOp(op);
 }
 
 
@@ -620,63 +881,185 @@ void saveWiFiCredentials(const char* ssid, const char* password) {
 // ---------------------------------------------------------------------------
 // Today's steps
 // ---------------------------------------------------------------------------
-String getFormattedDate() {
-  time_t now = time(nullptr);
-  if (now < 100000) {
-    return "NTP";
-  }
-
-  // Set timezone to Pacific Time
-  setenv("TZ", "PST8PDT", 1);  // "PST8PDT" adjusts for daylight saving time
+/**
+ * Days since 1970-01-01 in local (Pacific) time.
+ */
+uint32_t getLocalDayNumber(time_t t) {
+  setenv("TZ", "PST8PDT", 1);
   tzset();
-
-  struct tm timeinfo;
-  localtime_r(&now, &timeinfo);
-  char buffer[11];  // "YYYY-MM-DD"
-  strftime(buffer, sizeof(buffer), "%Y-%m-%d", &timeinfo);
-  return String(buffer);
+  return DailyRollups::dayNumber(t);
 }
 
 unsigned long getTodaysSteps() {
-  String today = getFormattedDate();
-  if (wasTimeSet && lastRecordedDate != today) {
-    lastRecordedDate = today;
-    totalStepsToday = 0;
+  time_t now = time(nullptr);
+  unsigned long steps = 0;
+  static unsigned long lastStoredSteps = 0;
+  if (now >= 100000) {
+    // The display calls this, so don't wait for a flash write in progress, show what we had.
+    StorageLock lock(storageWriter, 0);
+    if (lock.locked()) {
+      lastStoredSteps = dailyRollups.get(getLocalDayNumber(now)).steps;
+    }
+    steps = lastStoredSteps;
   }
 
   if (gIsTreadmillActive) {
-    return totalStepsToday + gSteps;
+    return steps + gSteps;
   }
 
-  return totalStepsToday;
+  return steps;
 }
 
 // ---------------------------------------------------------------------------
 // Session Start/End
 // ---------------------------------------------------------------------------
+void closeOrphanedSession();
+void updateCurrentSessionTotals();
+
 void sessionStartedDetected() {
   Debug.printf("%s >> NEW SESSION Started!\n", getFormattedTimeHMS().c_str());
   gIsTreadmillActive = true;
   gCurrentSession.start = (uint32_t)time(nullptr);
+  wasSessionResumed = false;
+  lastCheckpointSteps = 0;
+
+  if (hasOrphanedSession) {
+    uint32_t now = gCurrentSession.start;
+    if (now >= 100000 && orphanedSession.start && now - orphanedSessionUpdated <= RESUME_WINDOW_SECS) {
+      Debug.printf("Resuming the session that was running before the reset (started %u)\n", orphanedSession.start);
+      gCurrentSession.start = orphanedSession.start;
+      resumedSession = orphanedSession;
+      wasSessionResumed = true;
+      hasOrphanedSession = false;
+    } else {
+      closeOrphanedSession();
+    }
+  }
+
+  #ifdef TELEMETRY_ENABLED
+    StorageOp op(StorageOp::TELEMETRY_START);
+    op.value = gCurrentSession.start;
+    submitStorageOp(op);
+  #endif
 }
 
 void sessionEndedDetected() {
   gIsTreadmillActive = false;
   gCurrentSession.stop = (uint32_t)time(nullptr);
-  gCurrentSession.steps = gSteps;
+
+  #ifdef TELEMETRY_ENABLED
+    submitStorageOp(StorageOp::TELEMETRY_FINISH);
+  #endif
+  updateCurrentSessionTotals();
 
   if (gCurrentSession.steps > 50000) {
     Debug.println("ERROR: Session steps too large, skipping save.");
+    submitStorageOp(StorageOp::CLEAR_CHECKPOINT);
     return;
   }
   if (!gCurrentSession.start) {
     Debug.println("ERROR: Session had no start time, skipping save.");
+    submitStorageOp(StorageOp::CLEAR_CHECKPOINT);
     return;
   }
 
   Debug.printf("<< NEW SESSION Ended!\n");
   printSessionDetails(gCurrentSession, sessionsStored);
-  recordSessionToEEPROM(gCurrentSession);
+  if (!recordSession(gCurrentSession)) {
+    // Keeps its checkpoint, and the loop records it as soon as there's room again.
+    Debug.println("Storage queue is full, the session is recorded later.");
+    orphanedSession = gCurrentSession;
+    orphanedSessionUpdated = 0;  // Not to be resumed
+    hasOrphanedSession = true;
+    return;
+  }
+  submitStorageOp(StorageOp::CLEAR_CHECKPOINT);
+}
+
+/**
+ * Copies the treadmill's counters into gCurrentSession. If the session was resumed after a reset and the
+ * treadmill restarted its counters meanwhile, what was walked before the reset is added back.
+ */
+void updateCurrentSessionTotals() {
+  gCurrentSession.steps = gSteps;
+  gCurrentSession.distanceMeters = gDistanceInMeters;
+  gCurrentSession.calories = gCalories;
+  gCurrentSession.activeSecs = gDurationInSecs;
+
+  if (wasSessionResumed && gCurrentSession.steps < resumedSession.steps) {
+    gCurrentSession.steps += resumedSession.steps;
+    gCurrentSession.distanceMeters += resumedSession.distanceMeters;
+    gCurrentSession.calories += resumedSession.calories;
+    gCurrentSession.activeSecs += resumedSession.activeSecs;
+  }
+}
+
+/**
+ * Saves the running session to the checkpoint area every CHECKPOINT_INTERVAL_MS or CHECKPOINT_STEPS steps.
+ */
+void checkpointRunningSession() {
+  static HasElapsed checkpointTimer(CHECKPOINT_INTERVAL_MS);
+  if (!gIsTreadmillActive) {
+    return;
+  }
+
+  updateCurrentSessionTotals();
+  if (checkpointTimer.isIntervalUp() || gCurrentSession.steps >= lastCheckpointSteps + CHECKPOINT_STEPS) {
+    checkpointTimer.runNextTimeIn(CHECKPOINT_INTERVAL_MS);
+    lastCheckpointSteps = gCurrentSession.steps;
+    StorageOp op(StorageOp::SAVE_CHECKPOINT);
+    op.session = gCurrentSession;
+    op.value = (uint32_t)time(nullptr);
+    submitStorageOp(op);
+  }
+}
+
+/**
+ * Records the session that was running when the device reset, ending it at its last checkpoint. If the storage
+ * queue is full it stays orphaned and handleOrphanedSession() tries again.
+ */
+void closeOrphanedSession() {
+  if (orphanedSession.start) {
+    if (!recordSession(orphanedSession)) {
+      return;
+    }
+    Debug.printf("<< Closed the orphaned session.\n");
+    printSessionDetails(orphanedSession, sessionsStored);
+  }
+  hasOrphanedSession = false;
+  submitStorageOp(StorageOp::CLEAR_CHECKPOINT);
+}
+
+/**
+ * Gives the treadmill RESUME_WINDOW_SECS after a reset to report the interrupted session is still going,
+ * after that it's closed.
+ */
+void handleOrphanedSession() {
+  if (!hasOrphanedSession || gIsTreadmillActive) {
+    return;
+  }
+  time_t now = time(nullptr);
+  bool expired = (now >= 100000 && (uint32_t)now - orphanedSessionUpdated > RESUME_WINDOW_SECS);
+  if (expired || millis() > RESUME_WINDOW_SECS * 1000UL) {
+    closeOrphanedSession();
+  }
+}
+
+void treadmillDataUpdated() {
+  #ifdef TELEMETRY_ENABLED
+    // The recorder keeps one sample per second, so only queue the first update of each second.
+    static uint32_t lastSampleTime = 0;
+    uint32_t now = (uint32_t)time(nullptr);
+    if (gIsTreadmillActive && now != lastSampleTime) {
+      lastSampleTime = now;
+      StorageOp op(StorageOp::TELEMETRY_SAMPLE);
+      op.sample.time = now;
+      op.sample.steps = gSteps;
+      op.sample.speed = (uint32_t)(gSpeedInKm * 100.0f + 0.5f);
+      op.sample.distance = gDistanceInMeters;
+      submitStorageOp(op);
+    }
+  #endif
 }
 
 // ---------------------------------------------------------------------------
@@ -694,7 +1077,7 @@ void simulateNewSession() {
   newSession.start = nowSec;
   newSession.stop = nowSec;
   newSession.steps = random(1, 51);
-  recordSessionToEEPROM(newSession);
+  recordSession(newSession);
 }
 
 // ---------------------------------------------------------------------------
@@ -729,7 +1112,7 @@ void updateLcd() {
 
 #if OMNI_CONSOLE_MODE
   if (pageStyle == 0) {
-    Debug.printf("Clearing LCD, consIsConn: %d, isMobAppConn: %d, isMobSubs:%\n", treadmillDevice->isConnected(), isMobileAppConnected, isMobileAppSubscribed);
+    Debug.printf("Clearing LCD, consIsConn: %d, isMobAppConn: %d, isMobSubs:%\n", treadmillDevice->isConnected(), isMobileAppConnected(), isMobileAppSubscribed());
     lcd.clear();  // Causes additional blocking i didn't want in the Serial mode.
   }
 #endif
@@ -737,8 +1120,8 @@ void updateLcd() {
   lcd.setCursor(0, 0);
   lcd.printf("TreadSpan %s ", FW_VERSION);
   lcdPrintBoolIndicator(treadmillDevice->isConnected());
-  lcdPrintBoolIndicator(isMobileAppConnected);
-  lcdPrintBoolIndicator(isMobileAppSubscribed);
+  lcdPrintBoolIndicator(isMobileAppConnected());
+  lcdPrintBoolIndicator(isMobileAppSubscribed());
 
   lcd.setCursor(0, 1);
   if (pageStyle < 2) {
@@ -1110,6 +1493,56 @@ void tftPeriodicMainLoopHandler() {
 }
 #endif
 
+// ---------------------------------------------------------------------------
+// BLE Link Tuning
+// ---------------------------------------------------------------------------
+void logLinkParameters(const char* event, NimBLEConnInfo& connInfo) {
+  Debug.printf(">> %s: interval %.2fms, latency %u, timeout %ums, MTU %u\n", event,
+               connInfo.getConnInterval() * 1.25f, connInfo.getConnLatency(), connInfo.getConnTimeout() * 10,
+               connInfo.getMTU());
+}
+
+/**
+ * Asks the phone for the short connection interval while data is moving, and for the power-saving one after.
+ * The phone has the final say, onConnParamsUpdate() logs what it picked.
+ */
+void setMobileAppLinkFast(MobileApp& app, bool fast) {
+  if (app.connHandle == BLE_HS_CONN_HANDLE_NONE || fast == app.isLinkFast) {
+    return;
+  }
+  app.isLinkFast = fast;
+  if (fast) {
+    pServer->updateConnParams(app.connHandle, BLE_FAST_INTERVAL_MIN, BLE_FAST_INTERVAL_MAX, BLE_FAST_LATENCY, BLE_FAST_TIMEOUT);
+  } else {
+    pServer->updateConnParams(app.connHandle, BLE_IDLE_INTERVAL_MIN, BLE_IDLE_INTERVAL_MAX, BLE_IDLE_LATENCY, BLE_IDLE_TIMEOUT);
+  }
+  Debug.printf(">> Requested the %s connection interval for connection %u\n", fast ? "fast" : "power-saving", app.connHandle);
+}
+
+/**
+ * Keeps each phone's link fast while a sync, daily history or telemetry transfer for it runs, and relaxes it
+ * BLE_RELAX_DELAY_MS after the last one finished.
+ */
+void tuneMobileAppLinks() {
+  for (MobileApp& app : mobileApps) {
+    if (app.connHandle == BLE_HS_CONN_HANDLE_NONE) {
+      continue;
+    }
+    bool busy = app.sync.isActive() || (historyReadPending && historyConnHandle == app.connHandle);
+    #ifdef TELEMETRY_ENABLED
+      busy = busy || (telemetryReadPending && telemetryConnHandle == app.connHandle);
+    #endif
+    #ifdef L2CAP_EXPORT_ENABLED
+      busy = busy || bulkExport.isRunning();  // The channel doesn't say which phone opened it
+    #endif
+    if (busy) {
+      app.lastBusy = millis();
+      setMobileAppLinkFast(app, true);
+    } else if (millis() - app.lastBusy > BLE_RELAX_DELAY_MS) {
+      setMobileAppLinkFast(app, false);
+    }
+  }
+}
 
 // ---------------------------------------------------------------------------
 // BLE Server Callbacks
@@ -1120,18 +1553,76 @@ class MyServerCallbacks : public NimBLEServerCallbacks {
    * There is an onSubscribe which is called when the mobile app subscribes to notifications on the data characteristic.
    */
   void onConnect(NimBLEServer* pServer, NimBLEConnInfo& connInfo) override {
-    isMobileAppConnected = true;
-    haveNotifiedMobileAppOfFirstSession = false;
-    Debug.println(">> Mobile app connected!");
+    uint16_t connHandle = connInfo.getConnHandle();
+    uint32_t count;
+    {
+      MobileAppsLock lock;
+      MobileApp* app = findMobileApp(BLE_HS_CONN_HANDLE_NONE);
+      if (!app) {
+        Debug.printf(">> Already serving %u phones, dropping connection %u\n", MAX_MOBILE_APPS, connHandle);
+        pServer->disconnect(connHandle);
+        return;
+      }
+      app->connHandle = connHandle;
+      app->isSubscribed = false;
+      app->haveNotifiedOfFirstSession = false;
+      app->isLiveMetricsSubscribed = false;
+      app->isLinkFast = true;  // The phone picked the interval, treat it as fast so an idle connection gets relaxed.
+      app->lastBusy = millis();
+      app->sync.reset();
+      app->sync.setMtu(connInfo.getMTU());
+      count = mobileAppCount();
+    }
+    Debug.printf(">> Mobile app connected! Connection %u, %u of %u phones\n", connHandle, count, MAX_MOBILE_APPS);
+    logLinkParameters("Connected", connInfo);
+
+    pServer->setDataLen(connHandle, BLE_DATA_LENGTH_OCTETS);
+    #if !defined(CONFIG_IDF_TARGET_ESP32)
+      // The original ESP32 is Bluetooth 4.2 and only has the 1M PHY.
+      pServer->updatePhy(connHandle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK, 0);
+    #endif
+
+    // Connecting stops advertising, keep it going so the next phone can find us.
+    if (count < MAX_MOBILE_APPS) {
+      NimBLEDevice::startAdvertising();
+    }
+  }
+
+  void onConnParamsUpdate(NimBLEConnInfo& connInfo) override {
+    logLinkParameters("Connection parameters updated", connInfo);
+  }
+
+  #if !defined(CONFIG_IDF_TARGET_ESP32)
+    void onPhyUpdate(NimBLEConnInfo& connInfo, uint8_t txPhy, uint8_t rxPhy) override {
+      Debug.printf(">> PHY is now tx %uM, rx %uM\n", txPhy, rxPhy);  // 1 = 1M, 2 = 2M, 3 = coded
+    }
+  #endif
+
+  void onMTUChange(uint16_t MTU, NimBLEConnInfo& connInfo) override {
+    MobileAppsLock lock;
+    MobileApp* app = findMobileApp(connInfo.getConnHandle());
+    if (app) {
+      app->sync.setMtu(MTU);
+      Debug.printf(">> MTU is now %u, %u session(s) per notification when batching\n", MTU, app->sync.batchCapacity());
+    }
   }
 
   void onDisconnect(NimBLEServer* pServer, NimBLEConnInfo& connInfo, int reason) override {
-    isMobileAppConnected = false;
-    isMobileAppSubscribed = false;
-    haveNotifiedMobileAppOfFirstSession = false;
-    Debug.println(F(">> Mobile app disconnected."));
-    delay(500);
-    pServer->startAdvertising();
+    {
+      MobileAppsLock lock;
+      MobileApp* app = findMobileApp(connInfo.getConnHandle());
+      if (!app) {
+        return;  // One we turned away
+      }
+      app->connHandle = BLE_HS_CONN_HANDLE_NONE;
+      app->isSubscribed = false;
+      app->isLiveMetricsSubscribed = false;
+      app->haveNotifiedOfFirstSession = false;
+      app->sync.reset();
+    }
+    Debug.printf(">> Mobile app on connection %u disconnected.\n", connInfo.getConnHandle());
+    // No delay here, it would hold up the host task and with it the other phones' syncs.
+    NimBLEDevice::startAdvertising();
     Debug.println(F(">> Advertising restarted..."));
   }
 };
@@ -1139,12 +1630,17 @@ class MyServerCallbacks : public NimBLEServerCallbacks {
 // Characteristic callbacks for the data characteristic
 class DataCharacteristicCallbacks : public NimBLECharacteristicCallbacks {
   void onSubscribe(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo, uint16_t subValue) override {
+    MobileAppsLock lock;
+    MobileApp* app = findMobileApp(connInfo.getConnHandle());
+    if (!app) {
+      return;
+    }
     if (subValue == 0) {
-      isMobileAppSubscribed = false;
-      Debug.println(" << Mobile app unsubscribed");
+      app->isSubscribed = false;
+      Debug.printf(" << Mobile app on connection %u unsubscribed\n", app->connHandle);
     } else {
-      isMobileAppSubscribed = true;
-      Debug.printf("  >> Mobile app SUBSCRIBED, %d\n", subValue);
+      app->isSubscribed = true;
+      Debug.printf("  >> Mobile app on connection %u SUBSCRIBED, %d\n", app->connHandle, subValue);
     }
   }
 
@@ -1165,32 +1661,90 @@ class DataCharacteristicCallbacks : public NimBLECharacteristicCallbacks {
      */
   void onStatus(NimBLECharacteristic* pCharacteristic, int code) override {
     Debug.printf("Notifi/Indi onStatus(), retc: %d, %s\n", code, NimBLEUtils::returnCodeToString(code));
+    if (code == BLE_HS_ENOMEM || code == BLE_HS_EBUSY) {
+      // The status doesn't say which connection, and the controller's buffers are shared anyway.
+      {
+        MobileAppsLock lock;
+        for (MobileApp& app : mobileApps) {
+          app.sync.onCongestion(millis());
+        }
+      }
+      liveMetrics.onCongestion(millis());  // The sync has priority, the dashboard can wait
+    }
   }
 };
 
 // ---------------------------------------------------------------------------
 // BLE Confirmation Characteristic Callback
 // ---------------------------------------------------------------------------
-void indicateNextSession();
+void indicateNextSession(MobileApp& app);
 
-// Callback for the confirmation characteristic
+// Callback for the confirmation characteristic. Driving the sync reads the session journal, which may have to
+// wait for an erase, so the write is handed to the loop.
 class ConfirmCallback : public NimBLECharacteristicCallbacks {
   void onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override {
     std::string rawValue = pCharacteristic->getValue();
-    String rxValue = String(rawValue.c_str());
 
     Debug.print("ConfirmCallback::onWrite got bytes: ");
-    for (int i = 0; i < rxValue.length(); i++) {
-      Debug.printf("%02X ", rxValue[i]);
+    for (size_t i = 0; i < rawValue.size(); i++) {
+      Debug.printf("%02X ", (uint8_t)rawValue[i]);
     }
     Debug.println();
 
-    if (rxValue.length() > 0 && rxValue[0] == 0x01) {
-      indicateNextSession();
+    AppWrite write;
+    write.connHandle = connInfo.getConnHandle();
+    write.len = (rawValue.size() < AppWrite::MAX_LEN) ? rawValue.size() : AppWrite::MAX_LEN;
+    memcpy(write.data, rawValue.data(), write.len);
+    if (!appWriteQueue || xQueueSend(appWriteQueue, &write, 0) != pdTRUE) {
+      Debug.printf("App write queue is full, write from connection %u dropped.\n", write.connHandle);
     }
   }
 };
 
+/**
+ * Handles the writes ConfirmCallback queued: the hello, confirms, acks and durable acks of the syncs.
+ */
+void handleAppWrites() {
+  AppWrite write;
+  while (appWriteQueue && xQueueReceive(appWriteQueue, &write, 0) == pdTRUE) {
+    StorageLock lock(storageWriter);
+    MobileAppsLock appsLock;
+    MobileApp* app = findMobileApp(write.connHandle);
+    if (!app || write.len == 0) {
+      continue;
+    }
+    const uint8_t* data = write.data;
+    size_t len = write.len;
+    if (len >= 2 && data[0] == SessionSync::HELLO) {
+      uint32_t durableSeq = app->sync.handleHello(data, len);
+      Debug.printf("App hello, format version %u, app has sessions up to %u\n", app->sync.version(), durableSeq);
+      if (durableSeq) {
+        acknowledgeSessions(durableSeq);
+      }
+      // Apps send the hello before subscribing. If the sync already started, start it over in the new format.
+      if (app->haveNotifiedOfFirstSession) {
+        app->sync.start();
+        indicateNextSession(*app);
+      }
+    } else if (len >= 5 && data[0] == SessionSync::DURABLE_ACK) {
+      uint32_t durableSeq = SessionSync::parseDurableAck(data, len);
+      Debug.printf("App stored sessions up to %u\n", durableSeq);
+      acknowledgeSessions(durableSeq);  // Synced for every phone, see acknowledgeSessions()
+      if (app->sync.handleDurableAck(durableSeq)) {
+        Debug.printf("Sync with connection %u complete\n", app->connHandle);
+      }
+    } else if (len >= 2 && data[0] == SessionSync::ACK) {
+      if (app->sync.handleAck(data, len)) {
+        indicateNextSession(*app);  // Refill the window right away
+      }
+    } else if (data[0] == SessionSync::CONFIRM) {
+      if (app->sync.handleConfirm()) {
+        indicateNextSession(*app);
+      }
+    }
+  }
+}
+
 // NEW: Callback for reading the current system time
 class TimeReadCallbacks : public NimBLECharacteristicCallbacks { // NEW
   void onRead(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override {
@@ -1225,49 +1779,355 @@ class TimeWriteCallbacks : public NimBLECharacteristicCallbacks {
 
 
 
+#ifdef TELEMETRY_ENABLED
+// Callback for the telemetry characteristic, the app writes the start time of a session (4 bytes, big-endian)
+// and gets that session's telemetry chunks as notifications.
+class TelemetryCallbacks : public NimBLECharacteristicCallbacks {
+  void onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override {
+    std::string rawValue = pCharacteristic->getValue();
+    if (rawValue.size() != 4) {
+      Debug.printf("Telemetry request has invalid length %d\n", rawValue.size());
+      return;
+    }
+    uint32_t key = ((uint8_t)rawValue[0] << 24) |
+                   ((uint8_t)rawValue[1] << 16) |
+                   ((uint8_t)rawValue[2] << 8)  |
+                   ((uint8_t)rawValue[3]);
+    Debug.printf("Telemetry requested for session starting at %u\n", key);
+    telemetryRequestKey = key;
+    telemetryRequestConnHandle = connInfo.getConnHandle();
+    telemetryRequestPending = true;
+  }
+};
+
+/**
+ * Sends the next chunk of a requested series, one per call so a long series doesn't hold up the loop.
+ * Each notification is [0x01][chunk] (see TelemetryCodec.h), a single 0xFF marks the end.
+ */
+void notifyNextTelemetryChunk() {
+  static HasElapsed notifyTimer(20);
+  if (telemetryRequestPending) {
+    telemetryRequestPending = false;
+    StorageLock lock(storageWriter);
+    telemetryRecorder.beginRead(telemetryRequestKey, telemetryReadCursor);
+    telemetryConnHandle = telemetryRequestConnHandle;
+    telemetryReadPending = true;
+  }
+  if (!telemetryReadPending || !notifyTimer.isIntervalUp()) {
+    return;
+  }
+  if (!findMobileApp(telemetryConnHandle)) {
+    telemetryReadPending = false;
+    return;
+  }
+
+  uint8_t payload[1 + TelemetryCodec::MAX_CHUNK_SIZE];
+  uint32_t len;
+  {
+    StorageLock lock(storageWriter);
+    len = telemetryRecorder.readNextChunk(telemetryReadCursor, payload + 1);
+  }
+  if (len == 0) {
+    payload[0] = 0xFF;
+    telemetryCharacteristic->notify(payload, 1, telemetryConnHandle);
+    telemetryReadPending = false;
+    Debug.println("Telemetry sent, set done marker.");
+    return;
+  }
+  payload[0] = 0x01;
+  telemetryCharacteristic->notify(payload, 1 + len, telemetryConnHandle);
+}
+#endif
+
+// Callback for the daily history characteristic, the app writes the first day it wants (days since 1970-01-01,
+// 4 bytes, big-endian) and gets the totals of every day since then that had sessions.
+class DailyHistoryCallbacks : public NimBLECharacteristicCallbacks {
+  void onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override {
+    std::string rawValue = pCharacteristic->getValue();
+    time_t now = time(nullptr);
+    if (rawValue.size() != 4 || now < 100000) {
+      Debug.printf("Daily history request ignored, length %d\n", rawValue.size());
+      return;
+    }
+    uint32_t fromDay = ((uint8_t)rawValue[0] << 24) |
+                       ((uint8_t)rawValue[1] << 16) |
+                       ((uint8_t)rawValue[2] << 8)  |
+                       ((uint8_t)rawValue[3]);
+    historyLastDay = getLocalDayNumber(now);
+    uint32_t oldestKept = historyLastDay - (DailyRollups::DAYS_KEPT - 1);
+    historyNextDay = (fromDay > oldestKept) ? fromDay : oldestKept;
+    Debug.printf("Daily history requested from day %u, sending %u..%u\n", fromDay, historyNextDay, historyLastDay);
+    historyConnHandle = connInfo.getConnHandle();
+    historyReadPending = true;
+  }
+};
+
+/**
+ * Sends the next batch of daily totals. Each notification is [0x01] followed by up to HISTORY_DAYS_PER_NOTIFY
+ * 14 byte big-endian records: day (4), steps (4), active seconds (4), sessions (2). A single 0xFF marks the end.
+ */
+void notifyNextDailyHistory() {
+  static const int HISTORY_DAYS_PER_NOTIFY = 12;
+  static const int HISTORY_RECORD_SIZE = 14;
+  static HasElapsed notifyTimer(20);
+  if (!historyReadPending || !notifyTimer.isIntervalUp()) {
+    return;
+  }
+  if (!findMobileApp(historyConnHandle)) {
+    historyReadPending = false;
+    return;
+  }
+
+  uint8_t payload[1 + HISTORY_DAYS_PER_NOTIFY * HISTORY_RECORD_SIZE];
+  int count = 0;
+  StorageLock lock(storageWriter);
+  while (count < HISTORY_DAYS_PER_NOTIFY && historyNextDay <= historyLastDay) {
+    DailyRollup rollup = dailyRollups.peek(historyNextDay++);
+    if (rollup.sessions == 0) {
+      continue;
+    }
+    uint8_t* p = payload + 1 + count * HISTORY_RECORD_SIZE;
+    uint32_t fields[3] = { rollup.day, rollup.steps, rollup.activeSecs };
+    for (int f = 0; f < 3; f++) {
+      p[f * 4 + 0] = (fields[f] >> 24) & 0xFF;
+      p[f * 4 + 1] = (fields[f] >> 16) & 0xFF;
+      p[f * 4 + 2] = (fields[f] >> 8) & 0xFF;
+      p[f * 4 + 3] = fields[f] & 0xFF;
+    }
+    p[12] = (rollup.sessions >> 8) & 0xFF;
+    p[13] = rollup.sessions & 0xFF;
+    count++;
+  }
+
+  if (count == 0) {
+    payload[0] = 0xFF;
+    dailyHistoryCharacteristic->notify(payload, 1, historyConnHandle);
+    historyReadPending = false;
+    Debug.println("Daily history sent, set done marker.");
+    return;
+  }
+  payload[0] = 0x01;
+  dailyHistoryCharacteristic->notify(payload, 1 + count * HISTORY_RECORD_SIZE, historyConnHandle);
+}
+
 // ---------------------------------------------------------------------------
 // Indicate (Notify) Next Session
 // ---------------------------------------------------------------------------
-void indicateNextSession() {
-  uint32_t totalSessions = getSessionCountFromEEPROM();
-  if (currentSessionIndex >= (int)totalSessions) {
-    setSessionCountInEEPROM(0);
-    EEPROM.commit();
-    currentSessionIndex = 0;
-    //haveNotifiedMobileAppOfFirstSession = false;
-
-    // Send a done marker
-    uint8_t donePayload[1] = { 0xFF };
-    dataCharacteristic->setValue(donePayload, 1);
-    dataCharacteristic->notify();
-    Debug.println("All sessions indicated, cleared/set done marker.");
+/**
+ * Notifies one phone, or with BLE_HS_CONN_HANDLE_NONE every phone that subscribed.
+ */
+class NotifyTransport : public SyncTransport {
+  public:
+    NotifyTransport(NimBLECharacteristic* characteristic, uint16_t connHandle = BLE_HS_CONN_HANDLE_NONE)
+      : mCharacteristic(characteristic), mConnHandle(connHandle) {}
+
+    bool send(const uint8_t* data, size_t len) override {
+      return mCharacteristic->notify(data, len, mConnHandle);
+    }
+
+  private:
+    NimBLECharacteristic* mCharacteristic;
+    uint16_t mConnHandle;
+};
+
+/**
+ * Sends the next session(s) and retransmits what's due, see SessionSync. Called after every confirm or ack
+ * and from the loop. Once the app has everything the done marker goes out and what was sent is marked as synced.
+ */
+void indicateNextSession(MobileApp& app) {
+  StorageLock lock(storageWriter);
+  MobileAppsLock appsLock;
+  if (app.connHandle == BLE_HS_CONN_HANDLE_NONE) {
+    return;  // Disconnected since
+  }
+  NotifyTransport transport(dataCharacteristic, app.connHandle);
+  uint32_t ackSeq = 0;
+  bool done = app.sync.pump(transport, millis(), ackSeq);
+  if (!done) {
     return;
   }
 
-  // Read next session from EEPROM
-  TreadmillSession s = readSessionFromEEPROM(currentSessionIndex);
-
-  // Prepare 12-byte packet in big-endian
-  uint8_t payload[12];
-  payload[0] = (s.start >> 24) & 0xFF;
-  payload[1] = (s.start >> 16) & 0xFF;
-  payload[2] = (s.start >> 8) & 0xFF;
-  payload[3] = s.start & 0xFF;
-  payload[4] = (s.stop >> 24) & 0xFF;
-  payload[5] = (s.stop >> 16) & 0xFF;
-  payload[6] = (s.stop >> 8) & 0xFF;
-  payload[7] = s.stop & 0xFF;
-  payload[8] = (s.steps >> 24) & 0xFF;
-  payload[9] = (s.steps >> 16) & 0xFF;
-  payload[10] = (s.steps >> 8) & 0xFF;
-  payload[11] = s.steps & 0xFF;
-
-  dataCharacteristic->setValue(payload, 12);
-  dataCharacteristic->notify();
-  Debug.printf(">> Notifying session %d\n", currentSessionIndex);
-  currentSessionIndex++;
+  // Anything recorded after the last session we sent stays pending for the next sync. Apps that ack durably
+  // do it themselves once the sessions are stored.
+  if (ackSeq) {
+    acknowledgeSessions(ackSeq);
+  }
+  Debug.printf("All sessions indicated to connection %u, set done marker.\n", app.connHandle);
 }
 
+// ---------------------------------------------------------------------------
+// Live Metrics
+// ---------------------------------------------------------------------------
+// Callback for the live metrics characteristic, see LiveMetricsNotifier for the format.
+class LiveMetricsCallbacks : public NimBLECharacteristicCallbacks {
+  void onSubscribe(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo, uint16_t subValue) override {
+    MobileAppsLock lock;
+    MobileApp* app = findMobileApp(connInfo.getConnHandle());
+    if (!app) {
+      return;
+    }
+    app->isLiveMetricsSubscribed = subValue != 0;
+    liveMetricsResetPending = liveMetricsResetPending || app->isLiveMetricsSubscribed;  // Send the current values right away
+    Debug.printf(">> Live metrics %s by connection %u\n", app->isLiveMetricsSubscribed ? "subscribed" : "unsubscribed", app->connHandle);
+  }
+
+  void onStatus(NimBLECharacteristic* pCharacteristic, int code) override {
+    if (code == BLE_HS_ENOMEM || code == BLE_HS_EBUSY) {
+      liveMetrics.onCongestion(millis());
+    }
+  }
+};
+
+/**
+ * Notifies the subscribed phones of the live values when they changed, at most every LIVE_METRICS_INTERVAL_MS.
+ */
+void notifyLiveMetrics() {
+  bool isSubscribed = false;
+  for (MobileApp& app : mobileApps) {
+    isSubscribed = isSubscribed || (app.connHandle != BLE_HS_CONN_HANDLE_NONE && app.isLiveMetricsSubscribed);
+  }
+  if (!isSubscribed) {
+    return;
+  }
+  if (liveMetricsResetPending) {
+    liveMetricsResetPending = false;
+    liveMetrics.reset();
+  }
+
+  LiveMetricsSnapshot snapshot;
+  snapshot.active = gIsTreadmillActive;
+  snapshot.steps = gSteps;
+  snapshot.speed = (uint16_t)(gSpeedInKm * 100.0f + 0.5f);
+  snapshot.distanceMeters = gDistanceInMeters;
+  snapshot.durationSecs = gDurationInSecs;
+  snapshot.calories = gCalories;
+  liveMetrics.update(snapshot);
+
+  NotifyTransport transport(liveMetricsCharacteristic);
+  liveMetrics.poll(transport, millis());
+}
+
+// ---------------------------------------------------------------------------
+// Advertised Status
+// ---------------------------------------------------------------------------
+#define ADVERTISED_STATUS_INTERVAL_MS 1000  // Changes show up in the advertising at most this often
+#define ADVERTISED_STATUS_COMPANY_ID 0xFFFF  // Bluetooth SIG's ID for tests and internal use, we don't have one
+#define ADVERTISED_STATUS_VERSION 1
+#define ADVERTISED_STATUS_ACTIVE 0x01
+#define ADVERTISED_STATUS_TIME_SET 0x02
+
+/**
+ * Puts the sync state and today's steps into the manufacturer data of the advertising, so the app can skip
+ * connecting when there's nothing to sync and anything nearby can show the steps without a connection:
+ *   [company id, little-endian][version << 4 | flags][pending sessions u16][today's steps u24]
+ * big-endian after the company ID, the counts saturate. With the 128 bit service UUID and the flags that's all
+ * 31 bytes of the advertising packet.
+ */
+void refreshAdvertisedStatus() {
+  static uint8_t advertised[8] = { 0 };
+  uint32_t pending = (sessionsStored > 0xFFFF) ? 0xFFFF : sessionsStored;
+  unsigned long steps = getTodaysSteps();
+  if (steps > 0xFFFFFF) {
+    steps = 0xFFFFFF;
+  }
+
+  uint8_t data[8];
+  data[0] = ADVERTISED_STATUS_COMPANY_ID & 0xFF;
+  data[1] = ADVERTISED_STATUS_COMPANY_ID >> 8;
+  data[2] = (ADVERTISED_STATUS_VERSION << 4) | (gIsTreadmillActive ? ADVERTISED_STATUS_ACTIVE : 0) |
+            (wasTimeSet ? ADVERTISED_STATUS_TIME_SET : 0);
+  data[3] = (pending >> 8) & 0xFF;
+  data[4] = pending & 0xFF;
+  data[5] = (steps >> 16) & 0xFF;
+  data[6] = (steps >> 8) & 0xFF;
+  data[7] = steps & 0xFF;
+  if (memcmp(data, advertised, sizeof(data)) == 0) {
+    return;
+  }
+  memcpy(advertised, data, sizeof(data));
+
+  NimBLEAdvertising* pAdvertising = NimBLEDevice::getAdvertising();
+  pAdvertising->setManufacturerData(data, sizeof(data));
+  pAdvertising->refreshAdvertisingData();  // Takes effect while advertising, otherwise with the next start
+}
+
+void advertisedStatusMainLoopHandler() {
+  static HasElapsed updateTimer(ADVERTISED_STATUS_INTERVAL_MS);
+  if (updateTimer.isIntervalUp()) {
+    refreshAdvertisedStatus();
+  }
+}
+
+// ---------------------------------------------------------------------------
+// L2CAP Bulk Export
+// ---------------------------------------------------------------------------
+#ifdef L2CAP_EXPORT_ENABLED
+// Callbacks of the export channel, see BulkExport for the request and the frames.
+class ExportChannelCallbacks : public NimBLEL2CAPChannelCallbacks {
+  void onConnect(NimBLEL2CAPChannel* channel, uint16_t negotiatedMTU) override {
+    Debug.printf(">> Export channel opened, MTU %u\n", negotiatedMTU);
+  }
+
+  void onRead(NimBLEL2CAPChannel* channel, std::vector<uint8_t>& data) override {
+    if (data.size() > sizeof(exportRequest)) {
+      Debug.printf("Export request has invalid length %d\n", data.size());
+      return;
+    }
+    memcpy(exportRequest, data.data(), data.size());
+    exportRequestLen = data.size();
+  }
+
+  void onDisconnect(NimBLEL2CAPChannel* channel) override {
+    exportCancelPending = true;
+    Debug.println(" << Export channel closed");
+  }
+};
+
+/**
+ * Writes the next frame of a requested export to the channel, one per call like the telemetry notifications.
+ * The channel's credits are the flow control, a frame it didn't take is written again on the next call.
+ */
+void sendNextExportFrame() {
+  static uint8_t frame[BulkExport::MAX_FRAME_SIZE];
+  static uint32_t frameLen = 0;
+
+  if (exportCancelPending) {
+    exportCancelPending = false;
+    bulkExport.cancel();
+    frameLen = 0;
+  }
+  if (exportRequestLen) {
+    StorageLock lock(storageWriter);
+    if (!bulkExport.handleRequest(exportRequest, exportRequestLen)) {
+      Debug.println("Export request ignored, it's malformed.");
+    }
+    exportRequestLen = 0;
+    frameLen = 0;
+  }
+  if (frameLen == 0) {
+    if (!bulkExport.isRunning()) {
+      return;
+    }
+    StorageLock lock(storageWriter);
+    frameLen = bulkExport.nextFrame(frame);
+    if (frameLen == 0) {
+      return;
+    }
+  }
+  if (!exportChannel->isConnected()) {
+    bulkExport.cancel();
+    frameLen = 0;
+    return;
+  }
+  if (exportChannel->write(std::vector<uint8_t>(frame, frame + frameLen))) {
+    frameLen = 0;
+    if (!bulkExport.isRunning()) {
+      Debug.println("Bulk export sent.");
+    }
+  }
+}
+#endif
+
 // ---------------------------------------------------------------------------
 // Setup
 // ---------------------------------------------------------------------------
@@ -1299,9 +2159,33 @@ void setup() {
     tftSetup();
   #endif
 
-  // Initialize EEPROM
+  // Initialize EEPROM (WiFi credentials) and the session journal
   EEPROM.begin(EEPROM_SIZE);
-  printAllSessionsInEEPROM();
+  dailyRollups.begin();
+  sessionStore.begin();
+  migrateLegacyEepromSessions();
+  #ifdef FOLD_OLD_SESSIONS_WHEN_FULL
+    sessionStore.setRetentionPolicy(SessionStore::RETENTION_FOLD_INTO_DAYS, getLocalDayNumber);
+  #endif
+  sessionsStored = sessionStore.pendingCount();
+  printAllStoredSessions();
+
+  sessionCheckpoint.begin();
+  hasOrphanedSession = sessionCheckpoint.getOrphan(orphanedSession, orphanedSessionUpdated);
+
+  #ifdef TELEMETRY_ENABLED
+    telemetryRecorder.begin();
+  #endif
+
+  // From here on flash writes go through the storage task.
+  storageWriter.begin(executeStorageOp, storageIdleWork);
+
+  // The NimBLE callbacks hand the phones' writes to the loop, see handleAppWrites().
+  mobileAppsMutex = xSemaphoreCreateRecursiveMutex();
+  appWriteQueue = xQueueCreate(APP_WRITE_QUEUE_DEPTH, sizeof(AppWrite));
+  if (!mobileAppsMutex || !appWriteQueue) {
+    Debug.println("ERROR: Not enough memory for the mobile app lock and write queue.");
+  }
 
   #ifdef GET_TIME_THROUGH_NTP
     // WiFi + NTP
@@ -1323,6 +2207,7 @@ void setup() {
 
   // Optional: Set transmission power
   NimBLEDevice::setPower(ESP_PWR_LVL_P9);
+  NimBLEDevice::setMTU(BLE_PREFERRED_MTU);
 
   pServer = NimBLEDevice::createServer();
   pServer->setCallbacks(new MyServerCallbacks());
@@ -1353,11 +2238,47 @@ void setup() {
   );
   timeWriteCharacteristic->setCallbacks(new TimeWriteCallbacks());
 
+  dailyHistoryCharacteristic = pService->createCharacteristic(
+    BLE_DAILY_HISTORY_CHAR_UUID,
+    NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::NOTIFY
+  );
+  dailyHistoryCharacteristic->setCallbacks(new DailyHistoryCallbacks());
+
+  liveMetricsCharacteristic = pService->createCharacteristic(
+    BLE_LIVE_METRICS_CHAR_UUID,
+    NIMBLE_PROPERTY::NOTIFY
+  );
+  liveMetricsCharacteristic->setCallbacks(new LiveMetricsCallbacks());
+
+  #ifdef L2CAP_EXPORT_ENABLED
+    exportChannel = NimBLEDevice::createL2CAPServer()->createService(L2CAP_EXPORT_PSM, L2CAP_EXPORT_MTU, new ExportChannelCallbacks());
+    uint8_t psm[2] = { L2CAP_EXPORT_PSM >> 8, L2CAP_EXPORT_PSM & 0xFF };
+    NimBLECharacteristic* exportPsmCharacteristic = pService->createCharacteristic(
+      BLE_EXPORT_PSM_CHAR_UUID,
+      NIMBLE_PROPERTY::READ
+    );
+    exportPsmCharacteristic->setValue(psm, sizeof(psm));
+  #endif
+
+  #ifdef TELEMETRY_ENABLED
+    telemetryCharacteristic = pService->createCharacteristic(
+      BLE_TELEMETRY_CHAR_UUID,
+      NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::NOTIFY
+    );
+    telemetryCharacteristic->setCallbacks(new TelemetryCallbacks());
+  #endif
+
   pService->start();
 
   // Start advertising (Peripheral)
   NimBLEAdvertising* pAdvertising = NimBLEDevice::getAdvertising();
   pAdvertising->addServiceUUID(BLE_SERVICE_UUID);
+  refreshAdvertisedStatus();
+  // The advertising packet is full, the name goes into the scan response.
+  NimBLEAdvertisementData scanResponse;
+  scanResponse.setName("TreadSpan");
+  pAdvertising->setScanResponseData(scanResponse);
+  pAdvertising->enableScanResponse(true);
   NimBLEDevice::startAdvertising();
   Debug.println("BLE Advertising started...");
 
@@ -1373,7 +2294,7 @@ void setup() {
   //   tsession.start = 1739826223;
   //   tsession.stop = 1739831820;
   //   tsession.steps = 4856;
-  //   recordSessionToEEPROM(tsession);
+  //   recordSession(tsession);
 }
 
 // ---------------------------------------------------------------------------
@@ -1424,19 +2345,47 @@ void loop() {
     // Clear sessions if CLEAR_PIN is LOW (do once)
     if (!clearedSessions && digitalRead(CLEAR_PIN) == LOW) {
       Debug.printf("CLEAR_PIN is LOW, clearing all sessions...\n");
-      setSessionCountInEEPROM(0);
-      EEPROM.commit();
+      acknowledgeSessions(UINT32_MAX);  // Everything, acknowledge() stops at the newest session
       clearedSessions = true;
     }
   #endif
 
-  if (isMobileAppConnected && isMobileAppSubscribed && !haveNotifiedMobileAppOfFirstSession) {
-    haveNotifiedMobileAppOfFirstSession = true;
-    currentSessionIndex = 0;
-    Debug.printf("Mobile App subscribed, sending first session...\n");
-    indicateNextSession();
+  handleAppWrites();
+  for (MobileApp& app : mobileApps) {
+    if (app.connHandle != BLE_HS_CONN_HANDLE_NONE && app.isSubscribed && !app.haveNotifiedOfFirstSession) {
+      {
+        StorageLock lock(storageWriter);
+        MobileAppsLock appsLock;
+        app.haveNotifiedOfFirstSession = true;
+        app.sync.start();
+      }
+      Debug.printf("Mobile App on connection %u subscribed, sending first session...\n", app.connHandle);
+      indicateNextSession(app);
+    }
+
+    // Windowed syncs keep sending without waiting for a write from the app, and every sync retransmits from here.
+    if (app.sync.isActive()) {
+      indicateNextSession(app);
+    }
   }
 
+  checkpointRunningSession();
+  handleOrphanedSession();
+  storageWriter.dispatchCompletions();
+
+  notifyNextDailyHistory();
+  notifyLiveMetrics();
+  advertisedStatusMainLoopHandler();
+  tuneMobileAppLinks();
+
+  #ifdef TELEMETRY_ENABLED
+    notifyNextTelemetryChunk();
+  #endif
+
+  #ifdef L2CAP_EXPORT_ENABLED
+    sendNextExportFrame();
+  #endif
+
   treadmillDevice->loopHandler();
 
   delay(1);
@@ -243,6 +243,22 @@ class BLEViewModel: NSObject, ObservableObject {
     // Temporary storage for fetched sessions
     private var fetchedSessions: [Session] = []
 
+    // Windowed sync: every batch up to ackedBatchSeq arrived, plus the ones in batchesAhead
+    private var ackedBatchSeq: UInt8 = 0
+    private var batchesAhead = Set<UInt8>()
+
+    // Format version 3: the journal seq the device's done marker covered, acked durably once HealthKit has the
+    // sessions. The last one acked is kept per device and sent with the next hello.
+    private var syncThroughSeq: UInt32?
+    private var isAwaitingDurableAck = false
+    private var isWritingDurableAck = false
+
+    // Names this sync to the device, so a sync cut off by a disconnect resumes where it stopped. Sessions can
+    // arrive twice across a reconnect, and out of order when a lost batch is retransmitted after later ones, so
+    // the journal seqs already in fetchedSessions are kept.
+    private var syncToken: UInt32 = 0
+    private var fetchedSessionSeqs = Set<UInt32>()
+
     // HealthKit
     private let healthStore = HKHealthStore()
     private let stepType = HKObjectType.quantityType(forIdentifier: .stepCount)!
@@ -272,6 +288,13 @@ class BLEViewModel: NSObject, ObservableObject {
         statusMessage = "Scanning for TreadSpan Chip..."
         fetchedSessions.removeAll()
         sessions.removeAll()
+        ackedBatchSeq = 0
+        batchesAhead.removeAll()
+        syncThroughSeq = nil
+        isAwaitingDurableAck = false
+        isWritingDurableAck = false
+        syncToken = UInt32.random(in: 1...UInt32.max)
+        fetchedSessionSeqs.removeAll()
         didDiscoverDevice = false
 
         centralManager.scanForPeripherals(withServices: [serviceUUID], options: nil)
@@ -303,6 +326,142 @@ class BLEViewModel: NSObject, ObservableObject {
         print("Parsed session: Start=\(start), Stop=\(stop), Steps=\(steps)")
     }
 
+    // Batched packets: [0xB1][version][count] followed by count 12-byte sessions. Version 2 adds a batch
+    // sequence number after the count and is acked instead of confirmed, version 3 prefixes every session
+    // with its 4-byte journal seq.
+    private func processSessionBatch(_ data: Data) {
+        let version = data[data.startIndex + 1]
+        let count = Int(data[data.startIndex + 2])
+        let headerSize = (version >= 2) ? 4 : 3
+        let recordSize = (version >= 3) ? 16 : 12
+        guard data.count == headerSize + count * recordSize else {
+            print("Invalid batch length \(data.count) for \(count) sessions.")
+            return
+        }
+
+        if version >= 2 {
+            // Retransmissions of batches we already have are only acked again
+            let seq = data[data.startIndex + 3]
+            let ahead = seq &- ackedBatchSeq
+            guard ahead >= 1 && ahead < 128 && !batchesAhead.contains(seq) else {
+                ackBatches()
+                return
+            }
+            batchesAhead.insert(seq)
+        }
+
+        for i in 0..<count {
+            let record = data.startIndex + headerSize + i * recordSize
+            if version >= 3 {
+                let sessionSeq = data.subdata(in: record..<(record + 4)).withUnsafeBytes { $0.load(as: UInt32.self).bigEndian }
+                guard fetchedSessionSeqs.insert(sessionSeq).inserted else { continue }
+            }
+            let offset = record + (recordSize - 12)
+            processSessionPacket(data.subdata(in: offset..<(offset + 12)))
+        }
+
+        // Only acked once every session of it is in fetchedSessions
+        if version >= 2 {
+            ackBatches()
+        } else {
+            confirmSession()
+        }
+    }
+
+    // Acks windowed batches: [0x03][every batch up to this seq][bit i: batch seq + 1 + i arrived too]
+    private func ackBatches() {
+        guard let confirmChar = confirmCharacteristic,
+              let peripheral = peripheral else {
+            return
+        }
+        while batchesAhead.contains(ackedBatchSeq &+ 1) {
+            ackedBatchSeq = ackedBatchSeq &+ 1
+            batchesAhead.remove(ackedBatchSeq)
+        }
+        var bitmap: UInt8 = 0
+        for i in 0..<8 where batchesAhead.contains(ackedBatchSeq &+ 1 &+ UInt8(i)) {
+            bitmap |= 1 << i
+        }
+        peripheral.writeValue(Data([0x03, ackedBatchSeq, bitmap]), for: confirmChar, type: .withResponse)
+    }
+
+    // Asks the device for batched session packets, must go out before subscribing to the data characteristic.
+    // Devices with older firmware ignore it and keep sending one session per notification.
+    private func sendSyncHello() {
+        guard let confirmChar = confirmCharacteristic,
+              let peripheral = peripheral else {
+            return
+        }
+        let cursor = syncCursor(for: peripheral)
+        var hello = Data([0x02, 0x03])
+        hello.append(contentsOf: bigEndianBytes(cursor))
+        hello.append(contentsOf: bigEndianBytes(syncToken))
+        peripheral.writeValue(hello, for: confirmChar, type: .withResponse)
+        print("Wrote sync hello, batch format version 3, have sessions up to \(cursor).")
+    }
+
+    private func syncCursorKey(for peripheral: CBPeripheral) -> String {
+        return "syncCursor-\(peripheral.identifier.uuidString)"
+    }
+
+    private func syncCursor(for peripheral: CBPeripheral) -> UInt32 {
+        return UInt32(UserDefaults.standard.integer(forKey: syncCursorKey(for: peripheral)))
+    }
+
+    // Manufacturer data of the advertising, see refreshAdvertisedStatus() in the firmware:
+    // [0xFFFF company id][version << 4 | flags][pending sessions u16][today's steps u24]
+    private struct AdvertisedStatus {
+        let isActive: Bool
+        let isTimeSet: Bool
+        let pendingSessions: Int
+        let todaysSteps: Int
+    }
+
+    private func advertisedStatus(_ advertisementData: [String: Any]) -> AdvertisedStatus? {
+        guard let data = advertisementData[CBAdvertisementDataManufacturerDataKey] as? Data, data.count >= 8 else {
+            return nil  // Older firmware
+        }
+        let bytes = [UInt8](data)
+        guard bytes[0] == 0xFF, bytes[1] == 0xFF, bytes[2] >> 4 == 1 else {
+            return nil
+        }
+        return AdvertisedStatus(isActive: bytes[2] & 0x01 != 0,
+                                isTimeSet: bytes[2] & 0x02 != 0,
+                                pendingSessions: Int(bytes[3]) << 8 | Int(bytes[4]),
+                                todaysSteps: Int(bytes[5]) << 16 | Int(bytes[6]) << 8 | Int(bytes[7]))
+    }
+
+    private func bigEndianBytes(_ value: UInt32) -> [UInt8] {
+        return [UInt8(value >> 24 & 0xFF), UInt8(value >> 16 & 0xFF), UInt8(value >> 8 & 0xFF), UInt8(value & 0xFF)]
+    }
+
+    // Called once the sessions of a sync are in HealthKit, or saving them failed. Only then may the device
+    // let go of them: [0x04][seq] acks everything up to seq durably. Without it they're sent again next time.
+    private func completeSync(savedAll: Bool) {
+        guard isAwaitingDurableAck else { return }
+        isAwaitingDurableAck = false
+
+        guard savedAll, let seq = syncThroughSeq,
+              let confirmChar = confirmCharacteristic,
+              let peripheral = peripheral else {
+            disconnect()
+            return
+        }
+        UserDefaults.standard.set(Int(seq), forKey: syncCursorKey(for: peripheral))
+        var ack = Data([0x04])
+        ack.append(contentsOf: bigEndianBytes(seq))
+        isWritingDurableAck = true
+        peripheral.writeValue(ack, for: confirmChar, type: .withResponse)
+        print("Acked sessions up to \(seq) durably.")
+        // Disconnects once the write went out, see didWriteValueFor
+    }
+
+    private func disconnect() {
+        if let peripheral = peripheral {
+            centralManager.cancelPeripheralConnection(peripheral)
+        }
+    }
+
     private func confirmSession() {
         guard let confirmChar = confirmCharacteristic,
               let peripheral = peripheral else {
@@ -316,21 +475,30 @@ class BLEViewModel: NSObject, ObservableObject {
     }
 
     private func handleDoneMarker() {
+        // Devices with format version 3 resend the marker until the durable ack arrives
+        guard !didReceiveStopMarker else { return }
         didReceiveStopMarker = true
         isFetching = false
+        // Devices with format version 3 wait for a durable ack, so stay connected until HealthKit has the sessions
+        isAwaitingDurableAck = (syncThroughSeq != nil)
+        if isAwaitingDurableAck {
+            DispatchQueue.main.asyncAfter(deadline: .now() + 30) { [weak self] in
+                self?.completeSync(savedAll: false)
+            }
+        }
 
         if fetchedSessions.isEmpty {
             statusMessage = "No Sessions to Sync."
+            completeSync(savedAll: true)
         } else {
             statusMessage = "All sessions retrieved."
             // Automatically push to HealthKit since we have sessions
             saveToHealthKit()
         }
 
+        guard !isAwaitingDurableAck && !isWritingDurableAck else { return }
         print("Done marker received from peripheral. Disconnecting...")
-        if let peripheral = peripheral {
-            centralManager.cancelPeripheralConnection(peripheral)
-        }
+        disconnect()
     }
 
     // MARK: - HealthKit
@@ -339,6 +507,7 @@ class BLEViewModel: NSObject, ObservableObject {
         guard HKHealthStore.isHealthDataAvailable() else {
             print("Health data not available on this device.")
             healthKitSyncStatusMessage = "Health data not available."
+            completeSync(savedAll: false)
             return
         }
 
@@ -354,6 +523,7 @@ class BLEViewModel: NSObject, ObservableObject {
                     print("Error checking HK authorization status: \(error.localizedDescription)")
                     DispatchQueue.main.async {
                         self.healthKitSyncStatusMessage = "HealthKit authorization error."
+                        self.completeSync(savedAll: false)
                     }
                     return
                 }
@@ -386,6 +556,7 @@ class BLEViewModel: NSObject, ObservableObject {
                 print("HK authorization error: \(error.localizedDescription)")
                 DispatchQueue.main.async {
                     self.healthKitSyncStatusMessage = "HealthKit authorization error."
+                    self.completeSync(savedAll: false)
                 }
                 return
             }
@@ -393,6 +564,7 @@ class BLEViewModel: NSObject, ObservableObject {
                 print("User did not grant HealthKit authorization.")
                 DispatchQueue.main.async {
                     self.healthKitSyncStatusMessage = "HealthKit authorization denied."
+                    self.completeSync(savedAll: false)
                 }
                 return
             }
@@ -405,6 +577,7 @@ class BLEViewModel: NSObject, ObservableObject {
             print("No sessions to save.")
             DispatchQueue.main.async {
                 self.healthKitSyncStatusMessage = "No sessions to save."
+                self.completeSync(savedAll: false)
             }
             return
         }
@@ -443,6 +616,7 @@ class BLEViewModel: NSObject, ObservableObject {
             } else {
                 self.healthKitSyncStatusMessage = "Some sessions failed to sync."
             }
+            self.completeSync(savedAll: successCount == self.sessions.count)
             // 3) Once sessions are saved, fetch stride-length data:
             //self.fetchAndPrintStrideLengths()
             self.fetchTodayTotalSteps()
@@ -527,6 +701,14 @@ extension BLEViewModel: CBCentralManagerDelegate {
         didDiscoverDevice = true
         centralManager.stopScan()
 
+        // Nothing to sync and the clock is set, no need to connect
+        if let status = advertisedStatus(advertisementData), status.pendingSessions == 0, status.isTimeSet {
+            print("Device advertises no pending sessions, \(status.todaysSteps) steps today. Not connecting.")
+            isFetching = false
+            statusMessage = "No Sessions to Sync."
+            return
+        }
+
         self.peripheral = peripheral
         self.peripheral?.delegate = self
         centralManager.connect(peripheral, options: nil)
@@ -555,6 +737,17 @@ extension BLEViewModel: CBCentralManagerDelegate {
                         didDisconnectPeripheral peripheral: CBPeripheral,
                         error: Error?) {
         print("Disconnected: \(error?.localizedDescription ?? "no error")")
+
+        // Cut off mid-sync: keep what we got and reconnect. The connect doesn't time out, it completes whenever
+        // the device is in range again, and the device resumes the sync after what we acked.
+        if isFetching && !didReceiveStopMarker {
+            ackedBatchSeq = 0
+            batchesAhead.removeAll()
+            statusMessage = "Connection lost, the sync resumes when the device is back in range..."
+            central.connect(peripheral, options: nil)
+            return
+        }
+
         self.peripheral = nil
         isFetching = false
 
@@ -658,6 +851,7 @@ extension BLEViewModel: CBPeripheralDelegate {
 
             // Now subscribe to the data characteristic after reading the time
             if let dataChar = dataCharacteristic {
+                sendSyncHello()
                 peripheral.setNotifyValue(true, for: dataChar)
                 statusMessage = "Fetching sessions..."
                 print("Data characteristic found. Enabling notifications/indications.")
@@ -668,6 +862,14 @@ extension BLEViewModel: CBPeripheralDelegate {
         if characteristic.uuid == dataCharUUID {
             if value.count == 1 && value[0] == 0xFF {
                 handleDoneMarker()
+            } else if value.count == 5 && value[0] == 0xFF {
+                guard !didReceiveStopMarker else { return }
+                syncThroughSeq = value.subdata(in: 1..<5).withUnsafeBytes { $0.load(as: UInt32.self).bigEndian }
+                handleDoneMarker()
+            } else if value.count >= 3 && value[0] == 0xB1 {
+                print("Received session batch: \(value.map { String(format: "%02X", $0) }.joined())")
+                processSessionBatch(value)
+                statusMessage = "Sessions acknowledged, waiting for next..."
             } else if value.count == 12 {
                 print("Received indicated data: \(value.map { String(format: "%02X", $0) }.joined())")
                 processSessionPacket(value)
@@ -687,5 +889,9 @@ extension BLEViewModel: CBPeripheralDelegate {
         } else {
             print("Successfully wrote to \(characteristic.uuid)")
         }
+        if characteristic.uuid == confirmCharUUID && isWritingDurableAck {
+            isWritingDurableAck = false
+            disconnect()
+        }
     }
 }